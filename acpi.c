@@ -0,0 +1,242 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "acpi.h"
+#include "klog.h"
+#include "str.h"
+#include "vmm.h"
+
+/* Length of the part of the RSDP covered by the first checksum */
+#define ACPI_RSDP_V1_SIZE 20
+
+static const acpi_sdt_header_t *acpi_root; /* the RSDT or XSDT */
+static bool acpi_root_is_xsdt;
+
+static acpi_madt_info_t acpi_madt;
+static bool acpi_have_madt;
+
+/** acpi_checksum:
+ *  Checks that the bytes of an ACPI structure sum to 0
+ *
+ */
+static bool acpi_checksum(const void *data, size_t size) {
+  const uint8_t *bytes = data;
+  uint8_t sum = 0;
+  for (size_t i = 0; i < size; i++) {
+    sum += bytes[i];
+  }
+  return sum == 0;
+}
+
+/** acpi_map:
+ *  Returns a pointer to firmware memory, through the direct map when it is
+ *  covered by it and otherwise through a new cached MMIO window mapping
+ *
+ *  @return The virtual address, NULL if it couldn't be mapped
+ */
+static const void *acpi_map(uint64_t phys, size_t size) {
+  if (phys < VMM_DIRECT_MAP_SIZE && size <= VMM_DIRECT_MAP_SIZE - phys) {
+    return phys_to_virt(phys);
+  }
+  if (phys > UINT32_MAX || size > UINT32_MAX - phys) {
+    return NULL;
+  }
+  return vmm_map_mmio(phys, size, VMM_CACHE_WRITE_BACK);
+}
+
+/** acpi_map_table:
+ *  Maps a system description table if its signature matches and it passes
+ *  its checksum
+ *
+ *  @param phys The physical address of the table
+ *  @param signature The expected signature, or NULL to take any table
+ *  @return The table, NULL if it doesn't match or is corrupt
+ */
+static const acpi_sdt_header_t *acpi_map_table(uint64_t phys,
+                                               const char *signature) {
+  const acpi_sdt_header_t *header = acpi_map(phys, sizeof(*header));
+  if (header == NULL ||
+      (signature != NULL && memcmp(header->signature, signature, 4) != 0)) {
+    return NULL;
+  }
+
+  uint32_t length = header->length;
+  if (length < sizeof(*header)) {
+    return NULL;
+  }
+  header = acpi_map(phys, length);
+  if (header == NULL || !acpi_checksum(header, length)) {
+    return NULL;
+  }
+  return header;
+}
+
+/** acpi_scan_rsdp:
+ *  Looks for the root system description pointer in a range of physical
+ *  memory
+ *
+ *  @return The RSDP, NULL if the range doesn't hold a valid one
+ */
+static const acpi_rsdp_t *acpi_scan_rsdp(uint32_t start, uint32_t end) {
+  for (uint32_t phys = start; phys + sizeof(acpi_rsdp_t) <= end;
+       phys += ACPI_RSDP_ALIGN) {
+    const acpi_rsdp_t *rsdp = phys_to_virt(phys);
+    if (memcmp(rsdp->signature, "RSD PTR ", 8) == 0 &&
+        acpi_checksum(rsdp, ACPI_RSDP_V1_SIZE)) {
+      return rsdp;
+    }
+  }
+  return NULL;
+}
+
+/** acpi_parse_madt:
+ *  Records the processors, I/O APICs and ISA IRQ routing from the multiple
+ *  APIC description table
+ *
+ */
+static void acpi_parse_madt(const acpi_madt_t *madt) {
+  acpi_madt_info_t *info = &acpi_madt;
+
+  info->local_apic_address = madt->local_apic_address;
+  info->pcat_compat = madt->flags & ACPI_MADT_PCAT_COMPAT;
+  for (uint32_t irq = 0; irq < ACPI_LEGACY_IRQS; irq++) {
+    info->irqs[irq] = (acpi_irq_route_t){.gsi = irq, .flags = 0};
+  }
+
+  const uint8_t *next = (const uint8_t *)(madt + 1);
+  const uint8_t *end = (const uint8_t *)madt + madt->header.length;
+  while (next + sizeof(acpi_madt_entry_t) <= end) {
+    const acpi_madt_entry_t *entry = (const acpi_madt_entry_t *)next;
+    if (entry->length < sizeof(*entry) || next + entry->length > end) {
+      break;
+    }
+    next += entry->length;
+
+    if (entry->type == ACPI_MADT_LOCAL_APIC) {
+      const struct acpi_madt_local_apic *cpu = (const void *)entry;
+      if ((cpu->flags & ACPI_MADT_CPU_ENABLED) &&
+          info->cpu_count < ACPI_MAX_CPUS) {
+        info->cpus[info->cpu_count++] = (acpi_cpu_t){
+            .apic_id = cpu->apic_id, .processor_id = cpu->processor_id};
+      }
+    } else if (entry->type == ACPI_MADT_LOCAL_X2APIC) {
+      const struct acpi_madt_local_x2apic *cpu = (const void *)entry;
+      if ((cpu->flags & ACPI_MADT_CPU_ENABLED) &&
+          info->cpu_count < ACPI_MAX_CPUS) {
+        info->cpus[info->cpu_count++] = (acpi_cpu_t){
+            .apic_id = cpu->x2apic_id, .processor_id = cpu->processor_uid};
+      }
+    } else if (entry->type == ACPI_MADT_IO_APIC) {
+      const struct acpi_madt_io_apic *io_apic = (const void *)entry;
+      if (info->io_apic_count < ACPI_MAX_IO_APICS) {
+        info->io_apics[info->io_apic_count++] =
+            (acpi_io_apic_t){.id = io_apic->id,
+                             .address = io_apic->address,
+                             .gsi_base = io_apic->gsi_base};
+      }
+    } else if (entry->type == ACPI_MADT_INTERRUPT_OVERRIDE) {
+      const struct acpi_madt_interrupt_override *override = (const void *)entry;
+      if (override->bus == 0 && override->source < ACPI_LEGACY_IRQS) {
+        info->irqs[override->source] =
+            (acpi_irq_route_t){.gsi = override->gsi, .flags = override->flags};
+      }
+    } else if (entry->type == ACPI_MADT_LOCAL_APIC_NMI) {
+      const struct acpi_madt_local_apic_nmi *nmi = (const void *)entry;
+      if (!info->have_nmi) {
+        info->have_nmi = true;
+        info->nmi_lint = nmi->lint;
+        info->nmi_flags = nmi->flags;
+      }
+    } else if (entry->type == ACPI_MADT_LOCAL_APIC_OVERRIDE) {
+      const struct acpi_madt_local_apic_override *override =
+          (const void *)entry;
+      if (override->address <= UINT32_MAX) {
+        info->local_apic_address = override->address;
+      }
+    }
+  }
+
+  acpi_have_madt = true;
+}
+
+/** acpi_initialize:
+ *  Finds the ACPI tables through the RSDP and parses the MADT
+ *
+ *  @return false if the firmware provides no valid ACPI tables
+ */
+bool acpi_initialize(void) {
+  const acpi_rsdp_t *rsdp = NULL;
+  uint32_t ebda = (uint32_t)*(const uint16_t *)phys_to_virt(ACPI_EBDA_POINTER)
+                  << 4;
+  if (ebda != 0 && ebda < ACPI_BIOS_AREA_START) {
+    rsdp = acpi_scan_rsdp(ebda, ebda + ACPI_EBDA_SEARCH_SIZE);
+  }
+  if (rsdp == NULL) {
+    rsdp = acpi_scan_rsdp(ACPI_BIOS_AREA_START, ACPI_BIOS_AREA_END);
+  }
+  if (rsdp == NULL) {
+    klog(KLOG_WARNING, "acpi: no rsdp found");
+    return false;
+  }
+
+  if (rsdp->revision >= 2 && rsdp->xsdt_address != 0 &&
+      acpi_checksum(rsdp, rsdp->length)) {
+    acpi_root = acpi_map_table(rsdp->xsdt_address, "XSDT");
+    acpi_root_is_xsdt = acpi_root != NULL;
+  }
+  if (acpi_root == NULL) {
+    acpi_root = acpi_map_table(rsdp->rsdt_address, "RSDT");
+  }
+  if (acpi_root == NULL) {
+    klog(KLOG_WARNING, "acpi: no valid rsdt");
+    return false;
+  }
+
+  const acpi_madt_t *madt = (const acpi_madt_t *)acpi_find_table("APIC");
+  if (madt != NULL && madt->header.length >= sizeof(*madt)) {
+    acpi_parse_madt(madt);
+  }
+
+  klog(KLOG_INFO, "acpi: %s at %08x, %u cpus, %u io apics",
+       acpi_root_is_xsdt ? "xsdt" : "rsdt", (unsigned int)virt_to_phys(rsdp),
+       (unsigned int)acpi_madt.cpu_count,
+       (unsigned int)acpi_madt.io_apic_count);
+  return true;
+}
+
+/** acpi_find_table:
+ *  Looks up a system description table by its signature
+ *
+ *  @param signature The four character signature, e.g. "APIC"
+ *  @return The first valid table with the signature, NULL if there is none
+ */
+const acpi_sdt_header_t *acpi_find_table(const char *signature) {
+  if (acpi_root == NULL) {
+    return NULL;
+  }
+
+  size_t entry_size = acpi_root_is_xsdt ? sizeof(uint64_t) : sizeof(uint32_t);
+  size_t count = (acpi_root->length - sizeof(*acpi_root)) / entry_size;
+  const uint8_t *entries = (const uint8_t *)(acpi_root + 1);
+
+  for (size_t i = 0; i < count; i++) {
+    /* XSDT entries are only 4 byte aligned */
+    uint64_t phys = 0;
+    memcpy(&phys, entries + i * entry_size, entry_size);
+
+    const acpi_sdt_header_t *table = acpi_map_table(phys, signature);
+    if (table != NULL) {
+      return table;
+    }
+  }
+  return NULL;
+}
+
+/** acpi_madt_info:
+ *  Returns what was recorded from the MADT, NULL if there was none
+ *
+ */
+const acpi_madt_info_t *acpi_madt_info(void) {
+  return acpi_have_madt ? &acpi_madt : NULL;
+}
@@ -0,0 +1,176 @@
+#ifndef INCLUDE_ACPI_H
+#define INCLUDE_ACPI_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Where the root system description pointer may be: the first KiB of the
+ * extended BIOS data area, whose segment is stored at ACPI_EBDA_POINTER, and
+ * the BIOS read only area. It is always 16 byte aligned. */
+#define ACPI_EBDA_POINTER 0x40e
+#define ACPI_EBDA_SEARCH_SIZE 1024
+#define ACPI_BIOS_AREA_START 0xe0000
+#define ACPI_BIOS_AREA_END 0x100000
+#define ACPI_RSDP_ALIGN 16
+
+/* acpi_madt.flags */
+#define ACPI_MADT_PCAT_COMPAT 0x1 /* there are 8259s to mask */
+
+/* acpi_madt_entry.type */
+#define ACPI_MADT_LOCAL_APIC 0
+#define ACPI_MADT_IO_APIC 1
+#define ACPI_MADT_INTERRUPT_OVERRIDE 2
+#define ACPI_MADT_LOCAL_APIC_NMI 4
+#define ACPI_MADT_LOCAL_APIC_OVERRIDE 5
+#define ACPI_MADT_LOCAL_X2APIC 9
+
+/* Flags of the local APIC entries */
+#define ACPI_MADT_CPU_ENABLED 0x1
+#define ACPI_MADT_CPU_ONLINE_CAPABLE 0x2
+
+/* MPS INTI flags of the interrupt override and NMI entries */
+#define ACPI_MADT_POLARITY_MASK 0x3
+#define ACPI_MADT_POLARITY_ACTIVE_LOW 0x3
+#define ACPI_MADT_TRIGGER_MASK 0xc
+#define ACPI_MADT_TRIGGER_LEVEL 0xc
+
+/* Limits of what acpi_initialize records from the MADT */
+#define ACPI_MAX_CPUS 16
+#define ACPI_MAX_IO_APICS 4
+#define ACPI_LEGACY_IRQS 16
+
+struct acpi_rsdp {
+  char signature[8]; /* "RSD PTR " */
+  uint8_t checksum;  /* of the first 20 bytes */
+  char oem_id[6];
+  uint8_t revision; /* 2 and up have the fields below */
+  uint32_t rsdt_address;
+  uint32_t length;
+  uint64_t xsdt_address;
+  uint8_t extended_checksum;
+  uint8_t reserved[3];
+} __attribute__((packed));
+
+typedef struct acpi_rsdp acpi_rsdp_t;
+
+/* Header shared by every system description table */
+struct acpi_sdt_header {
+  char signature[4];
+  uint32_t length; /* of the whole table, header included */
+  uint8_t revision;
+  uint8_t checksum; /* makes the bytes of the whole table sum to 0 */
+  char oem_id[6];
+  char oem_table_id[8];
+  uint32_t oem_revision;
+  uint32_t creator_id;
+  uint32_t creator_revision;
+} __attribute__((packed));
+
+typedef struct acpi_sdt_header acpi_sdt_header_t;
+
+struct acpi_madt {
+  acpi_sdt_header_t header; /* "APIC" */
+  uint32_t local_apic_address;
+  uint32_t flags;
+  /* variable length entries follow */
+} __attribute__((packed));
+
+typedef struct acpi_madt acpi_madt_t;
+
+struct acpi_madt_entry {
+  uint8_t type;
+  uint8_t length;
+} __attribute__((packed));
+
+typedef struct acpi_madt_entry acpi_madt_entry_t;
+
+struct acpi_madt_local_apic {
+  acpi_madt_entry_t entry;
+  uint8_t processor_id;
+  uint8_t apic_id;
+  uint32_t flags;
+} __attribute__((packed));
+
+struct acpi_madt_io_apic {
+  acpi_madt_entry_t entry;
+  uint8_t id;
+  uint8_t reserved;
+  uint32_t address;
+  uint32_t gsi_base; /* first global system interrupt it handles */
+} __attribute__((packed));
+
+struct acpi_madt_interrupt_override {
+  acpi_madt_entry_t entry;
+  uint8_t bus; /* 0, ISA */
+  uint8_t source; /* the ISA IRQ */
+  uint32_t gsi;
+  uint16_t flags;
+} __attribute__((packed));
+
+struct acpi_madt_local_apic_nmi {
+  acpi_madt_entry_t entry;
+  uint8_t processor_id; /* 0xff for every processor */
+  uint16_t flags;
+  uint8_t lint;
+} __attribute__((packed));
+
+struct acpi_madt_local_apic_override {
+  acpi_madt_entry_t entry;
+  uint16_t reserved;
+  uint64_t address;
+} __attribute__((packed));
+
+struct acpi_madt_local_x2apic {
+  acpi_madt_entry_t entry;
+  uint16_t reserved;
+  uint32_t x2apic_id;
+  uint32_t flags;
+  uint32_t processor_uid;
+} __attribute__((packed));
+
+/* What the kernel needs from the MADT */
+struct acpi_cpu {
+  uint32_t apic_id;
+  uint32_t processor_id;
+};
+
+typedef struct acpi_cpu acpi_cpu_t;
+
+struct acpi_io_apic {
+  uint32_t id;
+  uint32_t address;
+  uint32_t gsi_base;
+};
+
+typedef struct acpi_io_apic acpi_io_apic_t;
+
+/* Where an ISA IRQ arrives at the I/O APICs, identity mapped and edge
+ * triggered active high unless an interrupt override says otherwise */
+struct acpi_irq_route {
+  uint32_t gsi;
+  uint16_t flags; /* ACPI_MADT_POLARITY_* and ACPI_MADT_TRIGGER_* */
+};
+
+typedef struct acpi_irq_route acpi_irq_route_t;
+
+struct acpi_madt_info {
+  uint32_t local_apic_address;
+  bool pcat_compat;
+  uint32_t cpu_count; /* enabled processors */
+  acpi_cpu_t cpus[ACPI_MAX_CPUS];
+  uint32_t io_apic_count;
+  acpi_io_apic_t io_apics[ACPI_MAX_IO_APICS];
+  acpi_irq_route_t irqs[ACPI_LEGACY_IRQS];
+  bool have_nmi; /* nmi_lint is the LINT input NMIs arrive on */
+  uint8_t nmi_lint;
+  uint16_t nmi_flags;
+};
+
+typedef struct acpi_madt_info acpi_madt_info_t;
+
+bool acpi_initialize(void);
+const acpi_sdt_header_t *acpi_find_table(const char *signature);
+const acpi_madt_info_t *acpi_madt_info(void);
+
+#endif /* INCLUDE_ACPI_H */
@@ -0,0 +1,417 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "acpi.h"
+#include "apic.h"
+#include "clock.h"
+#include "cpu.h"
+#include "interrupts.h"
+#include "klog.h"
+#include "vmm.h"
+
+struct apic_io_apic {
+  volatile uint32_t *registers;
+  uint32_t gsi_base;
+  uint32_t redirections; /* number of redirection entries */
+};
+
+typedef struct apic_io_apic apic_io_apic_t;
+
+/* The local APIC MMIO page, unused in x2APIC mode */
+static volatile uint32_t *apic_registers;
+static bool apic_x2apic;
+static bool apic_enabled;
+
+static apic_io_apic_t apic_io_apics[ACPI_MAX_IO_APICS];
+static uint32_t apic_io_apic_count;
+
+/* Where each ISA IRQ arrives, and the CPU it is delivered to */
+static acpi_irq_route_t apic_irq_routes[INTERRUPT_LEGACY_IRQS];
+static uint32_t apic_irq_destination;
+
+/* NMI wiring of the local APICs from the MADT */
+static bool apic_have_nmi;
+static uint8_t apic_nmi_lint;
+static uint16_t apic_nmi_flags;
+
+static uint64_t apic_timer_frequency;
+
+static void apic_mask(unsigned int irq);
+static void apic_unmask(unsigned int irq);
+static void apic_acknowledge(uint32_t vector);
+
+static const interrupt_controller_t apic_controller = {
+    .name = "apic",
+    .mask = apic_mask,
+    .unmask = apic_unmask,
+    .acknowledge = apic_acknowledge,
+};
+
+/** apic_read:
+ *  Reads a register of this CPU's local APIC
+ *
+ *  @param reg One of the APIC_* register offsets
+ */
+uint32_t apic_read(uint32_t reg) {
+  if (apic_x2apic) {
+    return rdmsr(APIC_X2APIC_MSR_BASE + (reg >> 4));
+  }
+  return apic_registers[reg / sizeof(uint32_t)];
+}
+
+/** apic_write:
+ *  Writes a register of this CPU's local APIC
+ *
+ *  @param reg One of the APIC_* register offsets
+ *  @param value The value to write
+ */
+void apic_write(uint32_t reg, uint32_t value) {
+  if (apic_x2apic) {
+    wrmsr(APIC_X2APIC_MSR_BASE + (reg >> 4), value);
+  } else {
+    apic_registers[reg / sizeof(uint32_t)] = value;
+  }
+}
+
+/** apic_eoi:
+ *  Signals the end of the interrupt being handled to the local APIC, a single
+ *  uncached store or, in x2APIC mode, a non serializing MSR write
+ *
+ */
+void apic_eoi(void) { apic_write(APIC_EOI, 0); }
+
+/** apic_send_ipi:
+ *  Sends an interprocessor interrupt and waits for the local APIC to accept
+ *  it
+ *
+ *  @param destination The APIC id of the target CPU
+ *  @param command The low half of the interrupt command register, the
+ *                 delivery mode and vector
+ */
+void apic_send_ipi(uint32_t destination, uint32_t command) {
+  if (apic_x2apic) {
+    /* a single 64 bit write, delivery status doesn't exist in x2APIC mode */
+    wrmsr(APIC_X2APIC_MSR_BASE + (APIC_ICR_LOW >> 4),
+          ((uint64_t)destination << 32) | command);
+    return;
+  }
+
+  apic_write(APIC_ICR_HIGH, destination << 24);
+  apic_write(APIC_ICR_LOW, command);
+  while (apic_read(APIC_ICR_LOW) & APIC_ICR_DELIVERY_PENDING) {
+    asm volatile("pause");
+  }
+}
+
+/** apic_id:
+ *  Returns the APIC id of the calling CPU
+ *
+ */
+uint32_t apic_id(void) {
+  uint32_t id = apic_read(APIC_ID);
+  return apic_x2apic ? id : id >> 24;
+}
+
+/** apic_active:
+ *  Returns whether the APICs have taken over from the 8259s
+ *
+ */
+bool apic_active(void) { return apic_enabled; }
+
+/** io_apic_read:
+ *  Reads a register of an I/O APIC
+ *
+ */
+static uint32_t io_apic_read(const apic_io_apic_t *io_apic, uint32_t reg) {
+  io_apic->registers[IO_APIC_REGISTER_SELECT / sizeof(uint32_t)] = reg;
+  return io_apic->registers[IO_APIC_WINDOW / sizeof(uint32_t)];
+}
+
+/** io_apic_write:
+ *  Writes a register of an I/O APIC
+ *
+ */
+static void io_apic_write(const apic_io_apic_t *io_apic, uint32_t reg,
+                          uint32_t value) {
+  io_apic->registers[IO_APIC_REGISTER_SELECT / sizeof(uint32_t)] = reg;
+  io_apic->registers[IO_APIC_WINDOW / sizeof(uint32_t)] = value;
+}
+
+/** apic_io_apic_for:
+ *  Finds the I/O APIC handling a global system interrupt
+ *
+ *  @return The I/O APIC, NULL if none handles it
+ */
+static const apic_io_apic_t *apic_io_apic_for(uint32_t gsi) {
+  for (uint32_t i = 0; i < apic_io_apic_count; i++) {
+    const apic_io_apic_t *io_apic = &apic_io_apics[i];
+    if (gsi >= io_apic->gsi_base &&
+        gsi - io_apic->gsi_base < io_apic->redirections) {
+      return io_apic;
+    }
+  }
+  return NULL;
+}
+
+/** apic_route_irq:
+ *  Programs the redirection entry of an ISA IRQ to deliver it on vector
+ *  IDT_IRQ_BASE_INDEX + irq to the boot CPU. ISA lines are edge triggered
+ *  and active high unless the MADT overrides them.
+ *
+ *  @param irq The IRQ line (0 - 15)
+ *  @param masked Whether the entry is masked
+ */
+static void apic_route_irq(unsigned int irq, bool masked) {
+  const acpi_irq_route_t *route = &apic_irq_routes[irq];
+  const apic_io_apic_t *io_apic = apic_io_apic_for(route->gsi);
+  if (io_apic == NULL) {
+    return;
+  }
+
+  uint32_t low = IDT_IRQ_BASE_INDEX + irq;
+  if ((route->flags & ACPI_MADT_POLARITY_MASK) ==
+      ACPI_MADT_POLARITY_ACTIVE_LOW) {
+    low |= IO_APIC_ACTIVE_LOW;
+  }
+  if ((route->flags & ACPI_MADT_TRIGGER_MASK) == ACPI_MADT_TRIGGER_LEVEL) {
+    low |= IO_APIC_LEVEL;
+  }
+  if (masked) {
+    low |= IO_APIC_MASKED;
+  }
+
+  uint32_t entry = route->gsi - io_apic->gsi_base;
+  io_apic_write(io_apic, IO_APIC_REDIRECTION(entry), IO_APIC_MASKED);
+  io_apic_write(io_apic, IO_APIC_REDIRECTION(entry) + 1,
+                apic_irq_destination << IO_APIC_DESTINATION_SHIFT);
+  io_apic_write(io_apic, IO_APIC_REDIRECTION(entry), low);
+}
+
+/** apic_mask:
+ *  interrupt_controller mask, masks the redirection entry of the line
+ *
+ */
+static void apic_mask(unsigned int irq) { apic_route_irq(irq, true); }
+
+/** apic_unmask:
+ *  interrupt_controller unmask, unmasks the redirection entry of the line
+ *
+ */
+static void apic_unmask(unsigned int irq) { apic_route_irq(irq, false); }
+
+/** apic_acknowledge:
+ *  interrupt_controller acknowledge. Every vector the local APIC delivers
+ *  gets an EOI except the spurious vector, which never sets an in service
+ *  bit.
+ *
+ */
+static void apic_acknowledge(uint32_t vector) {
+  if (vector != IDT_APIC_SPURIOUS_INDEX) {
+    apic_eoi();
+  }
+}
+
+/** apic_spurious_handler:
+ *  Swallows spurious interrupts, they need no EOI
+ *
+ */
+static void apic_spurious_handler(
+    __attribute__((unused)) interrupt_frame_t *frame,
+    __attribute__((unused)) void *ctx) {}
+
+/** apic_error_handler:
+ *  Reports local APIC errors
+ *
+ */
+static void apic_error_handler(__attribute__((unused)) interrupt_frame_t *frame,
+                               __attribute__((unused)) void *ctx) {
+  /* the status register latches on a write */
+  apic_write(APIC_ESR, 0);
+  klog(KLOG_ERROR, "apic: error %02x on cpu %u",
+       (unsigned int)apic_read(APIC_ESR), (unsigned int)apic_id());
+}
+
+/** apic_timer_handler:
+ *  Local APIC timer interrupt, passed on to the clock as an event
+ *
+ */
+static void apic_timer_handler(__attribute__((unused)) interrupt_frame_t *frame,
+                               __attribute__((unused)) void *ctx) {
+  clock_event();
+}
+
+/** apic_local_initialize:
+ *  Enables and sets up the calling CPU's local APIC: NMIs on the LINT input
+ *  the MADT names, the other inputs and the timer masked, errors and
+ *  spurious interrupts on their own vectors. Run on every CPU.
+ *
+ */
+void apic_local_initialize(void) {
+  /* x2APIC mode can only be entered from xAPIC mode */
+  uint64_t base = rdmsr(MSR_IA32_APIC_BASE) | APIC_BASE_ENABLE;
+  wrmsr(MSR_IA32_APIC_BASE, base);
+  if (apic_x2apic) {
+    wrmsr(MSR_IA32_APIC_BASE, base | APIC_BASE_X2APIC_ENABLE);
+  }
+
+  apic_write(APIC_TPR, 0);
+  apic_write(APIC_LVT_TIMER, APIC_LVT_MASKED | IDT_APIC_TIMER_INDEX);
+
+  uint32_t nmi = APIC_LVT_DELIVERY_NMI;
+  if ((apic_nmi_flags & ACPI_MADT_POLARITY_MASK) ==
+      ACPI_MADT_POLARITY_ACTIVE_LOW) {
+    nmi |= APIC_LVT_ACTIVE_LOW;
+  }
+  /* without an NMI entry, NMIs are wired to LINT1 as on a PC */
+  bool nmi_on_lint0 = apic_have_nmi && apic_nmi_lint == 0;
+  apic_write(APIC_LVT_LINT0, nmi_on_lint0 ? nmi : APIC_LVT_MASKED);
+  apic_write(APIC_LVT_LINT1, nmi_on_lint0 ? APIC_LVT_MASKED : nmi);
+
+  apic_write(APIC_LVT_ERROR, IDT_APIC_ERROR_INDEX);
+  apic_write(APIC_ESR, 0);
+  apic_write(APIC_ESR, 0);
+
+  apic_write(APIC_SPURIOUS, APIC_SPURIOUS_ENABLE | IDT_APIC_SPURIOUS_INDEX);
+  apic_eoi();
+}
+
+/** apic_initialize:
+ *  Takes the legacy IRQs over from the 8259s: maps the local APIC, or uses
+ *  x2APIC mode when the CPU has it, and the I/O APICs from the MADT, sets up
+ *  this CPU's local APIC and moves every unmasked IRQ line to the I/O APICs.
+ *  acpi_initialize must have been run.
+ *
+ *  @return false if there are no APICs to use, the 8259s stay in charge
+ */
+bool apic_initialize(void) {
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+  const acpi_madt_info_t *madt = acpi_madt_info();
+  if (!(edx & CPUID_FEATURE_EDX_APIC) || madt == NULL ||
+      madt->io_apic_count == 0) {
+    klog(KLOG_WARNING, "apic: not available, staying on the 8259s");
+    return false;
+  }
+
+  apic_x2apic = ecx & CPUID_FEATURE_ECX_X2APIC;
+  if (!apic_x2apic) {
+    uint32_t phys = madt->local_apic_address;
+    if (phys == 0) {
+      phys = rdmsr(MSR_IA32_APIC_BASE) & APIC_BASE_ADDRESS_MASK;
+    }
+    apic_registers = vmm_map_mmio(phys, VMM_PAGE_SIZE, VMM_CACHE_UNCACHED);
+    if (apic_registers == NULL) {
+      return false;
+    }
+  }
+
+  for (uint32_t i = 0; i < madt->io_apic_count; i++) {
+    apic_io_apic_t *io_apic = &apic_io_apics[apic_io_apic_count];
+    io_apic->registers = vmm_map_mmio(madt->io_apics[i].address,
+                                      VMM_PAGE_SIZE, VMM_CACHE_UNCACHED);
+    if (io_apic->registers == NULL) {
+      continue;
+    }
+    io_apic->gsi_base = madt->io_apics[i].gsi_base;
+    io_apic->redirections =
+        ((io_apic_read(io_apic, IO_APIC_VERSION) >> 16) & 0xff) + 1;
+    for (uint32_t entry = 0; entry < io_apic->redirections; entry++) {
+      io_apic_write(io_apic, IO_APIC_REDIRECTION(entry), IO_APIC_MASKED);
+    }
+    apic_io_apic_count++;
+  }
+  if (apic_io_apic_count == 0) {
+    return false;
+  }
+
+  for (unsigned int irq = 0; irq < INTERRUPT_LEGACY_IRQS; irq++) {
+    apic_irq_routes[irq] = madt->irqs[irq];
+  }
+  apic_have_nmi = madt->have_nmi;
+  apic_nmi_lint = madt->nmi_lint;
+  apic_nmi_flags = madt->nmi_flags;
+
+  register_interrupt_handler(IDT_APIC_SPURIOUS_INDEX, apic_spurious_handler,
+                             NULL);
+  register_interrupt_handler(IDT_APIC_ERROR_INDEX, apic_error_handler, NULL);
+
+  uint32_t flags = interrupts_save();
+  apic_local_initialize();
+  apic_irq_destination = apic_id();
+  apic_enabled = true;
+  interrupt_set_controller(&apic_controller);
+  interrupts_restore(flags);
+
+  klog(KLOG_INFO, "apic: %s, cpu %u, %u io apics",
+       apic_x2apic ? "x2apic" : "xapic", (unsigned int)apic_irq_destination,
+       (unsigned int)apic_io_apic_count);
+  return true;
+}
+
+/** apic_timer_oneshot:
+ *  Arms this CPU's APIC timer to interrupt once after the given delay, cut
+ *  short to what the 32 bit counter can time
+ *
+ *  @param delta_ns The delay in nanoseconds
+ */
+void apic_timer_oneshot(uint64_t delta_ns) {
+  uint64_t count = delta_ns * apic_timer_frequency / CLOCK_NS_PER_SECOND;
+  if (count > UINT32_MAX) {
+    count = UINT32_MAX;
+  } else if (count < 1) {
+    count = 1;
+  }
+  apic_write(APIC_TIMER_INITIAL, count);
+}
+
+/** apic_timer_initialize:
+ *  Calibrates this CPU's APIC timer against the TSC and makes it the clock
+ *  event device in place of the PIT
+ *
+ *  @return false without APICs or a calibrated TSC
+ */
+bool apic_timer_initialize(void) {
+  uint64_t tsc_hz = clock_tsc_hz();
+  if (!apic_enabled || tsc_hz == 0) {
+    return false;
+  }
+
+  uint32_t flags = interrupts_save();
+
+  apic_write(APIC_TIMER_DIVIDE, APIC_TIMER_DIVIDE_16);
+  apic_write(APIC_LVT_TIMER, APIC_LVT_MASKED | IDT_APIC_TIMER_INDEX);
+
+  uint64_t cycles = tsc_hz * APIC_TIMER_CALIBRATION_MS / 1000;
+  apic_write(APIC_TIMER_INITIAL, UINT32_MAX);
+  uint64_t start = rdtsc();
+  while (rdtsc() - start < cycles) {
+    asm volatile("pause");
+  }
+  uint32_t remaining = apic_read(APIC_TIMER_CURRENT);
+  uint64_t elapsed = rdtsc() - start;
+  apic_write(APIC_TIMER_INITIAL, 0);
+
+  apic_timer_frequency = (uint64_t)(UINT32_MAX - remaining) * tsc_hz / elapsed;
+  if (apic_timer_frequency == 0) {
+    interrupts_restore(flags);
+    return false;
+  }
+
+  register_interrupt_handler(IDT_APIC_TIMER_INDEX, apic_timer_handler, NULL);
+  apic_write(APIC_LVT_TIMER, IDT_APIC_TIMER_INDEX);
+
+  interrupts_restore(flags);
+
+  klog(KLOG_INFO, "apic: timer at %llu Hz", apic_timer_frequency);
+  clock_set_event_device("apic", apic_timer_oneshot,
+                         (uint64_t)UINT32_MAX * CLOCK_NS_PER_SECOND /
+                             apic_timer_frequency);
+  return true;
+}
+
+/** apic_timer_hz:
+ *  Returns the calibrated APIC timer frequency, 0 if it isn't in use
+ *
+ */
+uint64_t apic_timer_hz(void) { return apic_timer_frequency; }
@@ -0,0 +1,84 @@
+#ifndef INCLUDE_APIC_H
+#define INCLUDE_APIC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Local APIC registers, as offsets into the xAPIC MMIO page. In x2APIC mode
+ * register r is the MSR APIC_X2APIC_MSR_BASE + (r >> 4). */
+#define APIC_ID 0x20
+#define APIC_VERSION 0x30
+#define APIC_TPR 0x80
+#define APIC_EOI 0xb0
+#define APIC_SPURIOUS 0xf0
+#define APIC_ESR 0x280
+#define APIC_ICR_LOW 0x300
+#define APIC_ICR_HIGH 0x310
+#define APIC_LVT_TIMER 0x320
+#define APIC_LVT_LINT0 0x350
+#define APIC_LVT_LINT1 0x360
+#define APIC_LVT_ERROR 0x370
+#define APIC_TIMER_INITIAL 0x380
+#define APIC_TIMER_CURRENT 0x390
+#define APIC_TIMER_DIVIDE 0x3e0
+
+#define APIC_X2APIC_MSR_BASE 0x800
+
+/* MSR_IA32_APIC_BASE bits */
+#define APIC_BASE_X2APIC_ENABLE (1 << 10)
+#define APIC_BASE_ENABLE (1 << 11)
+#define APIC_BASE_ADDRESS_MASK 0xfffff000
+
+/* APIC_SPURIOUS bits */
+#define APIC_SPURIOUS_ENABLE 0x100
+
+/* APIC_ICR_LOW bits */
+#define APIC_ICR_INIT (5 << 8)
+#define APIC_ICR_STARTUP (6 << 8)
+#define APIC_ICR_DELIVERY_PENDING (1 << 12)
+#define APIC_ICR_LEVEL_ASSERT (1 << 14)
+#define APIC_ICR_LEVEL_TRIGGER (1 << 15)
+
+/* Local vector table entry bits */
+#define APIC_LVT_DELIVERY_NMI (4 << 8)
+#define APIC_LVT_ACTIVE_LOW (1 << 13)
+#define APIC_LVT_LEVEL (1 << 15)
+#define APIC_LVT_MASKED (1 << 16)
+#define APIC_LVT_TIMER_PERIODIC (1 << 17)
+
+/* APIC_TIMER_DIVIDE value dividing the bus clock by 16 */
+#define APIC_TIMER_DIVIDE_16 0x3
+
+/* Length of the APIC timer calibration run against the TSC */
+#define APIC_TIMER_CALIBRATION_MS 10
+
+/* I/O APIC registers, reached by writing the register number to
+ * IO_APIC_REGISTER_SELECT and accessing IO_APIC_WINDOW */
+#define IO_APIC_REGISTER_SELECT 0x00
+#define IO_APIC_WINDOW 0x10
+#define IO_APIC_ID 0x00
+#define IO_APIC_VERSION 0x01
+#define IO_APIC_REDIRECTION(n) (0x10 + 2 * (n))
+
+/* Low half of a redirection entry, the vector is in bits 0-7 */
+#define IO_APIC_ACTIVE_LOW (1 << 13)
+#define IO_APIC_LEVEL (1 << 15)
+#define IO_APIC_MASKED (1 << 16)
+
+/* High half of a redirection entry, the physical APIC id of the target */
+#define IO_APIC_DESTINATION_SHIFT 24
+
+bool apic_initialize(void);
+void apic_local_initialize(void);
+bool apic_timer_initialize(void);
+bool apic_active(void);
+uint32_t apic_id(void);
+uint32_t apic_read(uint32_t reg);
+void apic_write(uint32_t reg, uint32_t value);
+void apic_eoi(void);
+void apic_send_ipi(uint32_t destination, uint32_t command);
+uint64_t apic_timer_hz(void);
+void apic_timer_oneshot(uint64_t delta_ns);
+
+#endif /* INCLUDE_APIC_H */
@@ -0,0 +1,121 @@
+#ifndef INCLUDE_ATOMIC_H
+#define INCLUDE_ATOMIC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Atomic operations on 32 bit words and memory barriers. x86 keeps loads in
+ * order with loads and stores in order with stores, so only a store followed
+ * by a load can be reordered by the CPU and the read and write barriers just
+ * stop the compiler. The loads and stores acquire and release. */
+
+/** compiler_barrier:
+ *  Stops the compiler from moving memory accesses across this point
+ *
+ */
+static inline void compiler_barrier(void) { asm volatile("" : : : "memory"); }
+
+/** memory_barrier:
+ *  Orders every earlier load and store before every later one, including a
+ *  store before a later load. A locked instruction works on every i686,
+ *  mfence needs SSE2.
+ *
+ */
+static inline void memory_barrier(void) {
+  asm volatile("lock addl $0, (%%esp)" : : : "memory", "cc");
+}
+
+/** read_barrier:
+ *  Orders earlier loads before later loads
+ *
+ */
+static inline void read_barrier(void) { compiler_barrier(); }
+
+/** write_barrier:
+ *  Orders earlier stores before later stores
+ *
+ */
+static inline void write_barrier(void) { compiler_barrier(); }
+
+/** cpu_relax:
+ *  Tells the CPU it is in a spin wait loop
+ *
+ */
+static inline void cpu_relax(void) { asm volatile("pause" : : : "memory"); }
+
+/** atomic_load:
+ *  Reads a word, later accesses can't move before it
+ *
+ *  @param p The word to read
+ */
+static inline uint32_t atomic_load(const volatile uint32_t *p) {
+  return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+/** atomic_store:
+ *  Writes a word, earlier accesses can't move after it
+ *
+ *  @param p The word to write
+ *  @param value The value to store
+ */
+static inline void atomic_store(volatile uint32_t *p, uint32_t value) {
+  __atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+/** atomic_exchange:
+ *  Writes a word and returns the value it replaced
+ *
+ *  @param p The word to write
+ *  @param value The value to store
+ */
+static inline uint32_t atomic_exchange(volatile uint32_t *p, uint32_t value) {
+  return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+}
+
+/** atomic_cas:
+ *  Replaces a word if it still holds the expected value
+ *
+ *  @param p The word to update
+ *  @param expected The value the word must hold
+ *  @param value The value to store
+ *  @return whether the word was replaced
+ */
+static inline bool atomic_cas(volatile uint32_t *p, uint32_t expected,
+                              uint32_t value) {
+  return __atomic_compare_exchange_n(p, &expected, value, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/** atomic_fetch_add:
+ *  Adds to a word
+ *
+ *  @param p The word to update
+ *  @param value The amount to add
+ *  @return The value before the addition
+ */
+static inline uint32_t atomic_fetch_add(volatile uint32_t *p, uint32_t value) {
+  return __atomic_fetch_add(p, value, __ATOMIC_SEQ_CST);
+}
+
+/** atomic_fetch_sub:
+ *  Subtracts from a word
+ *
+ *  @param p The word to update
+ *  @param value The amount to subtract
+ *  @return The value before the subtraction
+ */
+static inline uint32_t atomic_fetch_sub(volatile uint32_t *p, uint32_t value) {
+  return __atomic_fetch_sub(p, value, __ATOMIC_SEQ_CST);
+}
+
+/** atomic_inc:
+ *  Adds one to a counter, without ordering other accesses
+ *
+ *  @param p The counter
+ */
+static inline void atomic_inc(volatile uint32_t *p) {
+  __atomic_fetch_add(p, 1, __ATOMIC_RELAXED);
+}
+
+#endif /* INCLUDE_ATOMIC_H */
@@ -5,6 +5,17 @@ FLAGS    equ  MBALIGN | MEMINFO ; this is the Multiboot 'flag' field
 MAGIC    equ  0x1BADB002        ; 'magic number' lets bootloader find the header
 CHECKSUM equ -(MAGIC + FLAGS)   ; checksum of above, to prove we are multiboot
 
+; The kernel is linked at KERNEL_VIRTUAL_BASE + 1 MiB but loaded at 1 MiB. These
+; must match vmm.h and linker.ld.
+KERNEL_VIRTUAL_BASE equ 0xC0000000
+KERNEL_PAGE_INDEX   equ KERNEL_VIRTUAL_BASE >> 22
+DIRECT_MAP_PAGES    equ 0x30000000 >> 22  ; 768 MiB in 4 MiB pages
+LARGE_PAGE_SIZE     equ 1 << 22
+PDE_LARGE_PAGE      equ 0x83              ; present, writable, 4 MiB
+CR0_WP              equ 1 << 16
+CR0_PG              equ 1 << 31
+CR4_PSE             equ 1 << 4
+
 ; Declare a multiboot header that marks the program as a kernel. These are magic
 ; values that are documented in the multiboot standard. The bootloader will
 ; search for this signature in the first 8 KiB of the kernel file, aligned at a
@@ -36,7 +47,9 @@ stack_top:
 ; bootloader will jump to this position once the kernel has been loaded. It
 ; doesn't make sense to return from this function as the bootloader is gone.
 ; Declare _start as a function symbol with the given symbol size.
-section .text
+; _start runs before paging is enabled, so it lives in its own section linked
+; at its physical address.
+section .boot.text progbits alloc exec nowrite align=16
 global _start:function (_start.end - _start)
 _start:
 	; The bootloader has loaded us into 32-bit protected mode on a x86
@@ -50,6 +63,39 @@ _start:
 	; itself. It has absolute and complete power over the
 	; machine.
 
+	; Build the kernel page directory with 4 MiB pages, so the whole kernel
+	; and the memory it touches need only a handful of TLB entries. The
+	; first 4 MiB are identity mapped as well so that this code keeps
+	; running once paging is on; vmm_initialize removes that mapping. eax
+	; and ebx still hold the multiboot values and must be preserved.
+	extern vmm_kernel_directory
+	mov edi, vmm_kernel_directory - KERNEL_VIRTUAL_BASE
+	mov edx, PDE_LARGE_PAGE
+	mov [edi], edx
+	add edi, KERNEL_PAGE_INDEX * 4
+	mov ecx, DIRECT_MAP_PAGES
+.map:
+	mov [edi], edx
+	add edx, LARGE_PAGE_SIZE
+	add edi, 4
+	loop .map
+
+	mov ecx, cr4
+	or ecx, CR4_PSE
+	mov cr4, ecx
+	mov ecx, vmm_kernel_directory - KERNEL_VIRTUAL_BASE
+	mov cr3, ecx
+	mov ecx, cr0
+	or ecx, CR0_PG | CR0_WP
+	mov cr0, ecx
+
+	; Continue at the higher half address with an absolute jump.
+	mov ecx, higher_half
+	jmp ecx
+.end:
+
+section .text
+higher_half:
 	; To set up a stack, we set the esp register to point to the top of our
 	; stack (as it grows downwards on x86 systems). This is necessarily done
 	; in assembly as languages such as C cannot function without a stack.
@@ -58,9 +104,9 @@ _start:
 	; This is a good place to initialize crucial processor state before the
 	; high-level kernel is entered. It's best to minimize the early
 	; environment where crucial features are offline. Note that the
-	; processor is not fully initialized yet: Features such as floating
-	; point instructions and instruction set extensions are not initialized
-	; yet. The GDT should be loaded here. Paging should be enabled here.
+	; processor is not fully initialized yet: floating point and SSE are
+	; enabled by fpu_initialize and the GDT is loaded by kernel_main, paging
+	; was enabled above.
 	; C++ features such as global constructors and exceptions will require
 	; runtime support to work as well.
 
@@ -68,8 +114,14 @@ _start:
 	; aligned at the time of the call instruction (which afterwards pushes
 	; the return pointer of size 4 bytes). The stack was originally 16-byte
 	; aligned above and we've since pushed a multiple of 16 bytes to the
-	; stack since (pushed 0 bytes so far) and the alignment is thus
-	; preserved and the call is well defined.
+	; stack since (8 bytes of padding and the two arguments below) and the
+	; alignment is thus preserved and the call is well defined.
+
+	; Pass the bootloader's magic value (eax) and the physical address of
+	; the multiboot information structure (ebx) to kernel_main.
+	sub esp, 8
+	push ebx
+	push eax
 
 	;extern irq1handler
 	;call irq1handler
@@ -94,4 +146,3 @@ _start:
 	cli
 .hang:	hlt
 	jmp .hang
-.end:
@@ -0,0 +1,351 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clock.h"
+#include "cpu.h"
+#include "interrupts.h"
+#include "io.h"
+#include "klog.h"
+#include "spinlock.h"
+
+/* Guards the tick count and the TSC conversion, which are 64 bit and can't
+ * be read in one access */
+static seqlock_t clock_lock;
+static uint64_t clock_tick_count;
+static uint32_t clock_hz;
+static clock_event_handler_t clock_event_handler;
+
+/* The one-shot event device, the PIT until another device takes over */
+static clock_oneshot_t clock_event_oneshot;
+static uint64_t clock_event_max_oneshot_ns = PIT_MAX_ONESHOT_NS;
+
+/* TSC state, frequency is 0 when there is no TSC to use. Cycles are turned
+ * into nanoseconds as (cycles * mult) >> shift. */
+struct clock_tsc {
+  uint64_t frequency;
+  uint64_t base;
+  uint32_t mult;
+  uint32_t shift;
+};
+
+static struct clock_tsc clock_tsc;
+
+/** clock_tsc_read:
+ *  Takes a consistent copy of the TSC state
+ *
+ *  @param tsc Where to copy the state
+ */
+static inline void clock_tsc_read(struct clock_tsc *tsc) {
+  uint32_t sequence;
+  do {
+    sequence = seqlock_read_begin(&clock_lock);
+    *tsc = clock_tsc;
+  } while (seqlock_read_retry(&clock_lock, sequence));
+}
+
+/** clock_mul_shift:
+ *  Returns (value * mult) >> shift without losing the top bits of the 96 bit
+ *  product
+ *
+ *  @param value The 64 bit value to scale
+ *  @param mult The 32 bit multiplier
+ *  @param shift The right shift, at most 32
+ */
+static inline uint64_t clock_mul_shift(uint64_t value, uint32_t mult,
+                                       uint32_t shift) {
+  uint32_t high = value >> 32;
+  uint64_t result = ((uint64_t)(uint32_t)value * mult) >> shift;
+  if (high) {
+    result += ((uint64_t)high * mult) << (32 - shift);
+  }
+  return result;
+}
+
+/** clock_tick_handler:
+ *  IRQ0 handler, counts PIT interrupts and passes them on to the event handler
+ *
+ */
+static void clock_tick_handler(__attribute__((unused)) interrupt_frame_t *frame,
+                               __attribute__((unused)) void *ctx) {
+  uint32_t flags = seqlock_write_begin(&clock_lock);
+  clock_tick_count++;
+  seqlock_write_end(&clock_lock, flags);
+  clock_event();
+}
+
+/** clock_event:
+ *  Passes an interrupt of the event device on to the event handler, called
+ *  by the device's interrupt handler
+ *
+ */
+void clock_event(void) {
+  if (clock_event_handler != NULL) {
+    clock_event_handler();
+  }
+}
+
+/** clock_pit_set_rate:
+ *  Programs PIT channel 0 as a rate generator firing at the given frequency
+ *
+ *  @param hz The number of ticks per second
+ */
+static void clock_pit_set_rate(uint32_t hz) {
+  uint32_t divisor = PIT_FREQUENCY / hz;
+  if (divisor > 0xffff) {
+    divisor = 0xffff;
+  } else if (divisor < 2) {
+    divisor = 2;
+  }
+
+  outb(PIT_COMMAND_PORT,
+       PIT_SELECT_CHANNEL0 | PIT_ACCESS_LOHI | PIT_MODE_RATE_GENERATOR);
+  outb(PIT_CHANNEL0_PORT, divisor & 0xff);
+  outb(PIT_CHANNEL0_PORT, divisor >> 8);
+
+  clock_hz = PIT_FREQUENCY / divisor;
+}
+
+/** clock_measure_tsc:
+ *  Counts TSC cycles while PIT channel 2 counts down from the given latch.
+ *  Channel 2 is gated from port 0x61 and raises its output at terminal count,
+ *  so it can be polled without interrupts.
+ *
+ *  @param latch The PIT count to time
+ *  @return The number of TSC cycles that elapsed
+ */
+static uint64_t clock_measure_tsc(uint16_t latch) {
+  /* gate low and speaker off while loading the count */
+  uint8_t gate = inb(PIT_GATE_PORT) & ~(PIT_GATE_CHANNEL2 | PIT_GATE_SPEAKER);
+  outb(PIT_GATE_PORT, gate);
+
+  outb(PIT_COMMAND_PORT, PIT_SELECT_CHANNEL2 | PIT_ACCESS_LOHI |
+                             PIT_MODE_INTERRUPT_ON_TERMINAL_COUNT);
+  outb(PIT_CHANNEL2_PORT, latch & 0xff);
+  outb(PIT_CHANNEL2_PORT, latch >> 8);
+
+  /* the rising gate starts the count */
+  outb(PIT_GATE_PORT, gate | PIT_GATE_CHANNEL2);
+  uint64_t start = rdtsc();
+  while (!(inb(PIT_GATE_PORT) & PIT_GATE_CHANNEL2_OUTPUT)) {
+  }
+  uint64_t end = rdtsc();
+
+  outb(PIT_GATE_PORT, gate);
+  return end - start;
+}
+
+/** clock_calibrate_tsc:
+ *  Works out the TSC frequency against the PIT. The shortest of several runs
+ *  is used since interference can only make a run longer.
+ *
+ */
+static void clock_calibrate_tsc(void) {
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+  if (!(edx & CPUID_FEATURE_EDX_TSC)) {
+    return;
+  }
+
+  const uint16_t latch = PIT_FREQUENCY / (1000 / CLOCK_CALIBRATION_MS);
+  uint64_t best = UINT64_MAX;
+
+  uint32_t flags = interrupts_save();
+  for (int i = 0; i < CLOCK_CALIBRATION_RUNS; i++) {
+    uint64_t cycles = clock_measure_tsc(latch);
+    if (cycles < best) {
+      best = cycles;
+    }
+  }
+  interrupts_restore(flags);
+
+  if (best == 0) {
+    return;
+  }
+
+  struct clock_tsc tsc;
+  tsc.frequency = best * PIT_FREQUENCY / latch;
+
+  /* pick the largest shift that keeps the multiplier in 32 bits */
+  tsc.shift = 32;
+  while (tsc.shift > 0 &&
+         (CLOCK_NS_PER_SECOND << tsc.shift) / tsc.frequency > UINT32_MAX) {
+    tsc.shift--;
+  }
+  tsc.mult = (CLOCK_NS_PER_SECOND << tsc.shift) / tsc.frequency;
+
+  flags = seqlock_write_begin(&clock_lock);
+  tsc.base = rdtsc();
+  clock_tsc = tsc;
+  seqlock_write_end(&clock_lock, flags);
+}
+
+/** clock_initialize:
+ *  Calibrates the TSC and starts the PIT tick
+ *
+ *  @param hz The PIT tick rate
+ */
+void clock_initialize(uint32_t hz) {
+  seqlock_init(&clock_lock, "clock");
+  clock_calibrate_tsc();
+
+  uint32_t flags = interrupts_save();
+  clock_pit_set_rate(hz);
+  register_interrupt_handler(IDT_TIMER_INTERRUPT_INDEX, clock_tick_handler,
+                             NULL);
+  interrupts_restore(flags);
+
+  irq_unmask(PIT_IRQ);
+}
+
+/** clock_set_event_handler:
+ *  Sets the function called on every interrupt of the event device
+ *
+ *  @param handler The function to call, or NULL
+ */
+void clock_set_event_handler(clock_event_handler_t handler) {
+  clock_event_handler = handler;
+}
+
+/** clock_set_event_device:
+ *  Makes another timer the one-shot event device. The PIT interrupt is
+ *  masked, it only stays in use for timekeeping without a TSC.
+ *
+ *  @param name The name of the device, for the log
+ *  @param oneshot Arms the device
+ *  @param max_oneshot_ns The longest delay the device can time
+ */
+void clock_set_event_device(const char *name, clock_oneshot_t oneshot,
+                            uint64_t max_oneshot_ns) {
+  uint32_t flags = interrupts_save();
+  clock_event_oneshot = oneshot;
+  clock_event_max_oneshot_ns = max_oneshot_ns;
+  irq_mask(PIT_IRQ);
+  interrupts_restore(flags);
+
+  klog(KLOG_INFO, "clock: event device %s", name);
+}
+
+/** clock_pit_oneshot:
+ *  Switches PIT channel 0 to one-shot mode and arms it to interrupt once after
+ *  the given delay
+ *
+ *  @param delta_ns The delay in nanoseconds
+ */
+static void clock_pit_oneshot(uint64_t delta_ns) {
+  uint64_t count = delta_ns * PIT_FREQUENCY / CLOCK_NS_PER_SECOND;
+  if (count > 0xffff) {
+    count = 0xffff;
+  } else if (count < 1) {
+    count = 1;
+  }
+
+  outb(PIT_COMMAND_PORT, PIT_SELECT_CHANNEL0 | PIT_ACCESS_LOHI |
+                             PIT_MODE_INTERRUPT_ON_TERMINAL_COUNT);
+  outb(PIT_CHANNEL0_PORT, count & 0xff);
+  outb(PIT_CHANNEL0_PORT, count >> 8);
+}
+
+/** clock_set_oneshot:
+ *  Arms the event device to interrupt once after the given delay. Delays
+ *  beyond clock_max_oneshot_ns are cut short, the caller re-arms when the
+ *  early interrupt arrives. On the PIT the periodic tick stops until
+ *  clock_initialize is called again.
+ *
+ *  @param delta_ns The delay in nanoseconds
+ */
+void clock_set_oneshot(uint64_t delta_ns) {
+  if (delta_ns > clock_event_max_oneshot_ns) {
+    delta_ns = clock_event_max_oneshot_ns;
+  }
+  if (clock_event_oneshot != NULL) {
+    clock_event_oneshot(delta_ns);
+  } else {
+    clock_pit_oneshot(delta_ns);
+  }
+}
+
+/** clock_max_oneshot_ns:
+ *  Returns the longest delay the event device can time in one shot
+ *
+ */
+uint64_t clock_max_oneshot_ns(void) { return clock_event_max_oneshot_ns; }
+
+/** clock_cycles_to_ns:
+ *  Converts a TSC cycle count to nanoseconds
+ *
+ *  @param cycles The number of cycles
+ *  @return The duration in nanoseconds, 0 without a calibrated TSC
+ */
+uint64_t clock_cycles_to_ns(uint64_t cycles) {
+  struct clock_tsc tsc;
+  clock_tsc_read(&tsc);
+  if (tsc.frequency == 0) {
+    return 0;
+  }
+  return clock_mul_shift(cycles, tsc.mult, tsc.shift);
+}
+
+/** clock_tsc_to_monotonic_ns:
+ *  Converts a TSC reading to the clock_monotonic_ns time it was taken at
+ *
+ *  @param tsc A value read from the TSC
+ *  @return The time in nanoseconds, 0 without a calibrated TSC or for readings
+ *          taken before calibration
+ */
+uint64_t clock_tsc_to_monotonic_ns(uint64_t tsc) {
+  struct clock_tsc state;
+  clock_tsc_read(&state);
+  if (state.frequency == 0 || tsc < state.base) {
+    return 0;
+  }
+  return clock_mul_shift(tsc - state.base, state.mult, state.shift);
+}
+
+/** clock_monotonic_ns:
+ *  Returns the time since the clock was initialized. Reads the TSC when one
+ *  was calibrated, otherwise counts PIT ticks.
+ *
+ *  @return The time in nanoseconds
+ */
+uint64_t clock_monotonic_ns(void) {
+  struct clock_tsc tsc;
+  clock_tsc_read(&tsc);
+  if (tsc.frequency != 0) {
+    return clock_mul_shift(rdtsc() - tsc.base, tsc.mult, tsc.shift);
+  }
+  if (clock_hz == 0) {
+    return 0;
+  }
+  return clock_ticks() * (CLOCK_NS_PER_SECOND / clock_hz);
+}
+
+/** clock_ticks:
+ *  Returns the number of PIT ticks since the clock was initialized
+ *
+ */
+uint64_t clock_ticks(void) {
+  uint32_t sequence;
+  uint64_t ticks;
+  do {
+    sequence = seqlock_read_begin(&clock_lock);
+    ticks = clock_tick_count;
+  } while (seqlock_read_retry(&clock_lock, sequence));
+  return ticks;
+}
+
+/** clock_tick_hz:
+ *  Returns the rate the PIT was actually programmed to
+ *
+ */
+uint32_t clock_tick_hz(void) { return clock_hz; }
+
+/** clock_tsc_hz:
+ *  Returns the calibrated TSC frequency, 0 if there is no TSC
+ *
+ */
+uint64_t clock_tsc_hz(void) {
+  struct clock_tsc tsc;
+  clock_tsc_read(&tsc);
+  return tsc.frequency;
+}
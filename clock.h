@@ -0,0 +1,65 @@
+#ifndef INCLUDE_CLOCK_H
+#define INCLUDE_CLOCK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Input clock of the 8254 PIT in Hz */
+#define PIT_FREQUENCY 1193182
+
+#define PIT_CHANNEL0_PORT 0x40
+#define PIT_CHANNEL2_PORT 0x42
+#define PIT_COMMAND_PORT 0x43
+#define PIT_GATE_PORT 0x61 /* channel 2 gate and output, shared with speaker */
+#define PIT_IRQ 0
+
+/* PIT command byte fields */
+#define PIT_SELECT_CHANNEL0 0x00
+#define PIT_SELECT_CHANNEL2 0x80
+#define PIT_ACCESS_LOHI 0x30
+#define PIT_MODE_INTERRUPT_ON_TERMINAL_COUNT 0x00
+#define PIT_MODE_RATE_GENERATOR 0x04
+
+/* Bits of PIT_GATE_PORT */
+#define PIT_GATE_CHANNEL2 0x01
+#define PIT_GATE_SPEAKER 0x02
+#define PIT_GATE_CHANNEL2_OUTPUT 0x20
+
+#define CLOCK_DEFAULT_HZ 1000
+#define CLOCK_NS_PER_SECOND 1000000000ULL
+
+/* Length of each TSC calibration run against the PIT */
+#define CLOCK_CALIBRATION_MS 10
+#define CLOCK_CALIBRATION_RUNS 3
+
+/* Longest interval the 16 bit PIT counter can time in one shot (~54.9 ms) */
+#define PIT_MAX_ONESHOT_NS (0xffffULL * CLOCK_NS_PER_SECOND / PIT_FREQUENCY)
+
+/** clock_event_handler_t:
+ *  Called after every interrupt of the clock event device, periodic or
+ *  one-shot
+ */
+typedef void (*clock_event_handler_t)(void);
+
+/** clock_oneshot_t:
+ *  Arms a clock event device to interrupt once after the given delay, cut
+ *  short to the longest delay the device can time
+ */
+typedef void (*clock_oneshot_t)(uint64_t delta_ns);
+
+void clock_initialize(uint32_t hz);
+void clock_set_event_handler(clock_event_handler_t handler);
+void clock_set_event_device(const char *name, clock_oneshot_t oneshot,
+                            uint64_t max_oneshot_ns);
+void clock_set_oneshot(uint64_t delta_ns);
+uint64_t clock_max_oneshot_ns(void);
+void clock_event(void);
+uint64_t clock_monotonic_ns(void);
+uint64_t clock_ticks(void);
+uint32_t clock_tick_hz(void);
+uint64_t clock_tsc_hz(void);
+uint64_t clock_cycles_to_ns(uint64_t cycles);
+uint64_t clock_tsc_to_monotonic_ns(uint64_t tsc);
+
+#endif /* INCLUDE_CLOCK_H */
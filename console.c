@@ -0,0 +1,208 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "console.h"
+#include "io.h"
+#include "klog.h"
+#include "serial.h"
+
+/** console_serial_write:
+ *  Writes to a UART, through its transmit ring when it has one
+ *
+ */
+static void console_serial_write(console_t *console, const char *data,
+                                 size_t size) {
+  serial_write(console->port, data, size);
+}
+
+/** console_serial_flush:
+ *  Drains the transmit ring of a UART
+ *
+ */
+static void console_serial_flush(console_t *console) {
+  serial_flush(console->port);
+}
+
+/** console_vga_write:
+ *  Renders to the VGA text framebuffer
+ *
+ */
+static void console_vga_write(__attribute__((unused)) console_t *console,
+                              const char *data, size_t size) {
+  framebuffer_write(data, size);
+}
+
+/** console_debugcon_write:
+ *  Writes to the debug console port. The emulator takes each byte as it is
+ *  written, so the whole buffer goes out with a single rep outsb.
+ *
+ */
+static void console_debugcon_write(console_t *console, const char *data,
+                                   size_t size) {
+  outsb(console->port, data, size);
+}
+
+static console_t console_com1 = {
+    .name = "com1",
+    .write = console_serial_write,
+    .flush = console_serial_flush,
+    .port = SERIAL_COM1_BASE,
+    .level = KLOG_DEBUG,
+};
+
+static console_t console_vga = {
+    .name = "vga",
+    .write = console_vga_write,
+    .level = KLOG_WARNING,
+};
+
+static console_t console_com2 = {
+    .name = "com2",
+    .write = console_serial_write,
+    .flush = console_serial_flush,
+    .port = SERIAL_COM2_BASE,
+    .level = KLOG_DEBUG,
+};
+
+static console_t console_com3 = {
+    .name = "com3",
+    .write = console_serial_write,
+    .flush = console_serial_flush,
+    .port = SERIAL_COM3_BASE,
+    .level = KLOG_DEBUG,
+};
+
+static console_t console_com4 = {
+    .name = "com4",
+    .write = console_serial_write,
+    .flush = console_serial_flush,
+    .port = SERIAL_COM4_BASE,
+    .level = KLOG_DEBUG,
+};
+
+static console_t console_debugcon = {
+    .name = "debugcon",
+    .write = console_debugcon_write,
+    .port = CONSOLE_DEBUGCON_PORT,
+    .level = KLOG_DEBUG,
+};
+
+/* COM1 and the framebuffer are always there, so they are usable before
+ * console_initialize has run */
+static console_t *consoles[CONSOLE_COUNT] = {
+    [CONSOLE_COM1] = &console_com1,
+    [CONSOLE_VGA] = &console_vga,
+};
+
+/** console_initialize:
+ *  Probes for the optional consoles and registers the ones that are present.
+ *  COM1 must have been initialized already.
+ *
+ */
+void console_initialize(void) {
+  static console_t *const serial_consoles[] = {&console_com2, &console_com3,
+                                               &console_com4};
+
+  for (unsigned int i = 0; i < 3; i++) {
+    console_t *console = serial_consoles[i];
+    if (serial_probe(console->port)) {
+      serial_initialize(console->port, 1);
+      console_register(CONSOLE_COM2 + i, console);
+    }
+  }
+
+  if (inb(CONSOLE_DEBUGCON_PORT) == CONSOLE_DEBUGCON_PORT) {
+    console_register(CONSOLE_DEBUGCON, &console_debugcon);
+  }
+}
+
+/** console_register:
+ *  Makes a console available to fprintf and the klog fan out
+ *
+ *  @param id One of the CONSOLE_* ids
+ *  @param console The console, must stay valid while it is registered
+ *  @return false if the id is out of range
+ */
+bool console_register(unsigned int id, console_t *console) {
+  if (id >= CONSOLE_COUNT || console == NULL || console->write == NULL) {
+    return false;
+  }
+  consoles[id] = console;
+  return true;
+}
+
+/** console_unregister:
+ *  Stops sending output to a console
+ *
+ *  @param id One of the CONSOLE_* ids
+ */
+void console_unregister(unsigned int id) {
+  if (id < CONSOLE_COUNT) {
+    consoles[id] = NULL;
+  }
+}
+
+/** console_get:
+ *  Returns the console registered under an id, or NULL
+ *
+ */
+console_t *console_get(unsigned int id) {
+  return id < CONSOLE_COUNT ? consoles[id] : NULL;
+}
+
+/** console_set_level:
+ *  Sets the most verbose klog level fanned out to a console. A level below
+ *  KLOG_ERROR keeps the log off the console.
+ *
+ */
+void console_set_level(unsigned int id, int level) {
+  console_t *console = console_get(id);
+  if (console != NULL) {
+    console->level = level;
+  }
+}
+
+/** console_write:
+ *  Writes data to a single console, whatever its level
+ *
+ *  @param id One of the CONSOLE_* ids
+ *  @param data The data to write
+ *  @param size The number of bytes to write
+ */
+void console_write(unsigned int id, const char *data, size_t size) {
+  console_t *console = console_get(id);
+  if (console != NULL && size > 0) {
+    console->write(console, data, size);
+  }
+}
+
+/** console_write_level:
+ *  Writes data to every console that takes messages of the given level
+ *
+ *  @param level One of the KLOG_* levels
+ *  @param data The data to write
+ *  @param size The number of bytes to write
+ */
+void console_write_level(int level, const char *data, size_t size) {
+  for (unsigned int id = 0; id < CONSOLE_COUNT; id++) {
+    console_t *console = consoles[id];
+    if (console != NULL && level <= console->level) {
+      console->write(console, data, size);
+    }
+  }
+}
+
+/** console_flush:
+ *  Waits until every console has sent out what was written to it, for when
+ *  interrupts can no longer be relied upon (e.g. fatal exceptions)
+ *
+ */
+void console_flush(void) {
+  for (unsigned int id = 0; id < CONSOLE_COUNT; id++) {
+    console_t *console = consoles[id];
+    if (console != NULL && console->flush != NULL) {
+      console->flush(console);
+    }
+  }
+}
@@ -0,0 +1,57 @@
+#ifndef INCLUDE_CONSOLE_H
+#define INCLUDE_CONSOLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Console ids, the output argument of fprintf */
+#define CONSOLE_COM1 0
+#define CONSOLE_VGA 1
+#define CONSOLE_COM2 2
+#define CONSOLE_COM3 3
+#define CONSOLE_COM4 4
+#define CONSOLE_DEBUGCON 5
+#define CONSOLE_COUNT 6
+
+/* The Bochs/QEMU debug console. Every byte written to the port shows up on
+ * the host straight away, there is no status to poll. Reading the port back
+ * returns CONSOLE_DEBUGCON_PORT when the device is there. */
+#define CONSOLE_DEBUGCON_PORT 0xe9
+
+/* fprintf gathers output into chunks of this size before writing them to a
+ * console */
+#define CONSOLE_CHUNK_SIZE 128
+
+typedef struct console console_t;
+
+/** console_write_t:
+ *  Writes data to a console. The data must be visible, or on its way out,
+ *  when the call returns.
+ */
+typedef void (*console_write_t)(console_t *console, const char *data,
+                                size_t size);
+
+/** console_flush_t:
+ *  Waits until everything written to a console has left the machine
+ */
+typedef void (*console_flush_t)(console_t *console);
+
+struct console {
+  const char *name;
+  console_write_t write;
+  console_flush_t flush; /* NULL if writes are synchronous */
+  uint32_t port;         /* I/O port for the port backed consoles */
+  int level;             /* the most verbose klog level fanned out to it */
+};
+
+void console_initialize(void);
+bool console_register(unsigned int id, console_t *console);
+void console_unregister(unsigned int id);
+console_t *console_get(unsigned int id);
+void console_set_level(unsigned int id, int level);
+void console_write(unsigned int id, const char *data, size_t size);
+void console_write_level(int level, const char *data, size_t size);
+void console_flush(void);
+
+#endif /* INCLUDE_CONSOLE_H */
@@ -0,0 +1,154 @@
+#ifndef INCLUDE_CPU_H
+#define INCLUDE_CPU_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* CPUID leaf 1 feature bits */
+#define CPUID_FEATURE_ECX_X2APIC (1 << 21)
+
+#define CPUID_FEATURE_EDX_FPU (1 << 0)
+#define CPUID_FEATURE_EDX_PSE (1 << 3)
+#define CPUID_FEATURE_EDX_TSC (1 << 4)
+#define CPUID_FEATURE_EDX_APIC (1 << 9)
+#define CPUID_FEATURE_EDX_SEP (1 << 11) /* sysenter and sysexit */
+#define CPUID_FEATURE_EDX_PGE (1 << 13)
+#define CPUID_FEATURE_EDX_PAT (1 << 16)
+#define CPUID_FEATURE_EDX_FXSR (1 << 24)
+#define CPUID_FEATURE_EDX_SSE (1 << 25)
+#define CPUID_FEATURE_EDX_SSE2 (1 << 26)
+
+/* CPUID leaf 7 feature bits */
+#define CPUID_EXTENDED_FEATURES 7
+#define CPUID_FEATURE7_EBX_ERMS (1 << 9) /* fast rep movsb and stosb */
+
+/* EFLAGS bits */
+#define EFLAGS_INTERRUPT_ENABLE (1 << 9)
+
+/* Control register bits */
+#define CR0_MP (1 << 1) /* wait honours TS */
+#define CR0_EM (1 << 2) /* no x87, emulate it */
+#define CR0_TS (1 << 3) /* task switched, FPU use traps to #NM */
+#define CR0_NE (1 << 5) /* native x87 error reporting */
+#define CR4_PSE (1 << 4)
+#define CR4_PGE (1 << 7)
+#define CR4_OSFXSR (1 << 9)     /* fxsave, fxrstor and SSE */
+#define CR4_OSXMMEXCPT (1 << 10) /* unmasked SSE exceptions raise #XM */
+
+/* Model specific registers */
+#define MSR_IA32_APIC_BASE 0x1b
+#define MSR_IA32_SYSENTER_CS 0x174
+#define MSR_IA32_SYSENTER_ESP 0x175
+#define MSR_IA32_SYSENTER_EIP 0x176
+#define MSR_IA32_PAT 0x277
+
+/** cpuid:
+ *  Runs the cpuid instruction for the given leaf
+ *
+ *  @param leaf The value of eax passed to cpuid
+ *  @param eax, ebx, ecx, edx Where to store the returned registers
+ */
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx,
+                         uint32_t *ecx, uint32_t *edx) {
+  asm volatile("cpuid"
+               : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+               : "a"(leaf), "c"(0));
+}
+
+/** rdtsc:
+ *  Reads the time stamp counter
+ *
+ *  @return The number of cycles since reset
+ */
+static inline uint64_t rdtsc(void) {
+  uint32_t low, high;
+  asm volatile("rdtsc" : "=a"(low), "=d"(high));
+  return ((uint64_t)high << 32) | low;
+}
+
+/** rdmsr:
+ *  Reads a model specific register
+ *
+ *  @param msr The register number
+ */
+static inline uint64_t rdmsr(uint32_t msr) {
+  uint32_t low, high;
+  asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+  return ((uint64_t)high << 32) | low;
+}
+
+/** wrmsr:
+ *  Writes a model specific register
+ *
+ *  @param msr The register number
+ *  @param value The value to write
+ */
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+  asm volatile("wrmsr"
+               :
+               : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32))
+               : "memory");
+}
+
+/** read_cr0:
+ *  Returns the value of control register 0
+ *
+ */
+static inline uint32_t read_cr0(void) {
+  uint32_t value;
+  asm volatile("mov %%cr0, %0" : "=r"(value));
+  return value;
+}
+
+/** write_cr0:
+ *  Sets control register 0
+ *
+ *  @param value The new value
+ */
+static inline void write_cr0(uint32_t value) {
+  asm volatile("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+/** read_cr2:
+ *  Returns the value of control register 2, the linear address of the last
+ *  page fault
+ *
+ */
+static inline uint32_t read_cr2(void) {
+  uint32_t value;
+  asm volatile("mov %%cr2, %0" : "=r"(value));
+  return value;
+}
+
+/** read_cr3:
+ *  Returns the value of control register 3, the physical address of the
+ *  page directory
+ *
+ */
+static inline uint32_t read_cr3(void) {
+  uint32_t value;
+  asm volatile("mov %%cr3, %0" : "=r"(value));
+  return value;
+}
+
+/** read_cr4:
+ *  Returns the value of control register 4
+ *
+ */
+static inline uint32_t read_cr4(void) {
+  uint32_t value;
+  asm volatile("mov %%cr4, %0" : "=r"(value));
+  return value;
+}
+
+/** write_cr4:
+ *  Sets control register 4
+ *
+ *  @param value The new value
+ */
+static inline void write_cr4(uint32_t value) {
+  asm volatile("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+#endif /* INCLUDE_CPU_H */
@@ -0,0 +1,45 @@
+#ifndef INCLUDE_ELF_H
+#define INCLUDE_ELF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* elf32_section_header.type */
+#define ELF_SECTION_SYMTAB 2
+#define ELF_SECTION_STRTAB 3
+
+/* elf32_section_header.flags */
+#define ELF_SECTION_ALLOC 0x2
+
+/* Low four bits of elf32_symbol.info */
+#define ELF_SYMBOL_TYPE(info) ((info)&0xf)
+#define ELF_SYMBOL_FUNC 2
+
+struct elf32_section_header {
+  uint32_t name;
+  uint32_t type;
+  uint32_t flags;
+  uint32_t addr; /* as loaded by the bootloader, see ksym.c */
+  uint32_t offset;
+  uint32_t size;
+  uint32_t link; /* for a symbol table, the index of its string table */
+  uint32_t info;
+  uint32_t addralign;
+  uint32_t entsize;
+} __attribute__((packed));
+
+typedef struct elf32_section_header elf32_section_header_t;
+
+struct elf32_symbol {
+  uint32_t name; /* offset into the string table */
+  uint32_t value;
+  uint32_t size;
+  uint8_t info;
+  uint8_t other;
+  uint16_t shndx;
+} __attribute__((packed));
+
+typedef struct elf32_symbol elf32_symbol_t;
+
+#endif /* INCLUDE_ELF_H */
@@ -0,0 +1,238 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "fpu.h"
+#include "interrupts.h"
+#include "klog.h"
+#include "kmem.h"
+#include "thread.h"
+
+static bool fpu_present;
+static bool fpu_have_fxsr;
+static bool fpu_sse;
+
+/* Thread whose registers are loaded in the FPU, NULL when they belong to
+ * nobody. The registers are only saved when another thread wants them. */
+static thread_t *fpu_owner;
+
+static kmem_cache_t *fpu_cache;
+
+/** fpu_clts:
+ *  Clears CR0.TS, FPU instructions no longer trap
+ *
+ */
+static inline void fpu_clts(void) { asm volatile("clts" : : : "memory"); }
+
+/** fpu_stts:
+ *  Sets CR0.TS, the next FPU instruction raises #NM. Writing CR0 serializes
+ *  while reading it doesn't, so the write is skipped when TS is already set.
+ *
+ */
+static inline void fpu_stts(void) {
+  uint32_t cr0 = read_cr0();
+  if (!(cr0 & CR0_TS)) {
+    write_cr0(cr0 | CR0_TS);
+  }
+}
+
+/** fpu_save:
+ *  Stores the FPU registers, with fxsave when the CPU has it
+ *
+ *  @param state A FPU_STATE_ALIGN aligned area of FPU_STATE_SIZE bytes
+ */
+static inline void fpu_save(void *state) {
+  if (fpu_have_fxsr) {
+    asm volatile("fxsave (%0)" : : "r"(state) : "memory");
+  } else {
+    asm volatile("fnsave (%0)\n\tfwait" : : "r"(state) : "memory");
+  }
+}
+
+/** fpu_restore:
+ *  Loads the FPU registers saved by fpu_save
+ *
+ *  @param state The saved registers
+ */
+static inline void fpu_restore(const void *state) {
+  if (fpu_have_fxsr) {
+    asm volatile("fxrstor (%0)" : : "r"(state) : "memory");
+  } else {
+    asm volatile("frstor (%0)" : : "r"(state) : "memory");
+  }
+}
+
+/** fpu_reset:
+ *  Puts the FPU registers in their initial state for a thread's first use
+ *
+ */
+static inline void fpu_reset(void) {
+  asm volatile("fninit" : : : "memory");
+  if (fpu_sse) {
+    uint32_t mxcsr = FPU_MXCSR_DEFAULT;
+    asm volatile("ldmxcsr %0" : : "m"(mxcsr));
+  }
+}
+
+/** fpu_device_not_available:
+ *  #NM handler, hands the FPU to the running thread: saves the registers of
+ *  the thread that last used it and loads the running thread's
+ *
+ */
+static void
+fpu_device_not_available(__attribute__((unused)) interrupt_frame_t *frame,
+                         __attribute__((unused)) void *ctx) {
+  fpu_clts();
+
+  thread_t *current = thread_current();
+  if (current == NULL || current == fpu_owner) {
+    return;
+  }
+
+  if (current->fpu_state == NULL) {
+    if (fpu_cache == NULL) {
+      fpu_cache = kmem_cache_create("fpu", FPU_STATE_SIZE, FPU_STATE_ALIGN,
+                                    NULL);
+    }
+    current->fpu_state =
+        fpu_cache != NULL ? kmem_cache_alloc(fpu_cache) : NULL;
+    if (current->fpu_state == NULL) {
+      /* the thread can't be resumed without clobbering another's state */
+      klog(KLOG_ERROR, "fpu: no memory for the state of thread %s",
+           current->name);
+      klog_flush();
+      for (;;) {
+        asm volatile("cli; hlt");
+      }
+    }
+  }
+
+  if (fpu_owner != NULL) {
+    fpu_save(fpu_owner->fpu_state);
+  }
+  if (current->fpu_used) {
+    fpu_restore(current->fpu_state);
+  } else {
+    fpu_reset();
+    current->fpu_used = true;
+  }
+  fpu_owner = current;
+}
+
+/** fpu_initialize:
+ *  Detects the x87 and SSE units, enables them on the boot CPU and turns on
+ *  lazy switching: threads only get FPU registers of their own once they
+ *  use them
+ *
+ */
+void fpu_initialize(void) {
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+  fpu_present = edx & CPUID_FEATURE_EDX_FPU;
+  fpu_have_fxsr = edx & CPUID_FEATURE_EDX_FXSR;
+  fpu_sse = fpu_have_fxsr && (edx & CPUID_FEATURE_EDX_SSE);
+  if (!fpu_present) {
+    klog(KLOG_WARNING, "fpu: no x87 unit");
+    return;
+  }
+
+  fpu_initialize_cpu();
+  register_interrupt_handler(IDT_DEVICE_NOT_AVAILABLE_INDEX,
+                             fpu_device_not_available, NULL);
+
+  klog(KLOG_INFO, "fpu: x87%s%s%s, lazy switching",
+       fpu_have_fxsr ? ", fxsr" : "", fpu_sse ? ", sse" : "",
+       fpu_sse && (edx & CPUID_FEATURE_EDX_SSE2) ? ", sse2" : "");
+}
+
+/** fpu_initialize_cpu:
+ *  Enables the FPU, and SSE when there is one, on the calling CPU and leaves
+ *  CR0.TS set so the first use traps. Run on every CPU.
+ *
+ */
+void fpu_initialize_cpu(void) {
+  if (!fpu_present) {
+    return;
+  }
+
+  uint32_t cr0 = (read_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE;
+  write_cr0(cr0);
+  if (fpu_have_fxsr) {
+    uint32_t cr4 = read_cr4() | CR4_OSFXSR;
+    if (fpu_sse) {
+      cr4 |= CR4_OSXMMEXCPT;
+    }
+    write_cr4(cr4);
+  }
+  fpu_reset();
+  fpu_stts();
+}
+
+/** fpu_have_sse:
+ *  Returns whether SSE instructions can be used
+ *
+ */
+bool fpu_have_sse(void) { return fpu_sse; }
+
+/** fpu_thread_switch:
+ *  Called by the scheduler before switching threads, lets the next thread
+ *  use the FPU freely if its registers are still loaded and traps its first
+ *  use otherwise. Must be called with interrupts disabled.
+ *
+ *  @param next The thread about to run
+ */
+void fpu_thread_switch(thread_t *next) {
+  if (!fpu_present) {
+    return;
+  }
+  if (next == fpu_owner) {
+    fpu_clts();
+  } else {
+    fpu_stts();
+  }
+}
+
+/** fpu_thread_free:
+ *  Drops the FPU state of a thread that exited. Must be called with
+ *  interrupts disabled.
+ *
+ *  @param thread The dead thread
+ */
+void fpu_thread_free(thread_t *thread) {
+  if (fpu_owner == thread) {
+    fpu_owner = NULL;
+  }
+  if (thread->fpu_state != NULL) {
+    kmem_cache_free(fpu_cache, thread->fpu_state);
+    thread->fpu_state = NULL;
+  }
+}
+
+/** fpu_kernel_begin:
+ *  Lets the kernel use the FPU and SSE registers until fpu_kernel_end, saving
+ *  whatever thread state is loaded first. Interrupts stay disabled meanwhile,
+ *  so keep the section short.
+ *
+ *  @return The flags to pass to fpu_kernel_end
+ */
+uint32_t fpu_kernel_begin(void) {
+  uint32_t flags = interrupts_save();
+  fpu_clts();
+  if (fpu_owner != NULL) {
+    fpu_save(fpu_owner->fpu_state);
+    fpu_owner = NULL;
+  }
+  return flags;
+}
+
+/** fpu_kernel_end:
+ *  Ends a section started by fpu_kernel_begin. The registers now belong to
+ *  nobody, the next thread to use them traps and gets its own back.
+ *
+ *  @param flags The value fpu_kernel_begin returned
+ */
+void fpu_kernel_end(uint32_t flags) {
+  fpu_stts();
+  interrupts_restore(flags);
+}
@@ -0,0 +1,25 @@
+#ifndef INCLUDE_FPU_H
+#define INCLUDE_FPU_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* fxsave area, or the fsave area on CPUs without FXSR */
+#define FPU_STATE_SIZE 512
+#define FPU_STATE_ALIGN 16
+
+/* MXCSR after reset, every SSE exception masked */
+#define FPU_MXCSR_DEFAULT 0x1f80
+
+struct thread;
+
+void fpu_initialize(void);
+void fpu_initialize_cpu(void);
+bool fpu_have_sse(void);
+void fpu_thread_switch(struct thread *next);
+void fpu_thread_free(struct thread *thread);
+uint32_t fpu_kernel_begin(void);
+void fpu_kernel_end(uint32_t flags);
+
+#endif /* INCLUDE_FPU_H */
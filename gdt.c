@@ -53,11 +53,35 @@ gdt_entry_t data_entry = {
     .base_high = 0x00,
 };
 
-// TODO: Apparently I need a TSS, but first I need to find out what a TSS is?
+/** gdt_make_entry:
+ *  Builds a descriptor for a segment of the given base and limit
+ *
+ *  @param base The linear address the segment starts at
+ *  @param limit The offset of the last byte in the segment
+ *  @param access The access byte
+ *  @param flags The flags nibble
+ */
+static gdt_entry_t gdt_make_entry(uint32_t base, uint32_t limit,
+                                  uint8_t access, uint8_t flags) {
+  return (gdt_entry_t){
+      .limit_low = limit & 0xffff,
+      .base_low = base & 0xffff,
+      .base_mid = (base >> 16) & 0xff,
+      .access = access,
+      .limit_mid = (limit >> 16) & 0xf,
+      .flags = flags,
+      .base_high = base >> 24,
+  };
+}
 
+/** gdt_init:
+ *  Loads the boot GDT with the flat kernel segments. Each CPU replaces it
+ *  with its own through gdt_init_cpu once the per-CPU data is set up.
+ *
+ */
 void gdt_init(void) {
   gdt_ptr_t gdt_ptr;
-  gdt_ptr.limit = sizeof(gdt_entry_t) * GDT_NUM_ENTRIES;
+  gdt_ptr.limit = sizeof(gdt_entry_t) * GDT_NUM_ENTRIES - 1;
   gdt_ptr.base = (uint32_t)&gdt_entries;
 
   gdt_entries[0] = null_entry;
@@ -66,3 +90,42 @@ void gdt_init(void) {
 
   gdt_load_and_set((uint32_t)&gdt_ptr);
 }
+
+/** gdt_init_cpu:
+ *  Builds and loads the calling CPU's own GDT: the flat kernel and user
+ *  segments, its TSS, and a data segment covering its per-CPU area, which is
+ *  loaded into fs
+ *
+ *  @param gdt The CPU's table of GDT_NUM_ENTRIES entries
+ *  @param tss The CPU's task state segment
+ *  @param percpu The CPU's per-CPU area
+ *  @param percpu_size The size of the per-CPU area
+ */
+void gdt_init_cpu(gdt_entry_t *gdt, tss_t *tss, const void *percpu,
+                  size_t percpu_size) {
+  *tss = (tss_t){.ss0 = GDT_KERNEL_DATA_SELECTOR,
+                 .iomap_base = sizeof(tss_t)};
+
+  for (unsigned int i = 0; i < GDT_NUM_ENTRIES; i++) {
+    gdt[i] = null_entry;
+  }
+  gdt[GDT_KERNEL_CODE_SELECTOR >> 3] = code_entry;
+  gdt[GDT_KERNEL_DATA_SELECTOR >> 3] = data_entry;
+  gdt[GDT_USER_CODE_SELECTOR >> 3] =
+      gdt_make_entry(0, 0xfffff, GDT_ACCESS_USER_CODE, GDT_FLAGS_PAGE_32);
+  gdt[GDT_USER_DATA_SELECTOR >> 3] =
+      gdt_make_entry(0, 0xfffff, GDT_ACCESS_USER_DATA, GDT_FLAGS_PAGE_32);
+  gdt[GDT_TSS_SELECTOR >> 3] = gdt_make_entry(
+      (uint32_t)tss, sizeof(tss_t) - 1, GDT_ACCESS_TSS, GDT_FLAGS_BYTE_32);
+  gdt[GDT_PERCPU_SELECTOR >> 3] =
+      gdt_make_entry((uint32_t)percpu, percpu_size - 1, GDT_ACCESS_DATA,
+                     GDT_FLAGS_BYTE_32);
+
+  gdt_ptr_t gdt_ptr;
+  gdt_ptr.limit = sizeof(gdt_entry_t) * GDT_NUM_ENTRIES - 1;
+  gdt_ptr.base = (uint32_t)gdt;
+  gdt_load_and_set((uint32_t)&gdt_ptr);
+
+  asm volatile("ltr %w0" : : "r"(GDT_TSS_SELECTOR));
+  asm volatile("mov %w0, %%fs" : : "r"(GDT_PERCPU_SELECTOR) : "memory");
+}
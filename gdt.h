@@ -5,7 +5,24 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define GDT_NUM_ENTRIES 3
+#define GDT_NUM_ENTRIES 7
+
+/* Segment selectors. The user code and data segments come right after the
+ * kernel ones, where sysexit expects them. Their selectors ask for ring 3. */
+#define GDT_KERNEL_CODE_SELECTOR 0x08
+#define GDT_KERNEL_DATA_SELECTOR 0x10
+#define GDT_USER_CODE_SELECTOR 0x1b
+#define GDT_USER_DATA_SELECTOR 0x23
+#define GDT_TSS_SELECTOR 0x28
+#define GDT_PERCPU_SELECTOR 0x30 /* loaded into fs, see smp.h */
+
+/* Access bytes of the user, system and per-CPU descriptors */
+#define GDT_ACCESS_USER_CODE 0xfa /* present, ring 3, readable code */
+#define GDT_ACCESS_USER_DATA 0xf2 /* present, ring 3, writable data */
+#define GDT_ACCESS_TSS 0x89       /* present, 32 bit available TSS */
+#define GDT_ACCESS_DATA 0x92      /* present, ring 0, writable data */
+#define GDT_FLAGS_BYTE_32 0x4     /* byte granular, 32 bit */
+#define GDT_FLAGS_PAGE_32 0xc     /* 4 KiB granular, 32 bit */
 
 struct gdt_entry {
   uint16_t limit_low; /* The lower 16 bits of the limit */
@@ -34,7 +51,44 @@ struct gdt_ptr {
 
 typedef struct gdt_ptr gdt_ptr_t;
 
+/* 32 bit task state segment. Only the ring 0 stack is used, for interrupts
+ * that arrive in user mode. esp0 follows the running thread, and sysenter
+ * reads it too, see syscall.c. */
+struct tss {
+  uint32_t link;
+  uint32_t esp0;
+  uint32_t ss0;
+  uint32_t esp1;
+  uint32_t ss1;
+  uint32_t esp2;
+  uint32_t ss2;
+  uint32_t cr3;
+  uint32_t eip;
+  uint32_t eflags;
+  uint32_t eax;
+  uint32_t ecx;
+  uint32_t edx;
+  uint32_t ebx;
+  uint32_t esp;
+  uint32_t ebp;
+  uint32_t esi;
+  uint32_t edi;
+  uint32_t es;
+  uint32_t cs;
+  uint32_t ss;
+  uint32_t ds;
+  uint32_t fs;
+  uint32_t gs;
+  uint32_t ldt;
+  uint16_t trap;
+  uint16_t iomap_base; /* past the end of the TSS, no I/O bitmap */
+} __attribute__((packed));
+
+typedef struct tss tss_t;
+
 void gdt_load_and_set(uint32_t);
 
 void gdt_init(void);
+void gdt_init_cpu(gdt_entry_t *gdt, tss_t *tss, const void *percpu,
+                  size_t percpu_size);
 #endif /* INCLUDE_TABLES_H */
@@ -1,5 +1,8 @@
 extern interrupt_handler
 
+SEGSEL_KERNEL_DS equ 0x10
+SEGSEL_PERCPU equ 0x30 ; GDT_PERCPU_SELECTOR, see gdt.h
+
 section .text
 
 global load_idt
@@ -22,69 +25,86 @@ disable_interrupts:
   ret
 
 %macro no_error_code_interrupt_handler 1
-global interrupt_handler_%1
-interrupt_handler_%1:
+global interrupt_handler_%+%1
+interrupt_handler_%+%1:
   push dword 0 ; push 0 as error code
   push dword %1 ; push the interrupt number
   jmp common_interrupt_handler ; jump to the common handler
 %endmacro
 
 %macro error_code_interrupt_handler 1
-global interrupt_handler_%1
-interrupt_handler_%1:
+global interrupt_handler_%+%1
+interrupt_handler_%+%1:
   push dword %1 ; push the interrupt number
   jmp common_interrupt_handler ; jump to the common handler
 %endmacro
 
+; common_interrupt_handler - builds an interrupt_frame_t (see interrupts.h) on
+; the stack and passes a pointer to it to interrupt_handler
 common_interrupt_handler: ; the common parts of the generic interrupt handler
   ; save the registers
-  push eax
-  push ebx
-  push ecx
-  push edx
-  push ebp
+  pushad
+  push ds
+  push es
+  push fs
+  push gs
+
+  ; run the handler with the kernel data segments. fs holds a user segment
+  ; when the interrupt came from user mode, point it back at the per-CPU data.
+  mov ax, SEGSEL_KERNEL_DS
+  mov ds, ax
+  mov es, ax
+  mov ax, SEGSEL_PERCPU
+  mov fs, ax
+  ; the C code expects the direction flag clear, the interrupted code may
+  ; have set it (memmove copies backwards with std). iret restores it.
+  cld
 
-  ; call the C function
+  ; call the C function with a pointer to the frame
+  push esp
   call interrupt_handler
+  add esp, 4
 
   ; restore the registers
-  pop ebp
-  pop edx
-  pop ecx
-  pop ebx
-  pop eax
+  pop gs
+  pop fs
+  pop es
+  pop ds
+  popad
 
-  ; restore the esp
+  ; pop the interrupt number and error code
   add esp, 8
 
   ; return to the code that got interrupted
   iret
 
-; protected mode exceptions
-no_error_code_interrupt_handler 0
-no_error_code_interrupt_handler 1
-no_error_code_interrupt_handler 2
-no_error_code_interrupt_handler 3
-no_error_code_interrupt_handler 4
-no_error_code_interrupt_handler 5
-no_error_code_interrupt_handler 6
-no_error_code_interrupt_handler 7
-error_code_interrupt_handler    8
-no_error_code_interrupt_handler 9
-error_code_interrupt_handler    10
-error_code_interrupt_handler    11
-error_code_interrupt_handler    12
-error_code_interrupt_handler    13
-error_code_interrupt_handler    14
-no_error_code_interrupt_handler 15
-no_error_code_interrupt_handler 16
-error_code_interrupt_handler    17
-no_error_code_interrupt_handler 18
-no_error_code_interrupt_handler 19
-
-; irqs
-no_error_code_interrupt_handler 32 ; timer interrupt
-no_error_code_interrupt_handler 33 ; keyboard interrupt
+; one stub for every vector, the CPU only pushes an error code for
+; exceptions 8, 10-14, 17, 21, 29 and 30
+%assign vector 0
+%rep 256
+%if vector == 8 || (vector >= 10 && vector <= 14) || vector == 17
+error_code_interrupt_handler vector
+%elif vector == 21 || vector == 29 || vector == 30
+error_code_interrupt_handler vector
+%else
+no_error_code_interrupt_handler vector
+%endif
+%assign vector vector + 1
+%endrep
+
+section .rodata
+
+; interrupt_stub_table - the address of the stub for each vector, used by
+; idt_init to fill the IDT
+global interrupt_stub_table
+interrupt_stub_table:
+%assign vector 0
+%rep 256
+  dd interrupt_handler_%+vector
+%assign vector vector + 1
+%endrep
+
+section .text
 
 global test_divide_by_zero
 test_divide_by_zero:
@@ -2,82 +2,324 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "clock.h"
+#include "console.h"
 #include "constants.h"
+#include "cpu.h"
 #include "interrupts.h"
 #include "io.h"
+#include "klog.h"
+#include "softirq.h"
+#include "str.h"
+#include "syscall.h"
+#include "thread.h"
 
 idt_entry_t idt_entries[IDT_NUM_ENTRIES];
 
-void interrupt_handler_0(void);
-void interrupt_handler_1(void);
-void interrupt_handler_2(void);
-void interrupt_handler_3(void);
-void interrupt_handler_4(void);
-void interrupt_handler_5(void);
-void interrupt_handler_6(void);
-void interrupt_handler_7(void);
-void interrupt_handler_8(void);
-void interrupt_handler_9(void);
-void interrupt_handler_10(void);
-void interrupt_handler_11(void);
-void interrupt_handler_12(void);
-void interrupt_handler_13(void);
-void interrupt_handler_14(void);
-void interrupt_handler_15(void);
-void interrupt_handler_16(void);
-void interrupt_handler_17(void);
-void interrupt_handler_18(void);
-void interrupt_handler_19(void);
-
-void interrupt_handler_32(void);
-void interrupt_handler_33(void);
-
-void pic_acknowledge(void) {
-  outb(PIC1_PORT_A, PIC_EOI);
-  outb(PIC2_PORT_A, PIC_EOI);
-}
-
-void interrupt_handler(__attribute__((unused)) cpu_state_t cpu, idt_info_t info,
-                       __attribute__((unused)) stack_state_t stack) {
-  unsigned char scan_code;
-  char *message = "key: _\n";
-
-  uint32_t idt_index = info.idt_index;
-
-  fprintf(SERIAL, "interrupt handler number: %%\n", idt_index);
-
-  switch (info.idt_index) {
-  /* TODO: What do I do here to keep these from looping */
-  /* forever?? */
-  case IDT_DIVIDE_ERROR_INDEX:
-    fprintf(SERIAL, "Divide Erro\n");
-    break;
-  case IDT_DOUBLE_FAULT_INDEX:
-    fprintf(SERIAL, "Double Fault\n");
-    break;
-  case 33:
-    scan_code = inb(0x60);
-    message[5] = scan_code;
-    fprintf(SERIAL, "interrupt number %%, key: %%\n", 33, scan_code);
-    fprintf(FRAMEBUFFER, "key: %%\n", scan_code);
-    if (scan_code == 0x50) {
-      fprintf(SERIAL, "down\n");
-      fprintf(FRAMEBUFFER, "down\n");
-    } else if (scan_code == 0x48) {
-      fprintf(SERIAL, "up\n");
-      fprintf(FRAMEBUFFER, "up\n");
+/* Entry points of the per-vector stubs, defined in interrupts.asm */
+extern const uint32_t interrupt_stub_table[IDT_NUM_ENTRIES];
+
+/* IRQ lines masked on the master and slave PIC */
+static uint8_t pic1_mask = 0xff;
+static uint8_t pic2_mask = 0xff;
+
+static void pic_mask(unsigned int irq);
+static void pic_unmask(unsigned int irq);
+static void pic_acknowledge(uint32_t vector);
+
+static const interrupt_controller_t pic_controller = {
+    .name = "8259",
+    .mask = pic_mask,
+    .unmask = pic_unmask,
+    .acknowledge = pic_acknowledge,
+};
+
+static const interrupt_controller_t *interrupt_controller_current =
+    &pic_controller;
+
+/* IRQ lines drivers have unmasked with irq_unmask, so they can be moved over
+ * when another controller takes over */
+static uint16_t interrupt_irqs_unmasked;
+
+/* Registered handlers, indexed by vector */
+static struct {
+  interrupt_handler_t handler;
+  void *ctx;
+} interrupt_handlers[INTERRUPT_NUM_VECTORS];
+
+static bool interrupt_report_unhandled;
+
+/* Number of interrupt handlers currently running, and the most seen at
+ * once */
+static uint32_t interrupt_nesting;
+static uint32_t interrupt_max_nesting;
+
+/* Per-vector counters and handler durations, kept by interrupt_handler */
+static interrupt_stats_t interrupt_stats[INTERRUPT_NUM_VECTORS];
+
+/* Frame of the innermost interrupt being handled */
+static interrupt_frame_t *interrupt_frame_current;
+static bool interrupt_have_tsc;
+
+/** register_interrupt_handler:
+ *  Installs the function called when the given vector fires, replacing any
+ *  previous handler
+ *
+ *  @param vector The interrupt vector
+ *  @param handler The function to call, or NULL to remove the handler
+ *  @param ctx Passed to the handler on every call
+ */
+void register_interrupt_handler(uint32_t vector, interrupt_handler_t handler,
+                                void *ctx) {
+  if (vector >= INTERRUPT_NUM_VECTORS) {
+    return;
+  }
+
+  uint32_t flags = interrupts_save();
+  interrupt_handlers[vector].handler = handler;
+  interrupt_handlers[vector].ctx = ctx;
+  interrupts_restore(flags);
+}
+
+/** interrupt_set_report_unhandled:
+ *  Turns reporting of vectors without a handler over serial on or off. Off by
+ *  default so stray interrupts don't cost a serial write.
+ *
+ *  @param enable Whether to report unhandled vectors
+ */
+void interrupt_set_report_unhandled(bool enable) {
+  interrupt_report_unhandled = enable;
+}
+
+/** interrupt_account:
+ *  Adds one run of a handler to the statistics of its vector
+ *
+ *  @param stats The statistics of the vector
+ *  @param cycles How long the handler and the acknowledge took
+ */
+static inline void interrupt_account(interrupt_stats_t *stats,
+                                     uint64_t cycles) {
+  uint32_t bucket = cycles == 0 ? 0 : 63 - __builtin_clzll(cycles);
+  if (bucket >= INTERRUPT_HISTOGRAM_BUCKETS) {
+    bucket = INTERRUPT_HISTOGRAM_BUCKETS - 1;
+  }
+
+  if (stats->count == 0 || cycles < stats->min_cycles) {
+    stats->min_cycles = cycles;
+  }
+  if (cycles > stats->max_cycles) {
+    stats->max_cycles = cycles;
+  }
+  stats->count++;
+  stats->total_cycles += cycles;
+  stats->histogram[bucket]++;
+}
+
+/** interrupt_handler:
+ *  Called by common_interrupt_handler for every interrupt with the state it
+ *  saved on the stack, runs the handler registered for the vector and then
+ *  gives the scheduler a chance to preempt the interrupted thread
+ *
+ *  @param frame The interrupted state
+ */
+void interrupt_handler(interrupt_frame_t *frame) {
+  uint32_t idt_index = frame->vector;
+  uint64_t start = interrupt_have_tsc ? rdtsc() : 0;
+
+  if (interrupt_nesting != 0 && idt_index < INTERRUPT_NUM_VECTORS) {
+    interrupt_stats[idt_index].nested++;
+  }
+  interrupt_nesting++;
+  if (interrupt_nesting > interrupt_max_nesting) {
+    interrupt_max_nesting = interrupt_nesting;
+  }
+
+  interrupt_frame_t *outer_frame = interrupt_frame_current;
+  interrupt_frame_current = frame;
+
+  if (idt_index < INTERRUPT_NUM_VECTORS &&
+      interrupt_handlers[idt_index].handler != NULL) {
+    interrupt_handlers[idt_index].handler(frame,
+                                          interrupt_handlers[idt_index].ctx);
+  } else if (interrupt_report_unhandled) {
+    klog(KLOG_WARNING, "unhandled interrupt: %02x", (unsigned int)idt_index);
+  }
+
+  if (idt_index >= IDT_IRQ_BASE_INDEX) {
+    interrupt_controller_current->acknowledge(idt_index);
+  }
+
+  if (idt_index < INTERRUPT_NUM_VECTORS) {
+    interrupt_account(&interrupt_stats[idt_index],
+                      interrupt_have_tsc ? rdtsc() - start : 0);
+  }
+
+  interrupt_nesting--;
+
+  /* the outermost handler runs the deferred work with interrupts enabled,
+   * unless it interrupted code that had them off. The frame stays current
+   * so the bottom halves can still see what was interrupted. */
+  if (interrupt_nesting == 0 && (frame->eflags & EFLAGS_INTERRUPT_ENABLE)) {
+    softirq_run();
+  }
+  interrupt_frame_current = outer_frame;
+
+  /* the interrupt is fully handled, so this is the place to switch to a
+   * thread it made runnable. Not when it arrived during a softirq though,
+   * that would leave the bottom half running on the thread switched away
+   * from; the outer handler switches once the softirq is done. Nor when
+   * the interrupted code had interrupts off, an NMI or exception there may
+   * have landed in the middle of a run queue update. */
+  if (!in_interrupt() && (frame->eflags & EFLAGS_INTERRUPT_ENABLE)) {
+    thread_interrupt_exit();
+  }
+}
+
+/** in_interrupt:
+ *  Returns whether the caller runs inside an interrupt handler or a softirq
+ *
+ */
+bool in_interrupt(void) { return interrupt_nesting != 0 || in_softirq(); }
+
+/** interrupt_current_frame:
+ *  Returns the state saved by the interrupt being handled, so code called
+ *  from a handler can see what was interrupted
+ *
+ *  @return The frame, NULL outside of interrupt handlers
+ */
+interrupt_frame_t *interrupt_current_frame(void) {
+  return interrupt_frame_current;
+}
+
+/** interrupt_get_stats:
+ *  Returns a consistent copy of the statistics of a vector
+ *
+ *  @param vector The interrupt vector
+ *  @param stats Where to store the statistics
+ */
+void interrupt_get_stats(uint32_t vector, interrupt_stats_t *stats) {
+  if (vector >= INTERRUPT_NUM_VECTORS) {
+    return;
+  }
+
+  uint32_t flags = interrupts_save();
+  *stats = interrupt_stats[vector];
+  interrupts_restore(flags);
+}
+
+/** interrupt_reset_stats:
+ *  Clears the statistics of every vector
+ *
+ */
+void interrupt_reset_stats(void) {
+  uint32_t flags = interrupts_save();
+  memset(interrupt_stats, 0, sizeof(interrupt_stats));
+  interrupt_max_nesting = 0;
+  interrupts_restore(flags);
+}
+
+/** interrupt_dump_stats:
+ *  Writes a line per vector that has fired to serial: its count, how often it
+ *  nested, the handler duration range in cycles and the non-empty histogram
+ *  buckets as log2(cycles):count
+ *
+ */
+void interrupt_dump_stats(void) {
+  fprintf(SERIAL, "irq: %3s %10s %6s %10s %10s %10s %8s\n", "vec", "count",
+          "nested", "min cyc", "avg cyc", "max cyc", "avg ns");
+
+  for (uint32_t vector = 0; vector < INTERRUPT_NUM_VECTORS; vector++) {
+    interrupt_stats_t stats;
+    interrupt_get_stats(vector, &stats);
+    if (stats.count == 0) {
+      continue;
     }
 
-    break;
-  default:
-    fprintf(SERIAL, "interrupt number not in list\n");
-    break;
+    uint64_t average = stats.total_cycles / stats.count;
+    fprintf(SERIAL, "irq: %02x  %10u %6u %10llu %10llu %10llu %8llu\n",
+            (unsigned int)vector, (unsigned int)stats.count,
+            (unsigned int)stats.nested, stats.min_cycles, average,
+            stats.max_cycles, clock_cycles_to_ns(average));
+
+    fprintf(SERIAL, "irq: %02x  hist", (unsigned int)vector);
+    for (uint32_t i = 0; i < INTERRUPT_HISTOGRAM_BUCKETS; i++) {
+      if (stats.histogram[i] != 0) {
+        fprintf(SERIAL, " %u:%u", (unsigned int)i,
+                (unsigned int)stats.histogram[i]);
+      }
+    }
+    fprintf(SERIAL, "\n");
   }
 
-  /* TODO: Check that we only send PIC pic_acknowledge if */
-  /*       interrupt is from PIC? */
-  if (info.idt_index >= 0x20 && info.idt_index <= 0x2f) {
-    pic_acknowledge();
+  fprintf(SERIAL, "irq: max nesting %u\n", (unsigned int)interrupt_max_nesting);
+}
+
+/* Names of the CPU exceptions, for exception_handler */
+static const char *const exception_names[IDT_NUM_EXCEPTIONS] = {
+    "Divide Error",
+    "Debug",
+    "NMI",
+    "Breakpoint",
+    "Overflow",
+    "Bound Range Exceeded",
+    "Invalid Opcode",
+    "Device Not Available",
+    "Double Fault",
+    "Coprocessor Segment Overrun",
+    "Invalid TSS",
+    "Segment Not Present",
+    "Stack Fault",
+    "General Protection",
+    "Page Fault",
+    "Reserved",
+    "x87 Floating Point",
+    "Alignment Check",
+    "Machine Check",
+    "SIMD Floating Point",
+    "Virtualization",
+    "Control Protection",
+    [22 ... 27] = "Reserved",
+    "Hypervisor Injection",
+    "VMM Communication",
+    "Security",
+    "Reserved",
+};
+
+/** exception_handler:
+ *  Reports a CPU exception over serial. Returning would only run the faulting
+ *  instruction again, so a fault in user mode ends the thread as if it had
+ *  called SYSCALL_EXIT and a fault in the kernel halts the CPU.
+ *
+ *  @param frame The state at the faulting instruction
+ *  @param ctx Unused
+ */
+static void exception_handler(interrupt_frame_t *frame,
+                              __attribute__((unused)) void *ctx) {
+  uint32_t vector = frame->vector;
+  bool user = (frame->cs & 0x3) == PL3;
+
+  klog(KLOG_ERROR, "%s%s (vector %u, error %x) at %x:%08x, cr2 %08x",
+       user ? "user " : "", exception_names[vector], (unsigned int)vector,
+       (unsigned int)frame->error_code, (unsigned int)frame->cs & 0xffff,
+       (unsigned int)frame->eip, (unsigned int)read_cr2());
+
+  if (user) {
+    thread_t *thread = thread_current();
+    klog(KLOG_ERROR, "ending thread %s",
+         thread != NULL ? thread->name : "(none)");
+    /* a fault from user mode is always the outermost interrupt, and this
+     * one never returns */
+    interrupt_nesting = 0;
+    interrupt_frame_current = NULL;
+    enable_interrupts();
+    syscall_dispatch(SYSCALL_EXIT, 0, 0, 0);
+  }
+
+  /* nothing else may get to run, get the message out now */
+  klog_flush();
+  console_flush();
+  for (;;) {
+    asm volatile("cli; hlt");
   }
 }
 
@@ -99,45 +341,185 @@ void set_idt_entry(unsigned int n, uint32_t handler, unsigned int type,
 void init_pic(void) {
   /* ICW1 */
   outb(PIC1_PORT_A, PIC1_ICW1); /* Master port A */
+  io_wait();
   outb(PIC2_PORT_A, PIC2_ICW1); /* Slave port A */
+  io_wait();
 
   /* ICW2 */
   outb(PIC1_PORT_B, PIC1_ICW2); /* Master offset of 0x20 in the IDT */
+  io_wait();
   outb(PIC2_PORT_B, PIC2_ICW2); /* Master offset of 0x28 in the IDT */
+  io_wait();
 
   /* ICW3 */
   outb(PIC1_PORT_B, PIC1_ICW3); /* Slaves attached to IR line 2 */
+  io_wait();
   outb(PIC2_PORT_B, PIC2_ICW3); /* This slave in IR line 2 of master */
+  io_wait();
 
   /* ICW4 */
   outb(PIC1_PORT_B, PIC1_ICW4); /* Set as master */
+  io_wait();
   outb(PIC2_PORT_B, PIC2_ICW4); /* Set as slave */
+  io_wait();
 
   // TODO: do I need to setup pic mask?
   // pic_mask(0xec, 0xff);
-  outb(PIC1_PORT_B, 0xfd);
+  outb(PIC1_PORT_B, pic1_mask);
   /* outb(PIC1_PORT_B, 0xfc); // to enable timer */
-  outb(PIC2_PORT_B, 0xff);
+  outb(PIC2_PORT_B, pic2_mask);
 }
 
-void idt_init(void) {
+/** pic_mask:
+ *  Stops the given IRQ line at the PIC
+ *
+ *  @param irq The IRQ line (0 - 15) to mask
+ */
+static void pic_mask(unsigned int irq) {
+  if (irq < 8) {
+    pic1_mask |= 1 << irq;
+    outb(PIC1_PORT_B, pic1_mask);
+  } else {
+    pic2_mask |= 1 << (irq - 8);
+    outb(PIC2_PORT_B, pic2_mask);
+  }
+}
+
+/** pic_unmask:
+ *  Lets the given IRQ line through the PIC
+ *
+ *  @param irq The IRQ line (0 - 15) to unmask
+ */
+static void pic_unmask(unsigned int irq) {
+  if (irq < 8) {
+    pic1_mask &= ~(1 << irq);
+    outb(PIC1_PORT_B, pic1_mask);
+  } else {
+    pic2_mask &= ~(1 << (irq - 8));
+    outb(PIC2_PORT_B, pic2_mask);
+    /* the slave is chained through IRQ2 on the master */
+    pic1_mask &= ~(1 << 2);
+    outb(PIC1_PORT_B, pic1_mask);
+  }
+}
+
+/** pic_acknowledge:
+ *  Sends the end of interrupt to the PIC that raised the vector, the slave
+ *  only for its own lines
+ *
+ *  @param vector The vector that was handled
+ */
+static void pic_acknowledge(uint32_t vector) {
+  if (vector >= PIC1_ICW2 + 16) {
+    return;
+  }
+  if (vector >= PIC2_ICW2) {
+    outb(PIC2_PORT_A, PIC_EOI);
+  }
+  outb(PIC1_PORT_A, PIC_EOI);
+}
+
+/** interrupt_set_controller:
+ *  Hands the legacy IRQ lines over to another interrupt controller. Lines
+ *  unmasked on the old controller are masked there and unmasked on the new
+ *  one.
+ *
+ *  @param controller The controller to use from now on
+ */
+void interrupt_set_controller(const interrupt_controller_t *controller) {
+  uint32_t flags = interrupts_save();
+
+  for (unsigned int irq = 0; irq < INTERRUPT_LEGACY_IRQS; irq++) {
+    if (interrupt_irqs_unmasked & (1 << irq)) {
+      interrupt_controller_current->mask(irq);
+    }
+  }
+  if (interrupt_controller_current == &pic_controller) {
+    /* leave nothing, the cascade included, to reach the old 8259s */
+    pic1_mask = pic2_mask = 0xff;
+    outb(PIC1_PORT_B, pic1_mask);
+    outb(PIC2_PORT_B, pic2_mask);
+  }
+  interrupt_controller_current = controller;
+  for (unsigned int irq = 0; irq < INTERRUPT_LEGACY_IRQS; irq++) {
+    if (interrupt_irqs_unmasked & (1 << irq)) {
+      controller->unmask(irq);
+    }
+  }
+
+  interrupts_restore(flags);
+}
+
+/** interrupt_controller:
+ *  Returns the controller delivering the legacy IRQ lines
+ *
+ */
+const interrupt_controller_t *interrupt_controller(void) {
+  return interrupt_controller_current;
+}
+
+/** irq_mask:
+ *  Stops a legacy IRQ line from interrupting
+ *
+ *  @param irq The IRQ line (0 - 15) to mask
+ */
+void irq_mask(unsigned int irq) {
+  if (irq >= INTERRUPT_LEGACY_IRQS) {
+    return;
+  }
+
+  uint32_t flags = interrupts_save();
+  interrupt_irqs_unmasked &= ~(1 << irq);
+  interrupt_controller_current->mask(irq);
+  interrupts_restore(flags);
+}
+
+/** irq_unmask:
+ *  Lets a legacy IRQ line interrupt, drivers call this once their handler is
+ *  registered
+ *
+ *  @param irq The IRQ line (0 - 15) to unmask
+ */
+void irq_unmask(unsigned int irq) {
+  if (irq >= INTERRUPT_LEGACY_IRQS) {
+    return;
+  }
+
+  uint32_t flags = interrupts_save();
+  interrupt_irqs_unmasked |= 1 << irq;
+  interrupt_controller_current->unmask(irq);
+  interrupts_restore(flags);
+}
+
+/** idt_load:
+ *  Loads the shared IDT on the calling CPU
+ *
+ */
+void idt_load(void) {
   idt_ptr_t idt_ptr;
   idt_ptr.limit = IDT_NUM_ENTRIES * sizeof(idt_entry_t) - 1;
   idt_ptr.base = (uint32_t)&idt_entries;
+  load_idt((uint32_t)&idt_ptr);
+}
 
-  set_idt_entry(IDT_DIVIDE_ERROR_INDEX, (uint32_t)&interrupt_handler_0,
-                IDT_INTERRUPT_GATE_TYPE, PL0);
-  set_idt_entry(1, (uint32_t)&interrupt_handler_1, IDT_INTERRUPT_GATE_TYPE,
-                PL0);
-  set_idt_entry(IDT_DOUBLE_FAULT_INDEX, (uint32_t)&interrupt_handler_8,
-                IDT_INTERRUPT_GATE_TYPE, PL0);
+void idt_init(void) {
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+  interrupt_have_tsc = edx & CPUID_FEATURE_EDX_TSC;
 
-  set_idt_entry(IDT_TIMER_INTERRUPT_INDEX, (uint32_t)&interrupt_handler_32,
-                IDT_INTERRUPT_GATE_TYPE, PL0);
-  set_idt_entry(IDT_KEYBOARD_INTERRUPT_INDEX, (uint32_t)&interrupt_handler_33,
-                IDT_INTERRUPT_GATE_TYPE, PL0);
+  for (unsigned int i = 0; i < IDT_NUM_ENTRIES; i++) {
+    set_idt_entry(i, interrupt_stub_table[i], IDT_INTERRUPT_GATE_TYPE, PL0);
+  }
 
-  load_idt((uint32_t)&idt_ptr);
+  /* every exception is fatal unless a driver takes it over, like the FPU
+   * does #NM. NMIs aren't exceptions and stay unhandled. */
+  for (unsigned int i = 0; i < IDT_NUM_EXCEPTIONS; i++) {
+    if (i != IDT_NMI_INDEX) {
+      register_interrupt_handler(i, exception_handler, NULL);
+    }
+  }
+
+  idt_load();
 
   init_pic();
 
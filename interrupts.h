@@ -9,11 +9,29 @@
 #define IDT_TRAP_GATE_TYPE 1
 
 #define IDT_DIVIDE_ERROR_INDEX 0x00
+#define IDT_NMI_INDEX 0x02
+#define IDT_DEVICE_NOT_AVAILABLE_INDEX 0x07
 #define IDT_DOUBLE_FAULT_INDEX 0x08
+#define IDT_PAGE_FAULT_INDEX 0x0e
+#define IDT_NUM_EXCEPTIONS 32 /* vectors reserved for CPU exceptions */
 #define IDT_TIMER_INTERRUPT_INDEX 0x20
 #define IDT_KEYBOARD_INTERRUPT_INDEX 0x21
+#define IDT_SERIAL_COM1_INTERRUPT_INDEX 0x24
+#define IDT_SYSCALL_INDEX 0x80 /* int 0x80 from user mode, see syscall.c */
 
-#define IDT_NUM_ENTRIES 48
+/* The legacy IRQ lines 0 - 15 arrive on vectors IDT_IRQ_BASE_INDEX + irq,
+ * whichever interrupt controller delivers them */
+#define IDT_IRQ_BASE_INDEX 0x20
+#define INTERRUPT_LEGACY_IRQS 16
+
+/* Local APIC vectors */
+#define IDT_APIC_TIMER_INDEX 0xf0
+#define IDT_APIC_ERROR_INDEX 0xfe
+#define IDT_APIC_SPURIOUS_INDEX 0xff
+
+#define IDT_NUM_ENTRIES 256
+
+#define INTERRUPT_NUM_VECTORS IDT_NUM_ENTRIES
 
 #define PIC1_PORT_A 0x20
 #define PIC1_PORT_B 0x21
@@ -22,7 +40,7 @@
 #define PIC2_PORT_B 0xA1
 
 #define PIC1_ICW1 0x11 /* Initialize the PIC and enable ICW4 */
-#define PIC2_ICW1 PIC1_ICW2
+#define PIC2_ICW1 0x11
 
 #define PIC1_ICW2 0x20 /* IRQ 0-7 will be remapped to IDT index 32 - 39 */
 #define PIC2_ICW2 0x28 /* IRQ 8-15 will be remapped to IDT index 40 - 47 */
@@ -58,41 +76,120 @@ struct idt_ptr {
 
 typedef struct idt_ptr idt_ptr_t;
 
-struct idt_info {
-  uint32_t idt_index;
-  uint32_t error_code;
-} __attribute__((packed));
-
-typedef struct idt_info idt_info_t;
-
-struct cpu_state {
-  unsigned int eax;
-  unsigned int ebx;
-  unsigned int ecx;
-  unsigned int edx;
-  unsigned int esp;
+/* interrupt_frame:
+ * The state saved by common_interrupt_handler in interrupts.asm, lowest
+ * address first: the segment registers, the pusha block, the vector and error
+ * code pushed by the per-vector stub, then the frame pushed by the CPU.
+ */
+struct interrupt_frame {
+  uint32_t gs;
+  uint32_t fs;
+  uint32_t es;
+  uint32_t ds;
+
+  uint32_t edi;
+  uint32_t esi;
+  uint32_t ebp;
+  uint32_t esp; /* esp before pusha, points at the vector field */
+  uint32_t ebx;
+  uint32_t edx;
+  uint32_t ecx;
+  uint32_t eax;
+
+  uint32_t vector;
+  uint32_t error_code; /* 0 for vectors without an error code */
+
+  uint32_t eip;
+  uint32_t cs;
+  uint32_t eflags;
+  /* only pushed by the CPU when the interrupt came from ring 3 */
+  uint32_t user_esp;
+  uint32_t user_ss;
 } __attribute__((packed));
 
-typedef struct cpu_state cpu_state_t;
-
-struct stack_state {
-  unsigned int error_code;
-  unsigned int eip;
-  unsigned int cs;
-  unsigned int eflags;
-} __attribute__((packed));
-
-typedef struct stack_state stack_state_t;
-
-void interrupt_handler(cpu_state_t cpu, idt_info_t info, stack_state_t stack);
+typedef struct interrupt_frame interrupt_frame_t;
+
+/** interrupt_handler_t:
+ *  A function registered for an interrupt vector. Called with interrupts
+ *  disabled; the interrupt controller is acknowledged after it returns.
+ */
+typedef void (*interrupt_handler_t)(interrupt_frame_t *frame, void *ctx);
+
+/* interrupt_controller:
+ * Delivers the legacy IRQ lines. The 8259 pair is used until another
+ * controller takes over with interrupt_set_controller.
+ */
+struct interrupt_controller {
+  const char *name;
+  void (*mask)(unsigned int irq);
+  void (*unmask)(unsigned int irq);
+  /* called after the handler of every vector from IDT_IRQ_BASE_INDEX up */
+  void (*acknowledge)(uint32_t vector);
+};
+
+typedef struct interrupt_controller interrupt_controller_t;
+
+/* Handler durations are counted in log2 buckets, bucket n holds durations of
+ * 2^n to 2^(n + 1) - 1 TSC cycles */
+#define INTERRUPT_HISTOGRAM_BUCKETS 32
+
+struct interrupt_stats {
+  uint32_t count;
+  uint32_t nested; /* times the vector arrived while a handler was running */
+  uint64_t total_cycles;
+  uint64_t min_cycles;
+  uint64_t max_cycles;
+  uint32_t histogram[INTERRUPT_HISTOGRAM_BUCKETS];
+};
+
+typedef struct interrupt_stats interrupt_stats_t;
+
+void interrupt_handler(interrupt_frame_t *frame);
+void register_interrupt_handler(uint32_t vector, interrupt_handler_t handler,
+                                void *ctx);
+void interrupt_set_report_unhandled(bool enable);
+bool in_interrupt(void);
+interrupt_frame_t *interrupt_current_frame(void);
+void interrupt_get_stats(uint32_t vector, interrupt_stats_t *stats);
+void interrupt_reset_stats(void);
+void interrupt_dump_stats(void);
 
 void load_idt(uint32_t address);
+void set_idt_entry(unsigned int n, uint32_t handler, unsigned int type,
+                   unsigned int privilege);
 
 void enable_interrupts(void);
 void disable_interrupts(void);
 void test_divide_by_zero(void);
 void test_double_fault(void);
 
+void interrupt_set_controller(const interrupt_controller_t *controller);
+const interrupt_controller_t *interrupt_controller(void);
+void irq_mask(unsigned int irq);
+void irq_unmask(unsigned int irq);
+
+/** interrupts_save:
+ *  Disables interrupts and returns the previous eflags so the caller can put
+ *  the interrupt flag back the way it found it
+ *
+ *  @return the eflags value before interrupts were disabled
+ */
+static inline uint32_t interrupts_save(void) {
+  uint32_t flags;
+  asm volatile("pushf\n\tpop %0\n\tcli" : "=r"(flags) : : "memory");
+  return flags;
+}
+
+/** interrupts_restore:
+ *  Restores the interrupt flag saved by interrupts_save
+ *
+ *  @param flags the eflags value returned by interrupts_save
+ */
+static inline void interrupts_restore(uint32_t flags) {
+  asm volatile("push %0\n\tpopf" : : "r"(flags) : "memory", "cc");
+}
+
 void idt_init(void);
+void idt_load(void);
 
 #endif /* INCLUDE_INTERRUPTS_H */
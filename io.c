@@ -3,9 +3,11 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "console.h"
 #include "io.h"
-#include "serial.h"
+#include "spinlock.h"
 #include "str.h"
+#include "vmm.h"
 
 /* The I/O ports */
 #define FB_COMMAND_PORT 0x3D4
@@ -56,29 +58,62 @@ static inline uint16_t vga_entry(unsigned char uc, uint8_t color) {
   return (uint16_t)uc | (uint16_t)color << 8;
 }
 
-static const size_t VGA_WIDTH = 80;
-static const size_t VGA_HEIGHT = 25;
+#define VGA_WIDTH 80
+#define VGA_HEIGHT 25
 
-size_t framebuffer_row;
-size_t framebuffer_column;
-uint8_t framebuffer_color;
-uint16_t *framebuffer_buffer;
+/* Physical address of the text mode buffer */
+#define VGA_TEXT_ADDRESS 0xB8000
+
+/* Every framebuffer_* entry point takes framebuffer_lock, the static helpers
+ * expect their caller to hold it */
+static spinlock_t framebuffer_lock;
+static size_t framebuffer_row;
+static size_t framebuffer_column;
+static uint8_t framebuffer_color;
+static uint16_t *framebuffer_buffer;
+
+/* Text is rendered into this RAM copy of the screen and only rows marked in
+ * framebuffer_dirty_rows are copied out to VGA memory by framebuffer_update */
+static uint16_t framebuffer_shadow[VGA_WIDTH * VGA_HEIGHT];
+static uint32_t framebuffer_dirty_rows;
+static unsigned short framebuffer_cursor;
+
+static void framebuffer_update(void);
+
+/** framebuffer_fill:
+ *  Fills a run of framebuffer entries with the same entry
+ *
+ *  @param dest the first entry to fill
+ *  @param entry the entry to fill with
+ *  @param count the number of entries to fill
+ */
+static inline void framebuffer_fill(uint16_t *dest, uint16_t entry,
+                                    size_t count) {
+  memset16(dest, entry, count);
+}
 
 /** framebuffer_initialize:
- *  Initializes a framebuffer
+ *  Initializes a framebuffer. The text buffer is mapped write combining, the
+ *  flushes only ever write whole rows to it.
  *
  */
 void framebuffer_initialize(void) {
+  spinlock_init(&framebuffer_lock, "framebuffer");
+  uint32_t flags = spinlock_lock_irqsave(&framebuffer_lock);
   framebuffer_row = 0;
   framebuffer_column = 0;
   framebuffer_color = vga_entry_color(VGA_COLOR_LIGHT_CYAN, VGA_COLOR_WHITE);
-  framebuffer_buffer = (uint16_t *)0xB8000;
-  for (size_t y = 0; y < VGA_HEIGHT; y++) {
-    for (size_t x = 0; x < VGA_WIDTH; x++) {
-      const size_t index = y * VGA_WIDTH + x;
-      framebuffer_buffer[index] = vga_entry(' ', framebuffer_color);
-    }
-  }
+  /* the direct map leaves video memory out, see VMM_LEGACY_VIDEO_BASE. If
+   * the window is full the shadow is kept but never shown. */
+  framebuffer_buffer =
+      vmm_map_mmio(VGA_TEXT_ADDRESS, sizeof(framebuffer_shadow),
+                   VMM_CACHE_WRITE_COMBINING);
+  framebuffer_fill(framebuffer_shadow, vga_entry(' ', framebuffer_color),
+                   VGA_WIDTH * VGA_HEIGHT);
+  framebuffer_dirty_rows = (1u << VGA_HEIGHT) - 1;
+  framebuffer_cursor = 0xffff;
+  framebuffer_update();
+  spinlock_unlock_irqrestore(&framebuffer_lock, flags);
 }
 
 /** framebuffer_move_cursor:
@@ -98,76 +133,151 @@ void framebuffer_move_cursor(unsigned short pos) {
  *
  *  @param color The color to set
  */
-void framebuffer_setcolor(uint8_t color) { framebuffer_color = color; }
+void framebuffer_setcolor(uint8_t color) {
+  uint32_t flags = spinlock_lock_irqsave(&framebuffer_lock);
+  framebuffer_color = color;
+  spinlock_unlock_irqrestore(&framebuffer_lock, flags);
+}
 
 /** framebuffer_putentryat:
- *  Puts an entry in the framebuffer
+ *  Puts an entry in the shadow framebuffer
  *
  *  @param c The character to put in the framebuffer
  *  @param color The color to use
  */
-void framebuffer_putentryat(char c, uint8_t color, size_t x, size_t y) {
+static void framebuffer_putentryat(char c, uint8_t color, size_t x,
+                                   size_t y) {
   const size_t index = y * VGA_WIDTH + x;
-  framebuffer_buffer[index] = vga_entry(c, color);
+  framebuffer_shadow[index] = vga_entry(c, color);
+  framebuffer_dirty_rows |= 1u << y;
+}
+
+static void framebuffer_clearline(size_t row) {
+  framebuffer_fill(&framebuffer_shadow[row * VGA_WIDTH],
+                   vga_entry(' ', framebuffer_color), VGA_WIDTH);
+  framebuffer_dirty_rows |= 1u << row;
+}
+
+/** framebuffer_scroll:
+ *  Moves every row of the shadow framebuffer up by one and clears the bottom
+ *  row
+ *
+ */
+static void framebuffer_scroll(void) {
+  memmove(framebuffer_shadow, &framebuffer_shadow[VGA_WIDTH],
+          (VGA_HEIGHT - 1) * VGA_WIDTH * sizeof(uint16_t));
+  framebuffer_dirty_rows = (1u << VGA_HEIGHT) - 1;
+  framebuffer_clearline(VGA_HEIGHT - 1);
 }
 
-void framebuffer_clearline(size_t row) {
-  for (size_t i = 0; i < VGA_WIDTH; i++) {
-    framebuffer_putentryat(0, framebuffer_color, i, row);
+/** framebuffer_advance_line:
+ *  Moves the write position to the start of the next line, scrolling once the
+ *  bottom of the screen is reached
+ *
+ */
+static void framebuffer_advance_line(void) {
+  framebuffer_column = 0;
+  if (++framebuffer_row == VGA_HEIGHT) {
+    framebuffer_row = VGA_HEIGHT - 1;
+    framebuffer_scroll();
   }
 }
 
 /** framebuffer_putchar:
- *  Puts a character in the framebuffer
+ *  Puts a character in the shadow framebuffer. Nothing reaches the screen
+ *  until the next framebuffer_update.
  *
  *  @param c the character to put
  */
-void framebuffer_putchar(char c) {
+static void framebuffer_putchar(char c) {
   if (c == 0x0a) {
-    framebuffer_newline();
+    framebuffer_advance_line();
   } else {
     framebuffer_putentryat(c, framebuffer_color, framebuffer_column,
                            framebuffer_row);
 
     if (++framebuffer_column == VGA_WIDTH) {
-      framebuffer_column = 0;
-      if (++framebuffer_row == VGA_HEIGHT) {
-        framebuffer_row = 0;
-      }
+      framebuffer_advance_line();
     }
-
-    framebuffer_move_cursor((framebuffer_row)*VGA_WIDTH + framebuffer_column);
   }
 }
 
-/** framebuffer_newline:
- *  Moves the cursor to a new line
+/** framebuffer_update:
+ *  Copies the dirty rows of the shadow framebuffer to VGA memory and moves the
+ *  hardware cursor if it changed
  *
  */
-void framebuffer_newline(void) {
-  if (++framebuffer_row == VGA_HEIGHT) {
-    framebuffer_row = 0;
+static void framebuffer_update(void) {
+  uint32_t dirty = framebuffer_dirty_rows;
+  framebuffer_dirty_rows = 0;
+
+  while (dirty && framebuffer_buffer != NULL) {
+    /* copy each run of consecutive dirty rows with a single block move */
+    size_t first = __builtin_ctz(dirty);
+    size_t last = first;
+    while (last + 1 < VGA_HEIGHT && (dirty & (1u << (last + 1)))) {
+      last++;
+    }
+    memcpy(&framebuffer_buffer[first * VGA_WIDTH],
+           &framebuffer_shadow[first * VGA_WIDTH],
+           (last - first + 1) * VGA_WIDTH * sizeof(uint16_t));
+    dirty &= ~((2u << last) - (1u << first));
   }
 
-  framebuffer_clearline(framebuffer_row);
+  unsigned short cursor = framebuffer_row * VGA_WIDTH + framebuffer_column;
+  if (cursor != framebuffer_cursor) {
+    framebuffer_cursor = cursor;
+    framebuffer_move_cursor(cursor);
+  }
+}
 
-  framebuffer_column = 0;
+/** framebuffer_flush:
+ *  Brings the screen up to date with the shadow framebuffer
+ *
+ */
+void framebuffer_flush(void) {
+  uint32_t flags = spinlock_lock_irqsave(&framebuffer_lock);
+  framebuffer_update();
+  spinlock_unlock_irqrestore(&framebuffer_lock, flags);
+}
 
-  framebuffer_move_cursor(framebuffer_row * framebuffer_column);
+/** framebuffer_newline:
+ *  Moves the cursor to a new line
+ *
+ */
+void framebuffer_newline(void) {
+  uint32_t flags = spinlock_lock_irqsave(&framebuffer_lock);
+  framebuffer_advance_line();
+  framebuffer_update();
+  spinlock_unlock_irqrestore(&framebuffer_lock, flags);
 }
 
-/** framebuffer_write:
- *  Writes data to the framebuffer
+/** framebuffer_append:
+ *  Renders data into the shadow framebuffer without flushing it
  *
  *  @param data a pointer to the start of the data to write
  *  @param size the number of bytes to write
  */
-void framebuffer_write(const char *data, size_t size) {
+static void framebuffer_append(const char *data, size_t size) {
   for (size_t i = 0; i < size; i++) {
     framebuffer_putchar(data[i]);
   }
 }
 
+/** framebuffer_write:
+ *  Writes data to the framebuffer, updating the screen and the cursor once
+ *  for the whole write
+ *
+ *  @param data a pointer to the start of the data to write
+ *  @param size the number of bytes to write
+ */
+void framebuffer_write(const char *data, size_t size) {
+  uint32_t flags = spinlock_lock_irqsave(&framebuffer_lock);
+  framebuffer_append(data, size);
+  framebuffer_update();
+  spinlock_unlock_irqrestore(&framebuffer_lock, flags);
+}
+
 /** framebuffer_writestring:
  *  Writes a null terminated string to the framebuffer
  *
@@ -184,38 +294,61 @@ void framebuffer_writestring(const char *data) {
  *  @param data a pointer to the start of the string to write
  */
 void framebuffer_writeline(const char *data) {
-  framebuffer_write(data, strlen(data));
-  framebuffer_newline();
+  uint32_t flags = spinlock_lock_irqsave(&framebuffer_lock);
+  framebuffer_append(data, strlen(data));
+  framebuffer_advance_line();
+  framebuffer_update();
+  spinlock_unlock_irqrestore(&framebuffer_lock, flags);
 }
 
-/** fprintf:
- *  Writes a null terminated string to the output specified
- *
- *  @param output the device to write output to
- *  @param string pointer to the string to write
- */
-void fprintf(unsigned short output, const char *string, ...) {
-  size_t i;
-  va_list args;
-  char formatted[strlen(string) + 1];
+/* Output of one fprintf call being gathered for a console */
+struct fprintf_chunk {
+  unsigned int console;
+  size_t size;
+  char data[CONSOLE_CHUNK_SIZE];
+};
 
-  size_t val_count = format_param_count(string);
+/** fprintf_console_sink:
+ *  vformat sink which gathers output into chunks, so the console is written
+ *  once per chunk rather than once per conversion
+ */
+static void fprintf_console_sink(void *ctx, const char *data, size_t size) {
+  struct fprintf_chunk *chunk = ctx;
 
-  uint8_t vals[val_count];
+  while (size > 0) {
+    size_t room = CONSOLE_CHUNK_SIZE - chunk->size;
+    if (room > size) {
+      room = size;
+    }
+    memcpy(&chunk->data[chunk->size], data, room);
+    chunk->size += room;
+    data += room;
+    size -= room;
 
-  va_start(args, val_count);
+    if (chunk->size == CONSOLE_CHUNK_SIZE) {
+      console_write(chunk->console, chunk->data, chunk->size);
+      chunk->size = 0;
+    }
+  }
+}
 
-  for (i = 0; i < val_count; i++) {
-    vals[i] = va_arg(args, int);
+/** fprintf:
+ *  Formats a string and writes it to the console specified. See vformat for
+ *  the supported conversions.
+ *
+ *  @param output the console to write output to, one of the CONSOLE_* ids
+ *  @param format pointer to the format string
+ */
+void fprintf(unsigned short output, const char *format, ...) {
+  if (console_get(output) == NULL) {
+    return;
   }
 
+  struct fprintf_chunk chunk = {.console = output, .size = 0};
+  va_list args;
+  va_start(args, format);
+  vformat(fprintf_console_sink, &chunk, format, args);
   va_end(args);
 
-  format_string(formatted, string, vals);
-
-  if (output == SERIAL) {
-    serial_writestring(SERIAL_COM1_BASE, formatted);
-  } else if (output == FRAMEBUFFER) {
-    framebuffer_writestring(formatted);
-  }
+  console_write(output, chunk.data, chunk.size);
 }
@@ -4,31 +4,153 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define SERIAL 0
-#define FRAMEBUFFER 1
+#include "console.h"
+
+/* The consoles fprintf is mostly used with */
+#define SERIAL CONSOLE_COM1
+#define FRAMEBUFFER CONSOLE_VGA
+
+/* Port I/O primitives. These are inline so the compiler can keep the port and
+ * data in registers and use the immediate port forms where the port is a
+ * constant below 0x100. */
 
 /** outb:
- *  Sends the given data to the given I/O port. Defined in io.asm
+ *  Sends the given data to the given I/O port
  *
  *  @param port The I/O port to send the data to
  *  @param data The data to send to the I/O port
  */
-void outb(unsigned short port, unsigned char data);
+static inline void outb(unsigned short port, unsigned char data) {
+  asm volatile("outb %0, %1" : : "a"(data), "Nd"(port));
+}
 
 /** inb:
- *  Read a byte from an I/O port. Defined in io.asm
+ *  Read a byte from an I/O port
  *
  *  @param  port The address of the I/O port
  *  @return      The read byte
  */
-unsigned char inb(unsigned short port);
+static inline unsigned char inb(unsigned short port) {
+  unsigned char data;
+  asm volatile("inb %1, %0" : "=a"(data) : "Nd"(port));
+  return data;
+}
+
+/** outw:
+ *  Sends a 16 bit word to the given I/O port
+ *
+ *  @param port The I/O port to send the data to
+ *  @param data The data to send to the I/O port
+ */
+static inline void outw(unsigned short port, uint16_t data) {
+  asm volatile("outw %0, %1" : : "a"(data), "Nd"(port));
+}
+
+/** inw:
+ *  Read a 16 bit word from an I/O port
+ *
+ *  @param  port The address of the I/O port
+ *  @return      The read word
+ */
+static inline uint16_t inw(unsigned short port) {
+  uint16_t data;
+  asm volatile("inw %1, %0" : "=a"(data) : "Nd"(port));
+  return data;
+}
+
+/** outl:
+ *  Sends a 32 bit double word to the given I/O port
+ *
+ *  @param port The I/O port to send the data to
+ *  @param data The data to send to the I/O port
+ */
+static inline void outl(unsigned short port, uint32_t data) {
+  asm volatile("outl %0, %1" : : "a"(data), "Nd"(port));
+}
+
+/** inl:
+ *  Read a 32 bit double word from an I/O port
+ *
+ *  @param  port The address of the I/O port
+ *  @return      The read double word
+ */
+static inline uint32_t inl(unsigned short port) {
+  uint32_t data;
+  asm volatile("inl %1, %0" : "=a"(data) : "Nd"(port));
+  return data;
+}
+
+/** outsb:
+ *  Sends a block of bytes to the given I/O port with rep outsb
+ *
+ *  @param port The I/O port to send the data to
+ *  @param data The address of the first byte to send
+ *  @param count The number of bytes to send
+ */
+static inline void outsb(unsigned short port, const void *data, size_t count) {
+  asm volatile("cld\n\trep outsb"
+               : "+S"(data), "+c"(count)
+               : "d"(port)
+               : "memory");
+}
+
+/** insb:
+ *  Reads a block of bytes from the given I/O port with rep insb
+ *
+ *  @param port The I/O port to read from
+ *  @param data The buffer to read into
+ *  @param count The number of bytes to read
+ */
+static inline void insb(unsigned short port, void *data, size_t count) {
+  asm volatile("cld\n\trep insb"
+               : "+D"(data), "+c"(count)
+               : "d"(port)
+               : "memory");
+}
+
+/** outsw:
+ *  Sends a block of 16 bit words to the given I/O port with rep outsw
+ *
+ *  @param port The I/O port to send the data to
+ *  @param data The address of the first word to send
+ *  @param count The number of words to send
+ */
+static inline void outsw(unsigned short port, const void *data, size_t count) {
+  asm volatile("cld\n\trep outsw"
+               : "+S"(data), "+c"(count)
+               : "d"(port)
+               : "memory");
+}
+
+/** insw:
+ *  Reads a block of 16 bit words from the given I/O port with rep insw
+ *
+ *  @param port The I/O port to read from
+ *  @param data The buffer to read into
+ *  @param count The number of words to read
+ */
+static inline void insw(unsigned short port, void *data, size_t count) {
+  asm volatile("cld\n\trep insw"
+               : "+D"(data), "+c"(count)
+               : "d"(port)
+               : "memory");
+}
+
+/** io_wait:
+ *  Waits roughly a microsecond by writing to the unused POST diagnostic port,
+ *  for devices like the PIC that need time between accesses
+ *
+ */
+static inline void io_wait(void) { outb(0x80, 0); }
 
 void framebuffer_initialize(void);
 void framebuffer_move_cursor(unsigned short pos);
+void framebuffer_write(const char *data, size_t size);
 void framebuffer_writestring(const char *data);
 void framebuffer_writeline(const char *data);
 void framebuffer_newline(void);
+void framebuffer_flush(void);
 
-void fprintf(unsigned short output, const char *string, ...);
+void fprintf(unsigned short output, const char *format, ...);
 
 #endif /* INCLUDE_IO_H */
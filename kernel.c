@@ -2,9 +2,29 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "acpi.h"
+#include "apic.h"
+#include "clock.h"
+#include "console.h"
+#include "fpu.h"
 #include "interrupts.h"
 #include "io.h"
+#include "keyboard.h"
+#include "klog.h"
+#include "kmem.h"
+#include "ksym.h"
+#include "multiboot.h"
+#include "pmm.h"
+#include "profile.h"
 #include "serial.h"
+#include "smp.h"
+#include "softirq.h"
+#include "spinlock.h"
+#include "str.h"
+#include "syscall.h"
+#include "thread.h"
+#include "timer.h"
+#include "vmm.h"
 #include "gdt.h"
 
 /* Check if the compiler thinks we are targeting the wrong operating system. */
@@ -18,26 +38,278 @@
 #error "This tutorial needs to be compiled with a ix86-elf compiler"
 #endif
 
-void kernel_main(void) {
+/* Interval of the uptime report sent over serial */
+#define KERNEL_HEARTBEAT_NS (10 * CLOCK_NS_PER_SECOND)
+
+static timer_t kernel_heartbeat_timer;
+
+/** kernel_heartbeat:
+ *  Periodic timer callback logging the uptime
+ *
+ */
+static void kernel_heartbeat(__attribute__((unused)) timer_t *timer,
+                             __attribute__((unused)) void *ctx) {
+  klog(KLOG_INFO, "uptime: %llu ms", clock_monotonic_ns() / 1000000);
+}
+
+/** kernel_dump_memory:
+ *  Writes the state of both memory allocators to serial
+ *
+ */
+static void kernel_dump_memory(void) {
+  pmm_dump();
+  kmem_dump();
+}
+
+/** kernel_profile_start:
+ *  Starts a profiling session at the default rate
+ *
+ */
+static void kernel_profile_start(void) { profile_start(PROFILE_DEFAULT_HZ); }
+
+/** kernel_profile_report:
+ *  Stops the profiler and reports the hottest functions
+ *
+ */
+static void kernel_profile_report(void) {
+  profile_stop();
+  profile_report();
+}
+
+/** kernel_profile_samples:
+ *  Stops the profiler and dumps the raw samples
+ *
+ */
+static void kernel_profile_samples(void) {
+  profile_stop();
+  profile_dump_samples();
+}
+
+/** kernel_serial_stats:
+ *  Writes the serial receive error counters to serial
+ *
+ */
+static void kernel_serial_stats(void) {
+  fprintf(SERIAL, "serial: %u overruns, %u dropped, %u unsent\n",
+          (unsigned int)serial_rx_overruns(),
+          (unsigned int)serial_rx_dropped(),
+          (unsigned int)serial_tx_dropped());
+}
+
+/** kernel_serial_flow:
+ *  Turns RTS/CTS flow control on COM1 on or off. It is off by default, a
+ *  port without a cable or a peer that doesn't drive CTS would stall output.
+ *
+ */
+static void kernel_serial_flow(void) {
+  bool enabled = !serial_get_flow_control(SERIAL_COM1_BASE);
+  serial_set_flow_control(SERIAL_COM1_BASE, enabled);
+  fprintf(SERIAL, "serial: flow control %s\n", enabled ? "on" : "off");
+}
+
+static void kernel_help(void);
+
+/* Diagnostics, run from a function key or by name from the serial shell */
+struct kernel_command {
+  const char *name;
+  uint16_t key; /* 0 if there is no function key for it */
+  void (*run)(void);
+  const char *help;
+};
+
+static const struct kernel_command kernel_commands[] = {
+    {"threads", KEY_F1, thread_dump, "dump the threads"},
+    {"memory", KEY_F2, kernel_dump_memory, "dump the memory allocators"},
+    {"irq", KEY_F3, interrupt_dump_stats, "dump the interrupt statistics"},
+    {"irq-reset", KEY_F4, interrupt_reset_stats,
+     "clear the interrupt statistics"},
+    {"profile", KEY_F5, kernel_profile_start, "start the profiler"},
+    {"report", KEY_F6, kernel_profile_report,
+     "stop the profiler, report the hottest functions"},
+    {"samples", KEY_F7, kernel_profile_samples,
+     "stop the profiler, dump the raw samples"},
+    {"serial", 0, kernel_serial_stats, "show the serial error counters"},
+    {"flow", 0, kernel_serial_flow, "toggle serial RTS/CTS flow control"},
+    {"cpus", 0, smp_dump, "list the processors"},
+    {"softirq", 0, softirq_dump, "dump the deferred work statistics"},
+    {"syscall-bench", 0, syscall_bench,
+     "time system calls from user mode, int 0x80 against sysenter"},
+    {"locks", 0, spinlock_dump, "dump the lock contention counters"},
+    {"locks-reset", 0, spinlock_reset_stats,
+     "clear the lock contention counters"},
+    {"help", 0, kernel_help, "list the commands"},
+};
+
+#define KERNEL_COMMAND_COUNT                                                   \
+  (sizeof(kernel_commands) / sizeof(kernel_commands[0]))
+
+/* Longest line read by the serial shell */
+#define KERNEL_SHELL_LINE_MAX 80
+
+/** kernel_help:
+ *  Lists the commands over serial
+ *
+ */
+static void kernel_help(void) {
+  for (size_t i = 0; i < KERNEL_COMMAND_COUNT; i++) {
+    fprintf(SERIAL, "  %-10s %s\n", kernel_commands[i].name,
+            kernel_commands[i].help);
+  }
+}
+
+/** kernel_handle_key:
+ *  Echoes a key press to serial and the framebuffer and runs the command
+ *  bound to it, if any
+ *
+ *  @param event The key event to handle
+ */
+static void kernel_handle_key(const key_event_t *event) {
+  if (event->released) {
+    return;
+  }
+
+  klog(KLOG_DEBUG, "key: %04x", event->key);
+  fprintf(FRAMEBUFFER, "key: %04x\n", event->key);
+  if (event->key == KEY_DOWN) {
+    klog(KLOG_DEBUG, "down");
+    fprintf(FRAMEBUFFER, "down\n");
+  } else if (event->key == KEY_UP) {
+    klog(KLOG_DEBUG, "up");
+    fprintf(FRAMEBUFFER, "up\n");
+  }
+
+  for (size_t i = 0; i < KERNEL_COMMAND_COUNT; i++) {
+    if (kernel_commands[i].key != 0 && kernel_commands[i].key == event->key) {
+      kernel_commands[i].run();
+    }
+  }
+}
+
+/** kernel_keyboard_thread:
+ *  Decodes scan codes and handles key events as they arrive
+ *
+ */
+static void kernel_keyboard_thread(__attribute__((unused)) void *arg) {
+  for (;;) {
+    key_event_t event;
+    keyboard_wait_event(&event);
+    kernel_handle_key(&event);
+  }
+}
+
+/** kernel_shell_thread:
+ *  Reads commands from COM1 and runs them, for headless runs
+ *
+ */
+static void kernel_shell_thread(__attribute__((unused)) void *arg) {
+  char line[KERNEL_SHELL_LINE_MAX];
+  for (;;) {
+    serial_writestring(SERIAL_COM1_BASE, "> ");
+    if (serial_readline(SERIAL_COM1_BASE, line, sizeof(line)) == 0) {
+      continue;
+    }
+
+    size_t i = 0;
+    while (i < KERNEL_COMMAND_COUNT && strcmp(line, kernel_commands[i].name)) {
+      i++;
+    }
+    if (i < KERNEL_COMMAND_COUNT) {
+      kernel_commands[i].run();
+    } else {
+      fprintf(SERIAL, "unknown command: %s, try help\n", line);
+    }
+  }
+}
+
+/** kernel_main:
+ *  Entered from _start in boot.asm
+ *
+ *  @param magic The value the bootloader left in eax
+ *  @param mbi_address The physical address of the multiboot information
+ *                    structure the bootloader left in ebx
+ */
+void kernel_main(uint32_t magic, uint32_t mbi_address) {
+  gdt_init();
+  smp_initialize_boot_cpu();
+  vmm_initialize();
+
   /* Initialize framebuffer */
   framebuffer_initialize();
 
-  gdt_init();
   idt_init();
+  softirq_initialize();
+  klog_initialize();
+  spinlock_initialize();
+  fpu_initialize();
+  str_initialize();
+  syscall_initialize();
+  if (acpi_initialize()) {
+    apic_initialize();
+  }
+  keyboard_initialize();
+  clock_initialize(CLOCK_DEFAULT_HZ);
+  apic_timer_initialize();
+  timer_initialize();
 
   framebuffer_writeline("Helloooooo kernel world");
   framebuffer_writeline("Now we can even read from the keyboard :)");
 
   serial_initialize(SERIAL_COM1_BASE, 1);
   serial_writestring(SERIAL_COM1_BASE, "Helloooo serial port?");
+  console_initialize();
 
   fprintf(SERIAL, "printing to serial\n");
   fprintf(FRAMEBUFFER, "printing to framebuffer");
 
-  fprintf(FRAMEBUFFER, "printing a format string: %%\n", 0x11);
-  fprintf(SERIAL, "printing a format string: %%\n", 0x11);
+  fprintf(FRAMEBUFFER, "printing a format string: %02x\n", 0x11);
+  fprintf(SERIAL, "printing a format string: %02x\n", 0x11);
+
+  klog(KLOG_INFO, "tsc: %llu Hz, pit: %u Hz, uptime: %llu ns", clock_tsc_hz(),
+       (unsigned int)clock_tick_hz(), clock_monotonic_ns());
+
+  multiboot_info_t *mbi = NULL;
+  if (magic == MULTIBOOT_BOOTLOADER_MAGIC) {
+    mbi = phys_to_virt(mbi_address);
+    pmm_initialize(mbi);
+    pmm_dump();
+  } else {
+    klog(KLOG_WARNING, "not booted by a multiboot loader: %08x",
+         (unsigned int)magic);
+  }
+
+  kmem_initialize();
+  kmem_dump();
+  if (mbi != NULL) {
+    ksym_initialize(mbi);
+  }
+  thread_initialize();
+  smp_initialize();
+
+  timer_add_periodic(&kernel_heartbeat_timer,
+                     clock_monotonic_ns() + KERNEL_HEARTBEAT_NS,
+                     KERNEL_HEARTBEAT_NS, kernel_heartbeat, NULL);
+
+  thread_create("shell", THREAD_PRIORITY_DEFAULT, kernel_shell_thread, NULL);
+  if (thread_create("keyboard", THREAD_PRIORITY_HIGH, kernel_keyboard_thread,
+                    NULL) == NULL) {
+    /* without a heap the keys are handled on the boot thread */
+    kernel_keyboard_thread(NULL);
+  }
 
+  /* From here on the boot thread is the idle thread */
   for (;;) {
-    asm("hlt");
+    /* logging only queues messages, the console output happens here */
+    klog_flush();
+    disable_interrupts();
+    /* work the last interrupt exit left behind */
+    softirq_run();
+    if (thread_runnable()) {
+      enable_interrupts();
+      thread_yield();
+    } else if (softirq_pending()) {
+      enable_interrupts();
+    } else {
+      timer_idle();
+    }
   }
 }
@@ -0,0 +1,315 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interrupts.h"
+#include "io.h"
+#include "keyboard.h"
+#include "thread.h"
+
+/* Raw scan codes, written only by the IRQ1 handler and read only by
+ * keyboard_process. head and tail are free running counters, masked on every
+ * access, so the ring needs no lock with a single producer and consumer. */
+static uint8_t keyboard_scancodes[KEYBOARD_SCANCODE_BUFFER_SIZE];
+static volatile uint32_t keyboard_scancode_head;
+static volatile uint32_t keyboard_scancode_tail;
+
+/* Decoded key events, written by keyboard_process and read by consumers */
+static key_event_t keyboard_events[KEYBOARD_EVENT_BUFFER_SIZE];
+static volatile uint32_t keyboard_event_head;
+static volatile uint32_t keyboard_event_tail;
+
+static volatile uint32_t keyboard_dropped_count;
+
+/* Thread blocked in keyboard_wait_event, woken by the IRQ1 handler */
+static thread_t *volatile keyboard_waiter;
+
+/* Decoder state */
+static bool keyboard_extended;
+static uint8_t keyboard_skip; /* bytes left of a pause key sequence */
+static uint8_t keyboard_held; /* KEYBOARD_HELD_* bits */
+static uint8_t keyboard_locks;
+
+#define KEYBOARD_HELD_LEFT_SHIFT 0x01
+#define KEYBOARD_HELD_RIGHT_SHIFT 0x02
+#define KEYBOARD_HELD_LEFT_CTRL 0x04
+#define KEYBOARD_HELD_RIGHT_CTRL 0x08
+#define KEYBOARD_HELD_LEFT_ALT 0x10
+#define KEYBOARD_HELD_RIGHT_ALT 0x20
+
+#define KEYBOARD_PREFIX_EXTENDED 0xe0
+#define KEYBOARD_PREFIX_PAUSE 0xe1
+#define KEYBOARD_BREAK 0x80
+
+/* US layout characters for set 1 make codes 0x00 - 0x39 */
+static const char keyboard_ascii[] = {
+    0,   27,  '1', '2', '3',  '4', '5', '6', /* 0x00 */
+    '7', '8', '9', '0', '-',  '=', '\b', '\t',
+    'q', 'w', 'e', 'r', 't',  'y', 'u', 'i', /* 0x10 */
+    'o', 'p', '[', ']', '\n', 0,   'a', 's',
+    'd', 'f', 'g', 'h', 'j',  'k', 'l', ';', /* 0x20 */
+    '\'', '`', 0,  '\\', 'z', 'x', 'c', 'v',
+    'b', 'n', 'm', ',', '.',  '/', 0,   '*', /* 0x30 */
+    0,   ' ',
+};
+
+static const char keyboard_ascii_shift[] = {
+    0,   27,  '!', '@', '#',  '$', '%', '^', /* 0x00 */
+    '&', '*', '(', ')', '_',  '+', '\b', '\t',
+    'Q', 'W', 'E', 'R', 'T',  'Y', 'U', 'I', /* 0x10 */
+    'O', 'P', '{', '}', '\n', 0,   'A', 'S',
+    'D', 'F', 'G', 'H', 'J',  'K', 'L', ':', /* 0x20 */
+    '"', '~', 0,   '|', 'Z',  'X', 'C', 'V',
+    'B', 'N', 'M', '<', '>',  '?', 0,   '*', /* 0x30 */
+    0,   ' ',
+};
+
+/** keyboard_interrupt_handler:
+ *  IRQ1 top half, only moves the scan code from the controller into the ring
+ *
+ */
+static void
+keyboard_interrupt_handler(__attribute__((unused)) interrupt_frame_t *frame,
+                           __attribute__((unused)) void *ctx) {
+  uint8_t scan_code = inb(KEYBOARD_DATA_PORT);
+  uint32_t head = keyboard_scancode_head;
+
+  if (head - keyboard_scancode_tail == KEYBOARD_SCANCODE_BUFFER_SIZE) {
+    keyboard_dropped_count++;
+    return;
+  }
+
+  keyboard_scancodes[head & (KEYBOARD_SCANCODE_BUFFER_SIZE - 1)] = scan_code;
+  /* publish the byte before the new head */
+  asm volatile("" : : : "memory");
+  keyboard_scancode_head = head + 1;
+
+  if (keyboard_waiter != NULL) {
+    thread_wake(keyboard_waiter);
+  }
+}
+
+/** keyboard_modifiers:
+ *  Returns the KEYBOARD_MOD_* bits for the current decoder state
+ *
+ */
+static uint8_t keyboard_modifiers(void) {
+  uint8_t modifiers = keyboard_locks;
+  if (keyboard_held &
+      (KEYBOARD_HELD_LEFT_SHIFT | KEYBOARD_HELD_RIGHT_SHIFT)) {
+    modifiers |= KEYBOARD_MOD_SHIFT;
+  }
+  if (keyboard_held & (KEYBOARD_HELD_LEFT_CTRL | KEYBOARD_HELD_RIGHT_CTRL)) {
+    modifiers |= KEYBOARD_MOD_CTRL;
+  }
+  if (keyboard_held & (KEYBOARD_HELD_LEFT_ALT | KEYBOARD_HELD_RIGHT_ALT)) {
+    modifiers |= KEYBOARD_MOD_ALT;
+  }
+  return modifiers;
+}
+
+/** keyboard_held_bit:
+ *  Returns the KEYBOARD_HELD_* bit tracking a modifier key, 0 for other keys
+ *
+ *  @param key The KEY_* code
+ */
+static uint8_t keyboard_held_bit(uint16_t key) {
+  switch (key) {
+  case KEY_LEFT_SHIFT:
+    return KEYBOARD_HELD_LEFT_SHIFT;
+  case KEY_RIGHT_SHIFT:
+    return KEYBOARD_HELD_RIGHT_SHIFT;
+  case KEY_LEFT_CTRL:
+    return KEYBOARD_HELD_LEFT_CTRL;
+  case KEY_RIGHT_CTRL:
+    return KEYBOARD_HELD_RIGHT_CTRL;
+  case KEY_LEFT_ALT:
+    return KEYBOARD_HELD_LEFT_ALT;
+  case KEY_RIGHT_ALT:
+    return KEYBOARD_HELD_RIGHT_ALT;
+  default:
+    return 0;
+  }
+}
+
+/** keyboard_translate:
+ *  Returns the character a key types under the given modifiers
+ *
+ *  @param key The KEY_* code
+ *  @param modifiers The KEYBOARD_MOD_* state
+ */
+static char keyboard_translate(uint16_t key, uint8_t modifiers) {
+  if (key >= sizeof(keyboard_ascii)) {
+    return 0;
+  }
+
+  char c = keyboard_ascii[key];
+  bool shift = modifiers & KEYBOARD_MOD_SHIFT;
+
+  if (c >= 'a' && c <= 'z') {
+    /* caps lock only affects letters */
+    if (modifiers & KEYBOARD_MOD_CAPS_LOCK) {
+      shift = !shift;
+    }
+    if (modifiers & KEYBOARD_MOD_CTRL) {
+      return c & 0x1f;
+    }
+  }
+
+  return shift ? keyboard_ascii_shift[key] : c;
+}
+
+/** keyboard_push_event:
+ *  Adds an event to the queue, counting it as dropped if the queue is full
+ *
+ *  @param event The event to add
+ */
+static void keyboard_push_event(const key_event_t *event) {
+  uint32_t head = keyboard_event_head;
+
+  if (head - keyboard_event_tail == KEYBOARD_EVENT_BUFFER_SIZE) {
+    keyboard_dropped_count++;
+    return;
+  }
+
+  keyboard_events[head & (KEYBOARD_EVENT_BUFFER_SIZE - 1)] = *event;
+  asm volatile("" : : : "memory");
+  keyboard_event_head = head + 1;
+}
+
+/** keyboard_decode:
+ *  Feeds one set 1 scan code through the decoder, queueing a key event once a
+ *  complete make or break code has been seen
+ *
+ *  @param scan_code The byte read from the controller
+ */
+static void keyboard_decode(uint8_t scan_code) {
+  if (keyboard_skip > 0) {
+    keyboard_skip--;
+    return;
+  }
+  if (scan_code == KEYBOARD_PREFIX_PAUSE) {
+    /* pause sends e1 1d 45 e1 9d c5 and has no break code */
+    keyboard_skip = 5;
+    return;
+  }
+  if (scan_code == KEYBOARD_PREFIX_EXTENDED) {
+    keyboard_extended = true;
+    return;
+  }
+
+  key_event_t event;
+  event.released = scan_code & KEYBOARD_BREAK;
+  event.key = scan_code & ~KEYBOARD_BREAK;
+  if (keyboard_extended) {
+    event.key |= KEYBOARD_EXTENDED;
+    keyboard_extended = false;
+  }
+
+  /* e0 2a / e0 aa are fake shifts wrapped around print screen */
+  if (event.key == (KEYBOARD_EXTENDED | KEY_LEFT_SHIFT)) {
+    return;
+  }
+
+  uint8_t held = keyboard_held_bit(event.key);
+  if (held) {
+    if (event.released) {
+      keyboard_held &= ~held;
+    } else {
+      keyboard_held |= held;
+    }
+  } else if (event.key == KEY_CAPS_LOCK && !event.released) {
+    keyboard_locks ^= KEYBOARD_MOD_CAPS_LOCK;
+  }
+
+  event.modifiers = keyboard_modifiers();
+  event.ascii = event.released ? 0 : keyboard_translate(event.key,
+                                                        event.modifiers);
+  keyboard_push_event(&event);
+}
+
+/** keyboard_process:
+ *  Bottom half, decodes every scan code received since the last call into
+ *  key events. Runs with interrupts enabled.
+ *
+ */
+void keyboard_process(void) {
+  uint32_t tail = keyboard_scancode_tail;
+
+  while (tail != keyboard_scancode_head) {
+    asm volatile("" : : : "memory");
+    keyboard_decode(
+        keyboard_scancodes[tail & (KEYBOARD_SCANCODE_BUFFER_SIZE - 1)]);
+    tail++;
+    keyboard_scancode_tail = tail;
+  }
+}
+
+/** keyboard_pending:
+ *  Returns whether there are scan codes waiting for keyboard_process
+ *
+ */
+bool keyboard_pending(void) {
+  return keyboard_scancode_tail != keyboard_scancode_head;
+}
+
+/** keyboard_poll_event:
+ *  Takes the oldest key event off the queue without waiting
+ *
+ *  @param event Where to store the event
+ *  @return true if an event was returned, false if the queue was empty
+ */
+bool keyboard_poll_event(key_event_t *event) {
+  uint32_t tail = keyboard_event_tail;
+
+  if (tail == keyboard_event_head) {
+    return false;
+  }
+
+  asm volatile("" : : : "memory");
+  *event = keyboard_events[tail & (KEYBOARD_EVENT_BUFFER_SIZE - 1)];
+  keyboard_event_tail = tail + 1;
+  return true;
+}
+
+/** keyboard_wait_event:
+ *  Takes the oldest key event off the queue, blocking the calling thread until
+ *  a key arrives if the queue is empty. Scan codes are decoded on the calling
+ *  thread rather than in the interrupt handler.
+ *
+ *  @param event Where to store the event
+ */
+void keyboard_wait_event(key_event_t *event) {
+  for (;;) {
+    keyboard_process();
+    if (keyboard_poll_event(event)) {
+      return;
+    }
+
+    /* the IRQ can't run between the check and blocking, so a scan code that
+     * arrives after the check still wakes us */
+    disable_interrupts();
+    if (!keyboard_pending()) {
+      keyboard_waiter = thread_current();
+      thread_block();
+      keyboard_waiter = NULL;
+    }
+    enable_interrupts();
+  }
+}
+
+/** keyboard_dropped:
+ *  Returns the number of scan codes and events lost because a queue was full
+ *
+ */
+uint32_t keyboard_dropped(void) { return keyboard_dropped_count; }
+
+/** keyboard_initialize:
+ *  Hooks the keyboard top half onto IRQ1
+ *
+ */
+void keyboard_initialize(void) {
+  register_interrupt_handler(IDT_KEYBOARD_INTERRUPT_INDEX,
+                             keyboard_interrupt_handler, NULL);
+  irq_unmask(KEYBOARD_IRQ);
+}
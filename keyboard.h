@@ -0,0 +1,76 @@
+#ifndef INCLUDE_KEYBOARD_H
+#define INCLUDE_KEYBOARD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define KEYBOARD_DATA_PORT 0x60
+#define KEYBOARD_IRQ 1
+
+/* Sizes of the scan code ring and the key event queue, must be powers of two
+ */
+#define KEYBOARD_SCANCODE_BUFFER_SIZE 256
+#define KEYBOARD_EVENT_BUFFER_SIZE 128
+
+/* Key codes are the set 1 make code of the key, with 0xe000 added for keys
+ * sent after an 0xe0 prefix */
+#define KEYBOARD_EXTENDED 0xe000
+
+#define KEY_ESCAPE 0x01
+#define KEY_BACKSPACE 0x0e
+#define KEY_TAB 0x0f
+#define KEY_ENTER 0x1c
+#define KEY_LEFT_CTRL 0x1d
+#define KEY_LEFT_SHIFT 0x2a
+#define KEY_RIGHT_SHIFT 0x36
+#define KEY_LEFT_ALT 0x38
+#define KEY_CAPS_LOCK 0x3a
+#define KEY_F1 0x3b
+#define KEY_F2 0x3c
+#define KEY_F3 0x3d
+#define KEY_F4 0x3e
+#define KEY_F5 0x3f
+#define KEY_F6 0x40
+#define KEY_F7 0x41
+#define KEY_F8 0x42
+#define KEY_F9 0x43
+#define KEY_F10 0x44
+#define KEY_F11 0x57
+#define KEY_F12 0x58
+#define KEY_RIGHT_CTRL (KEYBOARD_EXTENDED | 0x1d)
+#define KEY_RIGHT_ALT (KEYBOARD_EXTENDED | 0x38)
+#define KEY_HOME (KEYBOARD_EXTENDED | 0x47)
+#define KEY_UP (KEYBOARD_EXTENDED | 0x48)
+#define KEY_PAGE_UP (KEYBOARD_EXTENDED | 0x49)
+#define KEY_LEFT (KEYBOARD_EXTENDED | 0x4b)
+#define KEY_RIGHT (KEYBOARD_EXTENDED | 0x4d)
+#define KEY_END (KEYBOARD_EXTENDED | 0x4f)
+#define KEY_DOWN (KEYBOARD_EXTENDED | 0x50)
+#define KEY_PAGE_DOWN (KEYBOARD_EXTENDED | 0x51)
+#define KEY_INSERT (KEYBOARD_EXTENDED | 0x52)
+#define KEY_DELETE (KEYBOARD_EXTENDED | 0x53)
+
+/* Modifier state bits */
+#define KEYBOARD_MOD_SHIFT 0x01
+#define KEYBOARD_MOD_CTRL 0x02
+#define KEYBOARD_MOD_ALT 0x04
+#define KEYBOARD_MOD_CAPS_LOCK 0x08
+
+struct key_event {
+  uint16_t key;      /* KEY_* code */
+  char ascii;        /* the character typed, 0 if the key has none */
+  uint8_t modifiers; /* KEYBOARD_MOD_* state when the key changed */
+  bool released;     /* true on key up */
+};
+
+typedef struct key_event key_event_t;
+
+void keyboard_initialize(void);
+void keyboard_process(void);
+bool keyboard_pending(void);
+bool keyboard_poll_event(key_event_t *event);
+void keyboard_wait_event(key_event_t *event);
+uint32_t keyboard_dropped(void);
+
+#endif /* INCLUDE_KEYBOARD_H */
@@ -0,0 +1,241 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clock.h"
+#include "console.h"
+#include "cpu.h"
+#include "interrupts.h"
+#include "io.h"
+#include "klog.h"
+#include "str.h"
+
+/* klog_record.state */
+#define KLOG_RECORD_FREE 0      /* reserved, the writer hasn't finished */
+#define KLOG_RECORD_COMMITTED 1 /* ready to be flushed */
+#define KLOG_RECORD_PADDING 2   /* skipped space up to the end of the ring */
+
+/* Header of every record in the ring. The text follows it, null terminated,
+ * and the record is padded to KLOG_ALIGN. Since the ring size is a multiple
+ * of KLOG_ALIGN too, a header never wraps around the end. */
+struct klog_record {
+  uint64_t timestamp; /* TSC when the record was written */
+  uint32_t sequence;
+  uint16_t size; /* of the whole record */
+  uint8_t level;
+  uint8_t state;
+};
+
+typedef struct klog_record klog_record_t;
+
+/* The ring. Writers reserve space by moving klog_head with a compare and
+ * exchange, fill in their record and commit it, so a writer interrupted
+ * halfway only holds up the flush, never another writer. The single reader
+ * clears records as it consumes them, so reserved space always reads as
+ * KLOG_RECORD_FREE until its writer commits. head and tail are free running
+ * byte offsets. */
+static uint8_t klog_buffer[KLOG_BUFFER_SIZE]
+    __attribute__((aligned(KLOG_ALIGN)));
+static uint32_t klog_head;
+static uint32_t klog_tail;
+static uint32_t klog_sequence;
+static uint32_t klog_dropped_count;
+static bool klog_flushing;
+
+/* Sequence number of the last record flushed, to spot gaps */
+static uint32_t klog_flushed_sequence;
+static bool klog_flushed_any;
+
+static bool klog_have_tsc;
+
+static const char klog_level_tags[] = {'E', 'W', 'I', 'D'};
+
+/** klog_initialize:
+ *  Turns on timestamps. Messages can be logged before this, they are stamped
+ *  with 0.
+ *
+ */
+void klog_initialize(void) {
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+  klog_have_tsc = edx & CPUID_FEATURE_EDX_TSC;
+}
+
+/** klog_write:
+ *  Adds a message to the ring. Only copies bytes, so it is safe to call from
+ *  interrupt handlers.
+ *
+ *  @param level One of the KLOG_* levels
+ *  @param text The message, a trailing newline is dropped
+ *  @param length The length of the message
+ *  @return false if the ring was full and the message was dropped
+ */
+bool klog_write(int level, const char *text, size_t length) {
+  if (length > 0 && text[length - 1] == '\n') {
+    length--;
+  }
+  if (length > KLOG_LINE_MAX) {
+    length = KLOG_LINE_MAX;
+  }
+  if (level < KLOG_ERROR) {
+    level = KLOG_ERROR;
+  } else if (level > KLOG_DEBUG) {
+    level = KLOG_DEBUG;
+  }
+
+  uint32_t size = (sizeof(klog_record_t) + length + 1 + KLOG_ALIGN - 1) &
+                  ~(uint32_t)(KLOG_ALIGN - 1);
+  uint32_t head, start;
+
+  /* keep the reservation and the sequence number in the same order */
+  uint32_t flags = interrupts_save();
+  do {
+    head = __atomic_load_n(&klog_head, __ATOMIC_RELAXED);
+    start = head;
+    uint32_t room = KLOG_BUFFER_SIZE - (head & (KLOG_BUFFER_SIZE - 1));
+    if (room < size) {
+      start += room;
+    }
+    if (start + size - __atomic_load_n(&klog_tail, __ATOMIC_ACQUIRE) >
+        KLOG_BUFFER_SIZE) {
+      __atomic_fetch_add(&klog_dropped_count, 1, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&klog_sequence, 1, __ATOMIC_RELAXED);
+      interrupts_restore(flags);
+      return false;
+    }
+  } while (!__atomic_compare_exchange_n(&klog_head, &head, start + size, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+  uint32_t sequence = __atomic_fetch_add(&klog_sequence, 1, __ATOMIC_RELAXED);
+  interrupts_restore(flags);
+
+  if (start != head) {
+    klog_record_t *padding =
+        (klog_record_t *)&klog_buffer[head & (KLOG_BUFFER_SIZE - 1)];
+    padding->size = start - head;
+    __atomic_store_n(&padding->state, KLOG_RECORD_PADDING, __ATOMIC_RELEASE);
+  }
+
+  klog_record_t *record =
+      (klog_record_t *)&klog_buffer[start & (KLOG_BUFFER_SIZE - 1)];
+  record->timestamp = klog_have_tsc ? rdtsc() : 0;
+  record->sequence = sequence;
+  record->size = size;
+  record->level = level;
+  char *record_text = (char *)(record + 1);
+  memcpy(record_text, text, length);
+  record_text[length] = '\0';
+  __atomic_store_n(&record->state, KLOG_RECORD_COMMITTED, __ATOMIC_RELEASE);
+
+  return true;
+}
+
+/** vklog:
+ *  Formats a message into the ring
+ *
+ *  @param level One of the KLOG_* levels
+ *  @param format The format string, see vformat
+ *  @param args The values to format
+ */
+void vklog(int level, const char *format, va_list args) {
+  char line[KLOG_LINE_MAX + 1];
+  int length = vsnprintf(line, sizeof(line), format, args);
+  if (length > KLOG_LINE_MAX) {
+    length = KLOG_LINE_MAX;
+  }
+  klog_write(level, line, length);
+}
+
+/** klog:
+ *  Formats a message into the ring
+ *
+ *  @param level One of the KLOG_* levels
+ *  @param format The format string, see vformat
+ */
+void klog(int level, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vklog(level, format, args);
+  va_end(args);
+}
+
+/** klog_output:
+ *  Writes one record to every console that takes its level
+ *
+ */
+static void klog_output(const klog_record_t *record) {
+  char line[KLOG_LINE_MAX + 32];
+  uint64_t ns = clock_tsc_to_monotonic_ns(record->timestamp);
+  uint64_t us = ns / 1000;
+
+  int length = snprintf(line, sizeof(line), "[%5llu.%06llu] %c %s\n",
+                        us / 1000000, us % 1000000,
+                        klog_level_tags[record->level],
+                        (const char *)(record + 1));
+  if ((size_t)length >= sizeof(line)) {
+    length = sizeof(line) - 1;
+  }
+  console_write_level(record->level, line, length);
+}
+
+/** klog_flush:
+ *  Writes every committed message to the consoles in order. Stops at the
+ *  first record still being written. Only one caller drains at a time,
+ *  nested calls return straight away.
+ *
+ */
+void klog_flush(void) {
+  if (__atomic_exchange_n(&klog_flushing, true, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+
+  for (;;) {
+    uint32_t tail = klog_tail;
+    if (tail == __atomic_load_n(&klog_head, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+
+    klog_record_t *record =
+        (klog_record_t *)&klog_buffer[tail & (KLOG_BUFFER_SIZE - 1)];
+    uint8_t state = __atomic_load_n(&record->state, __ATOMIC_ACQUIRE);
+    if (state == KLOG_RECORD_FREE) {
+      break;
+    }
+
+    if (state == KLOG_RECORD_COMMITTED) {
+      uint32_t expected = klog_flushed_sequence + 1;
+      if (klog_flushed_any && record->sequence != expected) {
+        char line[48];
+        int length = snprintf(line, sizeof(line), "[klog: %u dropped]\n",
+                              (unsigned int)(record->sequence - expected));
+        console_write_level(KLOG_WARNING, line, length);
+      }
+      klog_flushed_any = true;
+      klog_flushed_sequence = record->sequence;
+      klog_output(record);
+    }
+
+    uint32_t size = record->size;
+    memset(record, 0, size);
+    __atomic_store_n(&klog_tail, tail + size, __ATOMIC_RELEASE);
+  }
+
+  __atomic_store_n(&klog_flushing, false, __ATOMIC_RELEASE);
+}
+
+/** klog_pending:
+ *  Returns whether there are messages waiting to be flushed
+ *
+ */
+bool klog_pending(void) {
+  return __atomic_load_n(&klog_tail, __ATOMIC_ACQUIRE) !=
+         __atomic_load_n(&klog_head, __ATOMIC_ACQUIRE);
+}
+
+/** klog_dropped:
+ *  Returns the number of messages lost because the ring was full
+ *
+ */
+uint32_t klog_dropped(void) {
+  return __atomic_load_n(&klog_dropped_count, __ATOMIC_RELAXED);
+}
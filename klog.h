@@ -0,0 +1,30 @@
+#ifndef INCLUDE_KLOG_H
+#define INCLUDE_KLOG_H
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Severity levels, lower is more severe */
+#define KLOG_ERROR 0
+#define KLOG_WARNING 1
+#define KLOG_INFO 2
+#define KLOG_DEBUG 3
+
+/* Size of the ring, a power of two. Records are KLOG_ALIGN aligned. */
+#define KLOG_BUFFER_SIZE 16384
+#define KLOG_ALIGN 16
+
+/* Longest message kept, longer ones are cut */
+#define KLOG_LINE_MAX 240
+
+void klog_initialize(void);
+void klog(int level, const char *format, ...);
+void vklog(int level, const char *format, va_list args);
+bool klog_write(int level, const char *text, size_t length);
+void klog_flush(void);
+bool klog_pending(void);
+uint32_t klog_dropped(void);
+
+#endif /* INCLUDE_KLOG_H */
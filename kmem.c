@@ -0,0 +1,402 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interrupts.h"
+#include "io.h"
+#include "klog.h"
+#include "kmem.h"
+#include "pmm.h"
+#include "vmm.h"
+
+/* Header at the start of every slab. The objects follow it, and free objects
+ * are chained through a link stored at the cache's free_offset. Every page of
+ * the slab has the header as its pmm owner, so an object's slab is found in
+ * O(1) from its address. */
+struct kmem_slab {
+  struct kmem_slab *next;
+  struct kmem_slab *prev;
+  kmem_cache_t *cache;
+  void *free;
+  uint32_t in_use;
+};
+
+typedef struct kmem_slab kmem_slab_t;
+
+/* The cache kmem_cache_create allocates caches from */
+static kmem_cache_t kmem_cache_cache;
+
+/* The kmalloc caches, one per power of two */
+static kmem_cache_t kmem_size_caches[KMEM_SIZE_CACHES];
+static const char *const kmem_size_names[KMEM_SIZE_CACHES] = {
+    "kmalloc-8",   "kmalloc-16",  "kmalloc-32",   "kmalloc-64",  "kmalloc-128",
+    "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048",
+};
+
+static kmem_cache_t *kmem_caches;
+
+/* Pages handed out by kmalloc for allocations too large for the caches */
+static uint32_t kmem_large_pages;
+
+/** kmem_align_up:
+ *  Rounds a size up to a multiple of a power of two
+ *
+ */
+static inline size_t kmem_align_up(size_t size, size_t align) {
+  return (size + align - 1) & ~(align - 1);
+}
+
+/** kmem_list_add:
+ *  Pushes a slab onto one of the slab lists of its cache
+ *
+ */
+static void kmem_list_add(kmem_slab_t **list, kmem_slab_t *slab) {
+  slab->prev = NULL;
+  slab->next = *list;
+  if (slab->next != NULL) {
+    slab->next->prev = slab;
+  }
+  *list = slab;
+}
+
+/** kmem_list_remove:
+ *  Unlinks a slab from the slab list it is on
+ *
+ */
+static void kmem_list_remove(kmem_slab_t **list, kmem_slab_t *slab) {
+  if (slab->prev != NULL) {
+    slab->prev->next = slab->next;
+  } else {
+    *list = slab->next;
+  }
+  if (slab->next != NULL) {
+    slab->next->prev = slab->prev;
+  }
+}
+
+/** kmem_cache_init:
+ *  Works out the slab layout of a cache. Objects are aligned to the given
+ *  alignment or, by default, to the cache line for objects of a cache line or
+ *  more and to their rounded up size otherwise, so no object straddles a
+ *  cache line.
+ *
+ *  @return false if an object doesn't fit in the largest slab
+ */
+static bool kmem_cache_init(kmem_cache_t *cache, const char *name,
+                            size_t size, size_t align, kmem_ctor_t ctor) {
+  if (size < sizeof(void *)) {
+    size = sizeof(void *);
+  }
+
+  if (align == 0) {
+    align = size >= KMEM_CACHE_LINE ? KMEM_CACHE_LINE : sizeof(void *);
+    while (align < size && align < KMEM_CACHE_LINE) {
+      align <<= 1;
+    }
+  }
+  if (align < sizeof(void *)) {
+    align = sizeof(void *);
+  }
+  if ((align & (align - 1)) != 0 || align > PMM_PAGE_SIZE) {
+    return false;
+  }
+
+  *cache = (kmem_cache_t){.name = name, .object_size = size, .ctor = ctor};
+
+  cache->stride = kmem_align_up(size, align);
+  if (ctor != NULL) {
+    /* keep the link out of the way of the constructed state */
+    cache->free_offset = cache->stride;
+    cache->stride = kmem_align_up(cache->stride + sizeof(void *), align);
+  }
+  cache->first_offset = kmem_align_up(sizeof(kmem_slab_t), align);
+
+  for (uint32_t order = 0; order <= KMEM_MAX_SLAB_ORDER; order++) {
+    size_t bytes = (size_t)PMM_PAGE_SIZE << order;
+    if (bytes < cache->first_offset + cache->stride) {
+      continue;
+    }
+
+    size_t objects = (bytes - cache->first_offset) / cache->stride;
+    size_t waste = bytes - cache->first_offset - objects * cache->stride;
+    cache->order = order;
+    cache->objects_per_slab = objects;
+    if (waste * KMEM_MAX_WASTE <= bytes) {
+      break;
+    }
+  }
+  if (cache->objects_per_slab == 0) {
+    return false;
+  }
+
+  uint32_t flags = interrupts_save();
+  cache->next = kmem_caches;
+  kmem_caches = cache;
+  interrupts_restore(flags);
+  return true;
+}
+
+/** kmem_slab_create:
+ *  Allocates a new slab for a cache and threads all of its objects onto the
+ *  slab's free list, running the constructor on each
+ *
+ *  @return The slab, NULL if the page frame allocator is out of memory
+ */
+static kmem_slab_t *kmem_slab_create(kmem_cache_t *cache) {
+  uint32_t phys = pmm_alloc_pages(cache->order);
+  if (phys == 0) {
+    return NULL;
+  }
+
+  kmem_slab_t *slab = phys_to_virt(phys);
+  slab->cache = cache;
+  slab->in_use = 0;
+  slab->free = NULL;
+
+  /* built backwards so objects are handed out in address order */
+  char *objects = (char *)slab + cache->first_offset;
+  for (uint32_t i = cache->objects_per_slab; i-- > 0;) {
+    char *object = objects + i * cache->stride;
+    if (cache->ctor != NULL) {
+      cache->ctor(object);
+    }
+    *(void **)(object + cache->free_offset) = slab->free;
+    slab->free = object;
+  }
+
+  pmm_set_owner(phys, cache->order, slab);
+  cache->slab_count++;
+  return slab;
+}
+
+/** kmem_slab_destroy:
+ *  Returns an empty slab to the page frame allocator
+ *
+ */
+static void kmem_slab_destroy(kmem_cache_t *cache, kmem_slab_t *slab) {
+  uint32_t phys = virt_to_phys(slab);
+  pmm_set_owner(phys, cache->order, NULL);
+  pmm_free_pages(phys);
+  cache->slab_count--;
+}
+
+/** kmem_cache_create:
+ *  Creates a cache of fixed size objects
+ *
+ *  @param name Shown by kmem_dump, must stay valid for the life of the cache
+ *  @param size The size of an object in bytes
+ *  @param align The alignment of every object, a power of two, 0 for the
+ *               default
+ *  @param ctor Called on every object when its slab is created, or NULL
+ *  @return The cache, NULL if it couldn't be created
+ */
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align,
+                                kmem_ctor_t ctor) {
+  kmem_cache_t *cache = kmem_cache_alloc(&kmem_cache_cache);
+  if (cache == NULL) {
+    return NULL;
+  }
+  if (!kmem_cache_init(cache, name, size, align, ctor)) {
+    kmem_cache_free(&kmem_cache_cache, cache);
+    return NULL;
+  }
+  return cache;
+}
+
+/** kmem_cache_alloc:
+ *  Allocates an object from a cache. O(1): objects come from a partially
+ *  used slab first, then from an empty one, and a new slab is only created
+ *  when there is neither.
+ *
+ *  @param cache The cache to allocate from
+ *  @return The object, NULL if out of memory
+ */
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+  uint32_t flags = interrupts_save();
+
+  kmem_slab_t *slab = cache->partial;
+  if (slab == NULL) {
+    slab = cache->empty;
+    if (slab != NULL) {
+      kmem_list_remove(&cache->empty, slab);
+      cache->empty_count--;
+    } else {
+      slab = kmem_slab_create(cache);
+      if (slab == NULL) {
+        cache->failures++;
+        interrupts_restore(flags);
+        return NULL;
+      }
+    }
+    kmem_list_add(&cache->partial, slab);
+  }
+
+  char *object = slab->free;
+  slab->free = *(void **)(object + cache->free_offset);
+  slab->in_use++;
+  if (slab->in_use == cache->objects_per_slab) {
+    kmem_list_remove(&cache->partial, slab);
+    kmem_list_add(&cache->full, slab);
+  }
+
+  cache->allocations++;
+  cache->active_objects++;
+  if (cache->active_objects > cache->peak_objects) {
+    cache->peak_objects = cache->active_objects;
+  }
+
+  interrupts_restore(flags);
+  return object;
+}
+
+/** kmem_cache_free:
+ *  Returns an object to its cache. A slab that becomes empty is kept for
+ *  reuse, or given back to the page frame allocator if the cache already
+ *  keeps KMEM_EMPTY_SLABS_KEPT empty slabs.
+ *
+ *  @param cache The cache the object was allocated from
+ *  @param object The object, may be NULL
+ */
+void kmem_cache_free(kmem_cache_t *cache, void *object) {
+  if (object == NULL) {
+    return;
+  }
+
+  kmem_slab_t *slab = pmm_owner(virt_to_phys(object));
+  if (slab == NULL || slab->cache != cache) {
+    klog(KLOG_ERROR, "kmem: bad free of %p to %s", object, cache->name);
+    return;
+  }
+
+  uint32_t flags = interrupts_save();
+
+  if (slab->in_use == cache->objects_per_slab) {
+    kmem_list_remove(&cache->full, slab);
+    kmem_list_add(&cache->partial, slab);
+  }
+
+  *(void **)((char *)object + cache->free_offset) = slab->free;
+  slab->free = object;
+  slab->in_use--;
+
+  if (slab->in_use == 0) {
+    kmem_list_remove(&cache->partial, slab);
+    if (cache->empty_count < KMEM_EMPTY_SLABS_KEPT) {
+      kmem_list_add(&cache->empty, slab);
+      cache->empty_count++;
+    } else {
+      kmem_slab_destroy(cache, slab);
+    }
+  }
+
+  cache->frees++;
+  cache->active_objects--;
+
+  interrupts_restore(flags);
+}
+
+/** kmalloc:
+ *  Allocates memory from the kernel heap. Sizes up to 2^KMEM_MAX_SHIFT come
+ *  from the smallest power of two cache that fits, larger sizes are rounded up
+ *  to a power of two number of pages.
+ *
+ *  @param size The number of bytes
+ *  @return The memory, NULL if size is 0 or out of memory
+ */
+void *kmalloc(size_t size) {
+  if (size == 0) {
+    return NULL;
+  }
+
+  if (size <= (1u << KMEM_MAX_SHIFT)) {
+    uint32_t shift = size <= (1u << KMEM_MIN_SHIFT)
+                         ? KMEM_MIN_SHIFT
+                         : 32 - __builtin_clz(size - 1);
+    return kmem_cache_alloc(&kmem_size_caches[shift - KMEM_MIN_SHIFT]);
+  }
+
+  uint32_t order = 0;
+  while (((size_t)PMM_PAGE_SIZE << order) < size) {
+    order++;
+  }
+
+  uint32_t phys = pmm_alloc_pages(order);
+  if (phys == 0) {
+    return NULL;
+  }
+
+  uint32_t flags = interrupts_save();
+  kmem_large_pages += 1 << order;
+  interrupts_restore(flags);
+  return phys_to_virt(phys);
+}
+
+/** kfree:
+ *  Frees memory returned by kmalloc
+ *
+ *  @param ptr The memory, may be NULL
+ */
+void kfree(void *ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+
+  uint32_t phys = virt_to_phys(ptr);
+  kmem_slab_t *slab = pmm_owner(phys);
+  if (slab != NULL) {
+    kmem_cache_free(slab->cache, ptr);
+    return;
+  }
+
+  /* a large allocation, the allocator remembers its order */
+  uint32_t flags = interrupts_save();
+  kmem_large_pages -= 1 << pmm_block_order(phys);
+  interrupts_restore(flags);
+  pmm_free_pages(phys);
+}
+
+/** kmem_initialize:
+ *  Sets up the kmalloc caches and the cache of caches. Needs the page frame
+ *  allocator.
+ *
+ */
+void kmem_initialize(void) {
+  kmem_cache_init(&kmem_cache_cache, "kmem_cache", sizeof(kmem_cache_t), 0,
+                  NULL);
+  for (uint32_t i = 0; i < KMEM_SIZE_CACHES; i++) {
+    kmem_cache_init(&kmem_size_caches[i], kmem_size_names[i],
+                    1u << (i + KMEM_MIN_SHIFT), 0, NULL);
+  }
+}
+
+/** kmem_dump:
+ *  Writes the occupancy and statistics of every cache to serial
+ *
+ */
+void kmem_dump(void) {
+  fprintf(SERIAL, "kmem: %-16s %5s %6s %6s %4s %5s %5s %8s %8s\n", "cache",
+          "size", "active", "total", "use%", "slabs", "pages", "allocs",
+          "frees");
+
+  for (kmem_cache_t *cache = kmem_caches; cache != NULL; cache = cache->next) {
+    uint32_t flags = interrupts_save();
+    kmem_cache_t snapshot = *cache;
+    interrupts_restore(flags);
+
+    uint32_t total = snapshot.slab_count * snapshot.objects_per_slab;
+    fprintf(SERIAL, "kmem: %-16s %5u %6u %6u %3u%% %5u %5u %8u %8u\n",
+            snapshot.name, (unsigned int)snapshot.object_size,
+            (unsigned int)snapshot.active_objects, (unsigned int)total,
+            total ? (unsigned int)(snapshot.active_objects * 100 / total) : 0,
+            (unsigned int)snapshot.slab_count,
+            (unsigned int)(snapshot.slab_count << snapshot.order),
+            (unsigned int)snapshot.allocations, (unsigned int)snapshot.frees);
+    if (snapshot.failures != 0) {
+      fprintf(SERIAL, "kmem: %-16s %u failed allocations\n", snapshot.name,
+              (unsigned int)snapshot.failures);
+    }
+  }
+
+  fprintf(SERIAL, "kmem: %u pages in large allocations\n",
+          (unsigned int)kmem_large_pages);
+}
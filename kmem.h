@@ -0,0 +1,70 @@
+#ifndef INCLUDE_KMEM_H
+#define INCLUDE_KMEM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define KMEM_CACHE_LINE 64
+
+/* kmalloc serves 2^KMEM_MIN_SHIFT up to 2^KMEM_MAX_SHIFT bytes from slab
+ * caches, anything larger comes straight from the page frame allocator */
+#define KMEM_MIN_SHIFT 3
+#define KMEM_MAX_SHIFT 11
+#define KMEM_SIZE_CACHES (KMEM_MAX_SHIFT - KMEM_MIN_SHIFT + 1)
+
+/* Slabs are at most 2^KMEM_MAX_SLAB_ORDER pages. The smallest order that
+ * wastes no more than 1/KMEM_MAX_WASTE of the slab is used. */
+#define KMEM_MAX_SLAB_ORDER 3
+#define KMEM_MAX_WASTE 8
+
+/* Number of empty slabs a cache keeps instead of returning them */
+#define KMEM_EMPTY_SLABS_KEPT 1
+
+/** kmem_ctor_t:
+ *  Puts a new object in its constructed state. It is called once for every
+ *  object when its slab is created, not on every allocation, and objects must
+ *  be in the constructed state again when they are freed.
+ */
+typedef void (*kmem_ctor_t)(void *object);
+
+struct kmem_slab;
+
+struct kmem_cache {
+  const char *name;
+  size_t object_size;  /* size asked for */
+  size_t stride;       /* distance between objects in a slab */
+  size_t free_offset;  /* where a free object keeps its free list link */
+  size_t first_offset; /* offset of the first object from the slab start */
+  uint32_t order;      /* log2 of the pages per slab */
+  uint32_t objects_per_slab;
+  kmem_ctor_t ctor;
+
+  struct kmem_slab *partial;
+  struct kmem_slab *full;
+  struct kmem_slab *empty;
+  uint32_t empty_count;
+
+  /* Statistics */
+  uint32_t slab_count;
+  uint32_t active_objects;
+  uint32_t peak_objects;
+  uint32_t allocations;
+  uint32_t frees;
+  uint32_t failures;
+
+  struct kmem_cache *next; /* list of every cache, for kmem_dump */
+};
+
+typedef struct kmem_cache kmem_cache_t;
+
+void kmem_initialize(void);
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t align,
+                                kmem_ctor_t ctor);
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *object);
+void *kmalloc(size_t size);
+void kfree(void *ptr);
+void kmem_dump(void);
+
+#endif /* INCLUDE_KMEM_H */
@@ -0,0 +1,153 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "elf.h"
+#include "kmem.h"
+#include "ksym.h"
+#include "multiboot.h"
+#include "vmm.h"
+
+/* Function symbols sorted by address. The names point into the string table
+ * the bootloader loaded, which the page frame allocator keeps reserved. */
+static ksym_t *ksym_table;
+static size_t ksym_table_count;
+
+/** ksym_section_address:
+ *  Returns where a section of the kernel image can be read. The bootloader
+ *  leaves sections that are part of the image at their link address and
+ *  fills in the physical address it loaded the others to.
+ *
+ */
+static const void *ksym_section_address(const elf32_section_header_t *section) {
+  if (section->addr >= KERNEL_VIRTUAL_BASE) {
+    return (const void *)section->addr;
+  }
+  return phys_to_virt(section->addr);
+}
+
+/** ksym_initialize:
+ *  Builds the sorted function table from the ELF symbol table the bootloader
+ *  passed along with the section headers. Needs the kernel heap.
+ *
+ *  @param mbi The multiboot information
+ */
+void ksym_initialize(const multiboot_info_t *mbi) {
+  if (!(mbi->flags & MULTIBOOT_INFO_ELF_SHDR)) {
+    return;
+  }
+
+  const elf32_section_header_t *symtab = NULL;
+  const elf32_section_header_t *strtab = NULL;
+
+  for (uint32_t i = 0; i < mbi->elf_num; i++) {
+    const elf32_section_header_t *section =
+        phys_to_virt(mbi->elf_addr + i * mbi->elf_size);
+    if (section->type == ELF_SECTION_SYMTAB && section->link < mbi->elf_num) {
+      symtab = section;
+      strtab = phys_to_virt(mbi->elf_addr + section->link * mbi->elf_size);
+      break;
+    }
+  }
+  if (symtab == NULL || symtab->addr == 0 || strtab->addr == 0) {
+    return;
+  }
+
+  const elf32_symbol_t *symbols = ksym_section_address(symtab);
+  const char *strings = ksym_section_address(strtab);
+  size_t count = symtab->size / sizeof(elf32_symbol_t);
+
+  size_t functions = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (ELF_SYMBOL_TYPE(symbols[i].info) == ELF_SYMBOL_FUNC &&
+        symbols[i].value != 0) {
+      functions++;
+    }
+  }
+
+  ksym_table = kmalloc(functions * sizeof(ksym_t));
+  if (ksym_table == NULL) {
+    return;
+  }
+
+  /* insertion sort, there are only a few hundred functions */
+  for (size_t i = 0; i < count; i++) {
+    const elf32_symbol_t *symbol = &symbols[i];
+    if (ELF_SYMBOL_TYPE(symbol->info) != ELF_SYMBOL_FUNC ||
+        symbol->value == 0) {
+      continue;
+    }
+
+    size_t j = ksym_table_count++;
+    while (j > 0 && ksym_table[j - 1].address > symbol->value) {
+      ksym_table[j] = ksym_table[j - 1];
+      j--;
+    }
+    ksym_table[j] = (ksym_t){.address = symbol->value,
+                             .size = symbol->size,
+                             .name = strings + symbol->name};
+  }
+}
+
+/** ksym_count:
+ *  Returns the number of functions in the table
+ *
+ */
+size_t ksym_count(void) { return ksym_table_count; }
+
+/** ksym_get:
+ *  Returns a function of the table by index
+ *
+ */
+const ksym_t *ksym_get(size_t index) {
+  return index < ksym_table_count ? &ksym_table[index] : NULL;
+}
+
+/** ksym_find:
+ *  Finds the function containing an address with a binary search
+ *
+ *  @param address A code address
+ *  @return The index of the function, -1 if there is none
+ */
+int ksym_find(uint32_t address) {
+  size_t low = 0;
+  size_t high = ksym_table_count;
+
+  /* find the first function starting above the address */
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (ksym_table[middle].address <= address) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  if (low == 0) {
+    return -1;
+  }
+
+  const ksym_t *symbol = &ksym_table[low - 1];
+  /* assembly functions often have no size, trust them up to the next one */
+  if (symbol->size != 0 && address - symbol->address >= symbol->size) {
+    return -1;
+  }
+  return low - 1;
+}
+
+/** ksym_lookup:
+ *  Returns the name of the function containing an address
+ *
+ *  @param address A code address
+ *  @param offset Where to store the offset into the function, may be NULL
+ *  @return The name, NULL if the address isn't inside a known function
+ */
+const char *ksym_lookup(uint32_t address, uint32_t *offset) {
+  int index = ksym_find(address);
+  if (index < 0) {
+    return NULL;
+  }
+  if (offset != NULL) {
+    *offset = address - ksym_table[index].address;
+  }
+  return ksym_table[index].name;
+}
@@ -0,0 +1,25 @@
+#ifndef INCLUDE_KSYM_H
+#define INCLUDE_KSYM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "multiboot.h"
+
+/* A function of the kernel image */
+struct ksym {
+  uint32_t address;
+  uint32_t size;
+  const char *name;
+};
+
+typedef struct ksym ksym_t;
+
+void ksym_initialize(const multiboot_info_t *mbi);
+size_t ksym_count(void);
+const ksym_t *ksym_get(size_t index);
+int ksym_find(uint32_t address);
+const char *ksym_lookup(uint32_t address, uint32_t *offset);
+
+#endif /* INCLUDE_KSYM_H */
@@ -0,0 +1,75 @@
+#ifndef INCLUDE_MULTIBOOT_H
+#define INCLUDE_MULTIBOOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Value the bootloader leaves in eax, see boot.asm */
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
+
+/* Bits of multiboot_info.flags telling which fields are valid */
+#define MULTIBOOT_INFO_MEMORY 0x00000001
+#define MULTIBOOT_INFO_CMDLINE 0x00000004
+#define MULTIBOOT_INFO_MODS 0x00000008
+#define MULTIBOOT_INFO_ELF_SHDR 0x00000020
+#define MULTIBOOT_INFO_MEM_MAP 0x00000040
+
+/* multiboot_mmap_entry.type */
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+#define MULTIBOOT_MEMORY_RESERVED 2
+#define MULTIBOOT_MEMORY_ACPI_RECLAIMABLE 3
+#define MULTIBOOT_MEMORY_NVS 4
+#define MULTIBOOT_MEMORY_BADRAM 5
+
+/* The boot information structure the bootloader passes in ebx. All addresses
+ * in it are physical. */
+struct multiboot_info {
+  uint32_t flags;
+
+  /* MULTIBOOT_INFO_MEMORY: KiB of lower and upper memory */
+  uint32_t mem_lower;
+  uint32_t mem_upper;
+
+  uint32_t boot_device;
+
+  /* MULTIBOOT_INFO_CMDLINE */
+  uint32_t cmdline;
+
+  /* MULTIBOOT_INFO_MODS */
+  uint32_t mods_count;
+  uint32_t mods_addr;
+
+  /* MULTIBOOT_INFO_ELF_SHDR: the kernel's ELF section header table */
+  uint32_t elf_num;
+  uint32_t elf_size;
+  uint32_t elf_addr;
+  uint32_t elf_shndx;
+
+  /* MULTIBOOT_INFO_MEM_MAP */
+  uint32_t mmap_length;
+  uint32_t mmap_addr;
+} __attribute__((packed));
+
+typedef struct multiboot_info multiboot_info_t;
+
+/* Memory map entries are variable sized, size doesn't count itself */
+struct multiboot_mmap_entry {
+  uint32_t size;
+  uint64_t addr;
+  uint64_t len;
+  uint32_t type;
+} __attribute__((packed));
+
+typedef struct multiboot_mmap_entry multiboot_mmap_entry_t;
+
+struct multiboot_module {
+  uint32_t mod_start;
+  uint32_t mod_end; /* one past the last byte */
+  uint32_t string;
+  uint32_t reserved;
+} __attribute__((packed));
+
+typedef struct multiboot_module multiboot_module_t;
+
+#endif /* INCLUDE_MULTIBOOT_H */
@@ -0,0 +1,477 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "elf.h"
+#include "interrupts.h"
+#include "io.h"
+#include "klog.h"
+#include "multiboot.h"
+#include "pmm.h"
+#include "vmm.h"
+
+/* Defined in linker.ld */
+extern char kernel_start[];
+extern char kernel_end[];
+
+/* Room for low memory, the kernel, its symbol tables, the descriptor array,
+ * the boot info and a handful of modules */
+#define PMM_MAX_RESERVED 24
+
+/* Only memory inside the kernel's direct map is managed, so every page handed
+ * out can be reached through phys_to_virt */
+#define PMM_ADDRESS_LIMIT VMM_DIRECT_MAP_SIZE
+
+struct pmm_range {
+  uint64_t start;
+  uint64_t end; /* one past the last byte */
+};
+
+typedef struct pmm_range pmm_range_t;
+
+static pmm_range_t pmm_reserved[PMM_MAX_RESERVED];
+static size_t pmm_reserved_count;
+
+/* One descriptor per page frame up to the top of usable memory */
+static pmm_page_t *pmm_pages;
+static size_t pmm_page_count;
+
+/* Buddy free lists, one per order, linked through the page descriptors */
+static uint32_t pmm_free_lists[PMM_MAX_ORDER + 1];
+static size_t pmm_free_blocks[PMM_MAX_ORDER + 1];
+static size_t pmm_free_pages_total;
+static size_t pmm_usable_pages;
+
+/** pmm_align_up:
+ *  Rounds an address up to the next page boundary
+ *
+ */
+static inline uint64_t pmm_align_up(uint64_t address) {
+  return (address + PMM_PAGE_SIZE - 1) & ~(uint64_t)(PMM_PAGE_SIZE - 1);
+}
+
+/** pmm_reserve:
+ *  Records a physical range which must not be handed out. Ranges are recorded
+ *  before the free lists are built.
+ *
+ *  @param start The first byte of the range
+ *  @param end One past the last byte of the range
+ */
+static void pmm_reserve(uint64_t start, uint64_t end) {
+  if (end <= start || pmm_reserved_count == PMM_MAX_RESERVED) {
+    return;
+  }
+  pmm_range_t *r = &pmm_reserved[pmm_reserved_count];
+  r->start = start & ~(uint64_t)(PMM_PAGE_SIZE - 1);
+  r->end = pmm_align_up(end);
+  pmm_reserved_count++;
+}
+
+/** pmm_list_push:
+ *  Adds a block to the free list of its order
+ *
+ */
+static void pmm_list_push(uint32_t pfn, uint32_t order) {
+  pmm_page_t *page = &pmm_pages[pfn];
+  page->order = order;
+  page->flags = PMM_PAGE_FREE;
+  page->prev = PMM_NO_PAGE;
+  page->next = pmm_free_lists[order];
+  if (page->next != PMM_NO_PAGE) {
+    pmm_pages[page->next].prev = pfn;
+  }
+  pmm_free_lists[order] = pfn;
+  pmm_free_blocks[order]++;
+}
+
+/** pmm_list_remove:
+ *  Takes a block off the free list of its order
+ *
+ */
+static void pmm_list_remove(uint32_t pfn) {
+  pmm_page_t *page = &pmm_pages[pfn];
+  if (page->prev != PMM_NO_PAGE) {
+    pmm_pages[page->prev].next = page->next;
+  } else {
+    pmm_free_lists[page->order] = page->next;
+  }
+  if (page->next != PMM_NO_PAGE) {
+    pmm_pages[page->next].prev = page->prev;
+  }
+  page->flags &= ~PMM_PAGE_FREE;
+  pmm_free_blocks[page->order]--;
+}
+
+/** pmm_free_block:
+ *  Returns a block to the free lists, merging it with its buddy for as long
+ *  as the buddy is free and of the same order
+ *
+ *  @param pfn The first page frame of the block
+ *  @param order The order of the block
+ */
+static void pmm_free_block(uint32_t pfn, uint32_t order) {
+  pmm_free_pages_total += 1 << order;
+
+  while (order < PMM_MAX_ORDER) {
+    uint32_t buddy = pfn ^ (1 << order);
+    if (buddy >= pmm_page_count || !(pmm_pages[buddy].flags & PMM_PAGE_FREE) ||
+        pmm_pages[buddy].order != order) {
+      break;
+    }
+    pmm_list_remove(buddy);
+    pfn &= ~(1 << order);
+    order++;
+  }
+
+  pmm_list_push(pfn, order);
+}
+
+/** pmm_free_range:
+ *  Hands a run of page frames to the allocator as the largest aligned blocks
+ *  that fit
+ *
+ *  @param start The first page frame
+ *  @param end One past the last page frame
+ */
+static void pmm_free_range(uint32_t start, uint32_t end) {
+  while (start < end) {
+    uint32_t order = 0;
+    while (order < PMM_MAX_ORDER && !(start & ((2u << order) - 1)) &&
+           start + (2u << order) <= end) {
+      order++;
+    }
+    for (uint32_t i = 0; i < (1u << order); i++) {
+      pmm_pages[start + i].flags &= ~PMM_PAGE_RESERVED;
+    }
+    pmm_usable_pages += 1 << order;
+    pmm_free_block(start, order);
+    start += 1 << order;
+  }
+}
+
+/** pmm_free_available:
+ *  Frees the parts of an available memory range that don't overlap any
+ *  reserved range
+ *
+ *  @param start The first byte of the range
+ *  @param end One past the last byte of the range
+ */
+static void pmm_free_available(uint64_t start, uint64_t end) {
+  start = pmm_align_up(start);
+  end &= ~(uint64_t)(PMM_PAGE_SIZE - 1);
+
+  while (start < end) {
+    uint64_t piece_end = end;
+    bool clipped = false;
+
+    for (size_t i = 0; i < pmm_reserved_count; i++) {
+      const pmm_range_t *r = &pmm_reserved[i];
+      if (r->start <= start && r->end > start) {
+        /* start is inside a reserved range, skip past it */
+        start = r->end;
+        clipped = true;
+        break;
+      }
+      if (r->start > start && r->start < piece_end) {
+        piece_end = r->start;
+      }
+    }
+
+    if (clipped) {
+      continue;
+    }
+
+    pmm_free_range(start >> PMM_PAGE_SHIFT, piece_end >> PMM_PAGE_SHIFT);
+    start = piece_end;
+  }
+}
+
+/** pmm_for_each_available:
+ *  Calls the given function for every available range in the boot memory map
+ *  below PMM_ADDRESS_LIMIT
+ *
+ *  @param mbi The multiboot information
+ *  @param fn The function to call with the start and end of each range
+ */
+static void pmm_for_each_available(const multiboot_info_t *mbi,
+                                   void (*fn)(uint64_t start, uint64_t end)) {
+  if (!(mbi->flags & MULTIBOOT_INFO_MEM_MAP)) {
+    /* without a map all we know is the size of upper memory */
+    if (mbi->flags & MULTIBOOT_INFO_MEMORY) {
+      fn(PMM_LOW_MEMORY_END,
+         PMM_LOW_MEMORY_END + (uint64_t)mbi->mem_upper * 1024);
+    }
+    return;
+  }
+
+  uint32_t address = mbi->mmap_addr;
+  uint32_t end = mbi->mmap_addr + mbi->mmap_length;
+
+  while (address < end) {
+    const multiboot_mmap_entry_t *entry =
+        (const multiboot_mmap_entry_t *)phys_to_virt(address);
+
+    if (entry->type == MULTIBOOT_MEMORY_AVAILABLE &&
+        entry->addr < PMM_ADDRESS_LIMIT) {
+      uint64_t range_end = entry->addr + entry->len;
+      if (range_end > PMM_ADDRESS_LIMIT) {
+        range_end = PMM_ADDRESS_LIMIT;
+      }
+      fn(entry->addr, range_end);
+    }
+
+    address += entry->size + sizeof(entry->size);
+  }
+}
+
+static uint64_t pmm_top;
+static uint64_t pmm_descriptor_bytes;
+static uint64_t pmm_descriptor_address;
+
+/** pmm_find_top:
+ *  pmm_for_each_available callback tracking the end of usable memory
+ */
+static void pmm_find_top(__attribute__((unused)) uint64_t start,
+                         uint64_t end) {
+  if (end > pmm_top) {
+    pmm_top = end;
+  }
+}
+
+/** pmm_find_descriptor_space:
+ *  pmm_for_each_available callback looking for a spot above low memory that
+ *  can hold the page descriptors without overlapping anything reserved
+ */
+static void pmm_find_descriptor_space(uint64_t start, uint64_t end) {
+  if (pmm_descriptor_address != 0) {
+    return;
+  }
+
+  uint64_t candidate = pmm_align_up(start);
+  bool moved = true;
+
+  while (moved) {
+    moved = false;
+    for (size_t i = 0; i < pmm_reserved_count; i++) {
+      const pmm_range_t *r = &pmm_reserved[i];
+      if (candidate < r->end && candidate + pmm_descriptor_bytes > r->start) {
+        candidate = r->end;
+        moved = true;
+      }
+    }
+  }
+
+  if (candidate + pmm_descriptor_bytes <= end) {
+    pmm_descriptor_address = candidate;
+  }
+}
+
+/** pmm_initialize:
+ *  Builds the page frame allocator from the multiboot memory map. Low memory,
+ *  the kernel image and its symbol tables, the boot information and any
+ *  modules are kept out of the free lists.
+ *
+ *  @param mbi The multiboot information passed by the bootloader, through the
+ *             direct map
+ */
+void pmm_initialize(const multiboot_info_t *mbi) {
+  pmm_reserve(0, PMM_LOW_MEMORY_END);
+  pmm_reserve(virt_to_phys(kernel_start), virt_to_phys(kernel_end));
+  pmm_reserve(virt_to_phys(mbi), virt_to_phys(mbi) + sizeof(*mbi));
+
+  if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
+    pmm_reserve(mbi->mmap_addr, mbi->mmap_addr + mbi->mmap_length);
+  }
+
+  if (mbi->flags & MULTIBOOT_INFO_MODS) {
+    const multiboot_module_t *mods = phys_to_virt(mbi->mods_addr);
+    pmm_reserve(mbi->mods_addr,
+                mbi->mods_addr + mbi->mods_count * sizeof(multiboot_module_t));
+    for (uint32_t i = 0; i < mbi->mods_count; i++) {
+      pmm_reserve(mods[i].mod_start, mods[i].mod_end);
+    }
+  }
+
+  if (mbi->flags & MULTIBOOT_INFO_ELF_SHDR) {
+    /* the symbol and string tables are loaded after the kernel image, keep
+     * them for ksym */
+    pmm_reserve(mbi->elf_addr, mbi->elf_addr + mbi->elf_num * mbi->elf_size);
+    for (uint32_t i = 0; i < mbi->elf_num; i++) {
+      const elf32_section_header_t *section =
+          phys_to_virt(mbi->elf_addr + i * mbi->elf_size);
+      bool table = section->type == ELF_SECTION_SYMTAB ||
+                   section->type == ELF_SECTION_STRTAB;
+      if (table && !(section->flags & ELF_SECTION_ALLOC) &&
+          section->addr != 0 && section->addr < VMM_DIRECT_MAP_SIZE) {
+        pmm_reserve(section->addr, section->addr + section->size);
+      }
+    }
+  }
+
+  pmm_for_each_available(mbi, pmm_find_top);
+  pmm_page_count = pmm_top >> PMM_PAGE_SHIFT;
+  pmm_descriptor_bytes = pmm_page_count * sizeof(pmm_page_t);
+
+  pmm_for_each_available(mbi, pmm_find_descriptor_space);
+  if (pmm_descriptor_address == 0) {
+    klog(KLOG_ERROR, "pmm: no room for %u page descriptors",
+         (unsigned int)pmm_page_count);
+    pmm_page_count = 0;
+    return;
+  }
+  pmm_reserve(pmm_descriptor_address,
+              pmm_descriptor_address + pmm_descriptor_bytes);
+
+  pmm_pages = phys_to_virt(pmm_descriptor_address);
+  for (size_t i = 0; i < pmm_page_count; i++) {
+    pmm_pages[i] = (pmm_page_t){.next = PMM_NO_PAGE,
+                                .prev = PMM_NO_PAGE,
+                                .owner = NULL,
+                                .order = 0,
+                                .flags = PMM_PAGE_RESERVED};
+  }
+  for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+    pmm_free_lists[order] = PMM_NO_PAGE;
+  }
+
+  pmm_for_each_available(mbi, pmm_free_available);
+}
+
+/** pmm_alloc_pages:
+ *  Allocates a physically contiguous block of 2^order pages, aligned to its
+ *  size. O(log n): a larger block is split in halves down to the order asked
+ *  for.
+ *
+ *  @param order The log2 of the number of pages
+ *  @return The physical address of the block, 0 if none is available
+ */
+uint32_t pmm_alloc_pages(uint32_t order) {
+  if (order > PMM_MAX_ORDER) {
+    return 0;
+  }
+
+  uint32_t flags = interrupts_save();
+
+  uint32_t found = order;
+  while (found <= PMM_MAX_ORDER && pmm_free_lists[found] == PMM_NO_PAGE) {
+    found++;
+  }
+  if (found > PMM_MAX_ORDER) {
+    interrupts_restore(flags);
+    return 0;
+  }
+
+  uint32_t pfn = pmm_free_lists[found];
+  pmm_list_remove(pfn);
+
+  /* give back the upper half until the block is the right size */
+  while (found > order) {
+    found--;
+    pmm_list_push(pfn + (1 << found), found);
+  }
+
+  pmm_pages[pfn].order = order;
+  pmm_free_pages_total -= 1 << order;
+
+  interrupts_restore(flags);
+  return pfn << PMM_PAGE_SHIFT;
+}
+
+/** pmm_alloc_page:
+ *  Allocates a single page
+ *
+ *  @return The physical address of the page, 0 if none is available
+ */
+uint32_t pmm_alloc_page(void) { return pmm_alloc_pages(0); }
+
+/** pmm_free_pages:
+ *  Frees a block returned by pmm_alloc_pages. The order is remembered by the
+ *  allocator.
+ *
+ *  @param address The physical address of the block
+ */
+void pmm_free_pages(uint32_t address) {
+  uint32_t pfn = address >> PMM_PAGE_SHIFT;
+  if (pfn >= pmm_page_count) {
+    return;
+  }
+
+  /* checked with interrupts off, so a free racing with this one can't slip
+   * in between the check and the free */
+  uint32_t flags = interrupts_save();
+  if (!(pmm_pages[pfn].flags & (PMM_PAGE_FREE | PMM_PAGE_RESERVED))) {
+    pmm_free_block(pfn, pmm_pages[pfn].order);
+  }
+  interrupts_restore(flags);
+}
+
+/** pmm_block_order:
+ *  Returns the order of an allocated block
+ *
+ *  @param address The physical address of the block
+ */
+uint32_t pmm_block_order(uint32_t address) {
+  uint32_t pfn = address >> PMM_PAGE_SHIFT;
+  return pfn < pmm_page_count ? pmm_pages[pfn].order : 0;
+}
+
+/** pmm_set_owner:
+ *  Tags every page of an allocated block with an owner, so the block can be
+ *  found again from any address inside it. Freeing the block does not clear
+ *  the tag.
+ *
+ *  @param address The physical address of the block
+ *  @param order The order of the block
+ *  @param owner The tag, NULL to clear it
+ */
+void pmm_set_owner(uint32_t address, uint32_t order, void *owner) {
+  uint32_t pfn = address >> PMM_PAGE_SHIFT;
+  for (uint32_t i = 0; i < (1u << order) && pfn + i < pmm_page_count; i++) {
+    pmm_pages[pfn + i].owner = owner;
+  }
+}
+
+/** pmm_owner:
+ *  Returns the owner tag of the page containing an address
+ *
+ *  @param address A physical address
+ *  @return The tag set by pmm_set_owner, NULL if there is none
+ */
+void *pmm_owner(uint32_t address) {
+  uint32_t pfn = address >> PMM_PAGE_SHIFT;
+  return pfn < pmm_page_count ? pmm_pages[pfn].owner : NULL;
+}
+
+/** pmm_free_page_count:
+ *  Returns the number of free pages
+ *
+ */
+size_t pmm_free_page_count(void) { return pmm_free_pages_total; }
+
+/** pmm_total_page_count:
+ *  Returns the number of pages managed by the allocator
+ *
+ */
+size_t pmm_total_page_count(void) { return pmm_usable_pages; }
+
+/** pmm_free_block_count:
+ *  Returns the number of free blocks of the given order
+ *
+ */
+size_t pmm_free_block_count(uint32_t order) {
+  return order <= PMM_MAX_ORDER ? pmm_free_blocks[order] : 0;
+}
+
+/** pmm_dump:
+ *  Writes the free block count of every order to serial
+ *
+ */
+void pmm_dump(void) {
+  fprintf(SERIAL, "pmm: %u of %u pages free\n",
+          (unsigned int)pmm_free_pages_total, (unsigned int)pmm_usable_pages);
+  for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+    fprintf(SERIAL, "pmm: order %2u (%5u KiB): %u free\n",
+            (unsigned int)order, (unsigned int)(4u << order),
+            (unsigned int)pmm_free_blocks[order]);
+  }
+}
@@ -0,0 +1,51 @@
+#ifndef INCLUDE_PMM_H
+#define INCLUDE_PMM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "multiboot.h"
+
+#define PMM_PAGE_SHIFT 12
+#define PMM_PAGE_SIZE (1 << PMM_PAGE_SHIFT)
+
+/* Largest block the allocator hands out is 2^PMM_MAX_ORDER pages (4 MiB) */
+#define PMM_MAX_ORDER 10
+
+/* Memory below 1 MiB is left alone: BIOS data, VGA and option ROMs */
+#define PMM_LOW_MEMORY_END 0x100000
+
+/* Marks the end of a free list in pmm_page.next / pmm_page.prev */
+#define PMM_NO_PAGE 0xffffffff
+
+/* pmm_page.flags */
+#define PMM_PAGE_RESERVED 0x01 /* never handed out */
+#define PMM_PAGE_FREE 0x02     /* first page of a free block */
+
+/* Descriptor kept for every page frame. Free blocks are linked through
+ * the descriptor of their first page, so free memory itself is never touched.
+ */
+struct pmm_page {
+  uint32_t next;
+  uint32_t prev;
+  void *owner;   /* set by the user of an allocated page, see pmm_set_owner */
+  uint8_t order; /* block order while free or allocated */
+  uint8_t flags;
+};
+
+typedef struct pmm_page pmm_page_t;
+
+void pmm_initialize(const multiboot_info_t *mbi);
+uint32_t pmm_alloc_pages(uint32_t order);
+uint32_t pmm_alloc_page(void);
+void pmm_free_pages(uint32_t address);
+uint32_t pmm_block_order(uint32_t address);
+void pmm_set_owner(uint32_t address, uint32_t order, void *owner);
+void *pmm_owner(uint32_t address);
+size_t pmm_free_page_count(void);
+size_t pmm_total_page_count(void);
+size_t pmm_free_block_count(uint32_t order);
+void pmm_dump(void);
+
+#endif /* INCLUDE_PMM_H */
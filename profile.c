@@ -0,0 +1,172 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clock.h"
+#include "interrupts.h"
+#include "io.h"
+#include "kmem.h"
+#include "ksym.h"
+#include "profile.h"
+#include "str.h"
+#include "timer.h"
+
+/* Interrupted instruction pointers. The buffer is allocated by the first
+ * session and reused, so sampling never allocates. */
+static uint32_t *profile_samples;
+static volatile uint32_t profile_sample_count;
+static volatile uint32_t profile_dropped;
+static volatile uint32_t profile_missed;
+static timer_t profile_timer;
+static uint32_t profile_hz;
+
+/* When the session started and stopped, to report the rate the timer
+ * actually delivered. profile_stopped_ns is 0 while sampling. */
+static uint64_t profile_started_ns;
+static uint64_t profile_stopped_ns;
+
+/** profile_sample:
+ *  Timer callback recording where the timer interrupt found the CPU. When the
+ *  timer softirq runs from the idle loop rather than at an interrupt exit
+ *  there is no interrupted instruction, the tick is counted as missed.
+ *
+ */
+static void profile_sample(__attribute__((unused)) timer_t *timer,
+                           __attribute__((unused)) void *ctx) {
+  interrupt_frame_t *frame = interrupt_current_frame();
+  if (frame == NULL) {
+    profile_missed++;
+    return;
+  }
+
+  if (profile_sample_count < PROFILE_MAX_SAMPLES) {
+    profile_samples[profile_sample_count++] = frame->eip;
+  } else {
+    profile_dropped++;
+  }
+}
+
+/** profile_start:
+ *  Starts a new sampling session, discarding the samples of the last one
+ *
+ *  @param hz The sample rate
+ *  @return false if the sample buffer couldn't be allocated
+ */
+bool profile_start(uint32_t hz) {
+  if (profile_samples == NULL) {
+    profile_samples = kmalloc(PROFILE_MAX_SAMPLES * sizeof(uint32_t));
+    if (profile_samples == NULL) {
+      return false;
+    }
+  }
+  if (hz == 0) {
+    hz = PROFILE_DEFAULT_HZ;
+  }
+
+  uint32_t flags = interrupts_save();
+  profile_sample_count = 0;
+  profile_dropped = 0;
+  profile_missed = 0;
+  profile_hz = hz;
+  profile_started_ns = clock_monotonic_ns();
+  profile_stopped_ns = 0;
+  uint64_t period = CLOCK_NS_PER_SECOND / hz;
+  timer_add_periodic(&profile_timer, profile_started_ns + period, period,
+                     profile_sample, NULL);
+  interrupts_restore(flags);
+
+  fprintf(SERIAL, "profile: sampling at %u Hz\n", (unsigned int)hz);
+  return true;
+}
+
+/** profile_stop:
+ *  Stops sampling, the samples are kept for the reports
+ *
+ */
+void profile_stop(void) {
+  if (timer_cancel(&profile_timer)) {
+    profile_stopped_ns = clock_monotonic_ns();
+  }
+}
+
+/** profile_running:
+ *  Returns whether a session is sampling
+ *
+ */
+bool profile_running(void) { return profile_timer.pending; }
+
+/** profile_report:
+ *  Writes the functions the most samples of the last session fell in to
+ *  serial, symbolized with the kernel's own symbol table
+ *
+ */
+void profile_report(void) {
+  uint32_t total = profile_sample_count;
+  size_t functions = ksym_count();
+
+  /* the rate the timer really fired at, every tick counts whether it was
+   * kept or not, so a timer that falls behind under load shows up here */
+  uint64_t end = profile_stopped_ns != 0 ? profile_stopped_ns
+                                         : clock_monotonic_ns();
+  uint64_t elapsed_ms = (end - profile_started_ns) / 1000000;
+  uint32_t ticks = total + profile_dropped + profile_missed;
+  uint32_t measured_hz =
+      elapsed_ms != 0 ? (uint64_t)ticks * 1000 / elapsed_ms : 0;
+
+  fprintf(SERIAL, "profile: %u samples at %u Hz (measured %u Hz over %u ms), "
+                  "%u dropped, %u missed\n",
+          (unsigned int)total, (unsigned int)profile_hz,
+          (unsigned int)measured_hz, (unsigned int)elapsed_ms,
+          (unsigned int)profile_dropped, (unsigned int)profile_missed);
+  if (total == 0) {
+    return;
+  }
+
+  uint32_t *counts = kmalloc((functions + 1) * sizeof(uint32_t));
+  if (counts == NULL) {
+    fprintf(SERIAL, "profile: no memory for the report\n");
+    return;
+  }
+  memset(counts, 0, (functions + 1) * sizeof(uint32_t));
+
+  /* the last counter collects samples outside any known function */
+  for (uint32_t i = 0; i < total; i++) {
+    int index = ksym_find(profile_samples[i]);
+    counts[index < 0 ? functions : (size_t)index]++;
+  }
+
+  for (uint32_t rank = 0; rank < PROFILE_REPORT_TOP; rank++) {
+    size_t best = 0;
+    for (size_t i = 1; i <= functions; i++) {
+      if (counts[i] > counts[best]) {
+        best = i;
+      }
+    }
+    if (counts[best] == 0) {
+      break;
+    }
+
+    uint32_t permille = (uint64_t)counts[best] * 1000 / total;
+    const ksym_t *symbol = ksym_get(best);
+    fprintf(SERIAL, "profile: %6u %3u.%u%% %s\n", (unsigned int)counts[best],
+            (unsigned int)(permille / 10), (unsigned int)(permille % 10),
+            symbol != NULL ? symbol->name : "(unknown)");
+    counts[best] = 0;
+  }
+
+  kfree(counts);
+}
+
+/** profile_dump_samples:
+ *  Writes every sample of the last session to serial as a raw address, for
+ *  symbolizing on the host, e.g. with addr2line -f -e build/myos.bin
+ *
+ */
+void profile_dump_samples(void) {
+  uint32_t total = profile_sample_count;
+  for (uint32_t i = 0; i < total; i++) {
+    fprintf(SERIAL, "profile: sample %08x\n",
+            (unsigned int)profile_samples[i]);
+  }
+  fprintf(SERIAL, "profile: %u samples\n", (unsigned int)total);
+}
@@ -0,0 +1,22 @@
+#ifndef INCLUDE_PROFILE_H
+#define INCLUDE_PROFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Samples are taken from a timer wheel timer, so the rate is limited to one
+ * sample per TIMER_TICK_NS */
+#define PROFILE_DEFAULT_HZ 500
+#define PROFILE_MAX_SAMPLES 16384
+
+/* Number of functions listed by profile_report */
+#define PROFILE_REPORT_TOP 20
+
+bool profile_start(uint32_t hz);
+void profile_stop(void);
+bool profile_running(void);
+void profile_report(void);
+void profile_dump_samples(void);
+
+#endif /* INCLUDE_PROFILE_H */
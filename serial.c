@@ -2,11 +2,79 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "interrupts.h"
 #include "io.h"
 #include "serial.h"
 #include "str.h"
+#include "thread.h"
 
-/* The I/O ports */
+/* Upper bound on the causes served per interrupt, in case a broken UART
+ * never reports that it has nothing pending */
+#define SERIAL_INTERRUPT_ROUNDS 8
+
+struct serial_port {
+  unsigned int com;
+  enum serial_uart_type type;
+  size_t fifo_size; /* bytes that may be written per transmit empty status */
+};
+
+typedef struct serial_port serial_port_t;
+
+static serial_port_t serial_ports[SERIAL_NUM_PORTS];
+
+/* Transmit ring for COM1. Writers copy into the ring and the IRQ4 transmit
+ * holding register empty interrupt drains it. head and tail are free running
+ * counters, masked on every access.
+ */
+static char serial_tx_buffer[SERIAL_TX_BUFFER_SIZE];
+static volatile size_t serial_tx_head;
+static volatile size_t serial_tx_tail;
+static volatile bool serial_tx_active;
+static unsigned int serial_tx_com;
+static size_t serial_tx_fifo_size = 1;
+static volatile uint32_t serial_tx_dropped_count;
+
+/* Receive ring for COM1, filled by the received data interrupt and drained
+ * by serial_read. The interrupt handler is the only producer and there is a
+ * single reader.
+ */
+static char serial_rx_buffer[SERIAL_RX_BUFFER_SIZE];
+static volatile size_t serial_rx_head;
+static volatile size_t serial_rx_tail;
+static size_t serial_rx_trigger = 1;
+static volatile uint32_t serial_rx_overrun_count;
+static volatile uint32_t serial_rx_dropped_count;
+
+/* Thread blocked in serial_readline, woken by the IRQ4 handler */
+static thread_t *volatile serial_rx_waiter;
+
+/* Set after a carriage return, so the line feed of a CR LF pair doesn't end
+ * a second, empty line */
+static bool serial_rx_last_cr;
+
+/* RTS/CTS hardware flow control on COM1. serial_cts follows the other end's
+ * CTS through the modem status interrupt, serial_rts is what we assert. */
+static bool serial_flow_control;
+static volatile bool serial_cts = true;
+static volatile bool serial_rts = true;
+
+/* Set when waiting for CTS timed out, later waits only poll it once */
+static bool serial_tx_stalled;
+
+/** serial_port:
+ *  Looks up the state of an initialized port
+ *
+ *  @param com the COM port
+ *  @return the port state, or NULL if the port was never initialized
+ */
+static serial_port_t *serial_port(unsigned int com) {
+  for (size_t i = 0; i < SERIAL_NUM_PORTS; i++) {
+    if (serial_ports[i].com == com) {
+      return &serial_ports[i];
+    }
+  }
+  return NULL;
+}
 
 /** serial_configure_baud_rate:
  *  Sets the speed of the data being sent. The default speed of a serial
@@ -37,6 +105,34 @@ void serial_configure_line(unsigned short com) {
   outb(SERIAL_LINE_COMMAND_PORT(com), 0x03);
 }
 
+/** serial_detect_uart:
+ *  Works out which UART is behind the port from how it reacts to the FIFO
+ *  being enabled. Bits 7-6 of the interrupt identification register report
+ *  the FIFO state, bit 5 the 64 byte FIFO of a 16750. Chips without a FIFO
+ *  are told apart by the scratch register, which the 8250 lacks.
+ *
+ *  @param com  The serial port to probe
+ *  @return     The detected UART
+ */
+static enum serial_uart_type serial_detect_uart(unsigned short com) {
+  outb(SERIAL_FIFO_COMMAND_PORT(com), SERIAL_FIFO_DETECT);
+
+  uint8_t iir = inb(SERIAL_INTERRUPT_IDENTIFICATION_PORT(com));
+
+  if ((iir & 0xc0) == 0xc0) {
+    return (iir & 0x20) ? SERIAL_UART_16750 : SERIAL_UART_16550A;
+  }
+  if (iir & 0x80) {
+    return SERIAL_UART_16550;
+  }
+
+  outb(SERIAL_SCRATCH_PORT(com), 0x2a);
+  if (inb(SERIAL_SCRATCH_PORT(com)) == 0x2a) {
+    return SERIAL_UART_16450;
+  }
+  return SERIAL_UART_8250;
+}
+
 /** serial_configure_buffers:
  *  Configures the serial modem buffers.
  *  We're setting it to use 14 bytes for buffer,
@@ -52,7 +148,8 @@ void serial_configure_buffers(unsigned short com) {
 }
 
 /** serial_configure_modem:
- *  All we need to do is set rts and dts/dtr
+ *  Sets rts and dts/dtr, and aux output 2 which gates the UART interrupt
+ *  line through to the PIC
  *
  *  @param com  The serial port to configure
  */
@@ -60,7 +157,105 @@ void serial_configure_modem(unsigned short com) {
   /** Bit:     | 7 | 6 | 5  | 4  | 3   | 2   | 1   | 0   |
     * Content: | r | r | af | lb | ao2 | ao1 | rts | dtr |
     */
-  outb(SERIAL_MODEM_COMMAND_PORT(com), 0x03);
+  outb(SERIAL_MODEM_COMMAND_PORT(com), 0x0b);
+}
+
+/** serial_interrupt_enable_bits:
+ *  Returns the interrupt enable register value for COM1 in its current state
+ *
+ */
+static uint8_t serial_interrupt_enable_bits(void) {
+  uint8_t bits = SERIAL_INTERRUPT_RECEIVED_DATA | SERIAL_INTERRUPT_LINE_STATUS;
+  if (serial_flow_control) {
+    bits |= SERIAL_INTERRUPT_MODEM_STATUS;
+  }
+  if (serial_tx_active) {
+    bits |= SERIAL_INTERRUPT_TRANSMIT_EMPTY;
+  }
+  return bits;
+}
+
+/** serial_update_cts:
+ *  Reads the other end's clear to send line
+ *
+ *  @param com the COM port
+ */
+static void serial_update_cts(unsigned int com) {
+  serial_cts = inb(SERIAL_MODEM_STATUS_PORT(com)) & SERIAL_MODEM_STATUS_CTS;
+}
+
+/** serial_wait_cts:
+ *  Waits for the other end to raise CTS, at most SERIAL_CTS_POLL_LIMIT
+ *  modem status reads, or a single one while the port is stalled. Must be
+ *  called with interrupts disabled.
+ *
+ *  @param com the COM port
+ *  @return false if CTS stayed low, the caller drops what it can't send
+ */
+static bool serial_wait_cts(unsigned int com) {
+  if (!serial_flow_control) {
+    return true;
+  }
+
+  uint32_t polls = serial_tx_stalled ? 1 : SERIAL_CTS_POLL_LIMIT;
+  for (uint32_t i = 0; i < polls; i++) {
+    serial_update_cts(com);
+    if (serial_cts) {
+      serial_tx_stalled = false;
+      return true;
+    }
+  }
+  serial_tx_stalled = true;
+  return false;
+}
+
+/** serial_set_rts:
+ *  Raises or drops our request to send line. Must be called with interrupts
+ *  disabled.
+ *
+ *  @param com the COM port
+ *  @param on whether the other end may send
+ */
+static void serial_set_rts(unsigned int com, bool on) {
+  uint8_t modem = inb(SERIAL_MODEM_COMMAND_PORT(com));
+  if (on) {
+    modem |= SERIAL_MODEM_RTS;
+  } else {
+    modem &= ~SERIAL_MODEM_RTS;
+  }
+  outb(SERIAL_MODEM_COMMAND_PORT(com), modem);
+  serial_rts = on;
+}
+
+/** serial_probe:
+ *  Checks for a UART at a port by sending a byte to itself in loopback mode.
+ *  An empty ISA port reads back as 0xff and never reports data ready.
+ *
+ *  @param com  The serial port to probe
+ *  @return     true if a working UART answered
+ */
+bool serial_probe(unsigned short com) {
+  if (inb(SERIAL_LINE_STATUS_PORT(com)) == 0xff) {
+    return false;
+  }
+
+  serial_configure_baud_rate(com, 1);
+  serial_configure_line(com);
+  outb(SERIAL_INTERRUPT_ENABLE_PORT(com), 0x00);
+  outb(SERIAL_MODEM_COMMAND_PORT(com), SERIAL_MODEM_LOOPBACK);
+
+  /* Drop whatever is left in the receiver before the test byte */
+  inb(SERIAL_DATA_PORT(com));
+
+  outb(SERIAL_DATA_PORT(com), 0xae);
+  bool present = false;
+  for (int i = 0; i < 1000 && !present; i++) {
+    present = inb(SERIAL_LINE_STATUS_PORT(com)) & SERIAL_LINE_DATA_READY;
+  }
+  present = present && inb(SERIAL_DATA_PORT(com)) == 0xae;
+
+  outb(SERIAL_MODEM_COMMAND_PORT(com), 0x00);
+  return present;
 }
 
 /** serial_initialize:
@@ -70,10 +265,44 @@ void serial_configure_modem(unsigned short com) {
  *  @param divisor  The divisor to use
  */
 void serial_initialize(unsigned short com, unsigned short divisor) {
+  serial_port_t *port = serial_port(com);
+  if (port == NULL) {
+    port = serial_port(0);
+  }
+
   serial_configure_baud_rate(com, divisor);
   serial_configure_line(com);
+
+  enum serial_uart_type type = serial_detect_uart(com);
+
   serial_configure_buffers(com);
   serial_configure_modem(com);
+
+  if (port != NULL) {
+    port->com = com;
+    port->type = type;
+    /* The 16750 is driven with its FIFO in 16 byte mode, see
+     * serial_configure_buffers */
+    port->fifo_size =
+        (type >= SERIAL_UART_16550A) ? SERIAL_16550A_FIFO_SIZE : 1;
+  }
+
+  outb(SERIAL_INTERRUPT_ENABLE_PORT(com), 0x00);
+
+  if (com == SERIAL_COM1_BASE) {
+    serial_tx_com = com;
+    serial_tx_fifo_size = (port != NULL) ? port->fifo_size : 1;
+    serial_rx_trigger =
+        (serial_tx_fifo_size > 1) ? SERIAL_16550A_RX_TRIGGER : 1;
+    register_interrupt_handler(IDT_SERIAL_COM1_INTERRUPT_INDEX,
+                               serial_interrupt_handler,
+                               (void *)(uintptr_t)com);
+    irq_unmask(SERIAL_COM1_IRQ);
+
+    /* Receiving is always on, the transmit interrupt stays off until there
+     * is something in the ring to send */
+    outb(SERIAL_INTERRUPT_ENABLE_PORT(com), serial_interrupt_enable_bits());
+  }
 }
 
 /** serial_is_transmit_fifo_empty:
@@ -89,22 +318,423 @@ int serial_is_transmit_fifo_empty(unsigned int com) {
   return inb(SERIAL_LINE_STATUS_PORT(com)) & 0x20;
 }
 
-/** serial_write:
- *  Writes data to the serial port
+/** serial_uart_type:
+ *  Returns the UART detected on the given port
+ *
+ *  @param com the COM port
+ *  @return the UART type, SERIAL_UART_NONE if the port was not initialized
+ */
+enum serial_uart_type serial_uart_type(unsigned int com) {
+  serial_port_t *port = serial_port(com);
+  return (port != NULL) ? port->type : SERIAL_UART_NONE;
+}
+
+/** serial_fifo_size:
+ *  Returns the number of bytes that can be written to the port each time
+ *  the line status reports the transmitter empty
+ *
+ *  @param com the COM port
+ */
+static size_t serial_fifo_size(unsigned int com) {
+  serial_port_t *port = serial_port(com);
+  return (port != NULL) ? port->fifo_size : 1;
+}
+
+/** serial_transmit_pending:
+ *  Moves bytes from the transmit ring into the UART for as long as the
+ *  transmit FIFO is empty, a whole FIFO's worth per line status read. With
+ *  flow control on, nothing is sent while the other end holds CTS low. Must
+ *  be called with interrupts disabled.
+ *
+ *  @param com the COM port
+ */
+static void serial_transmit_pending(unsigned int com) {
+  while (serial_tx_tail != serial_tx_head &&
+         (serial_cts || !serial_flow_control) &&
+         serial_is_transmit_fifo_empty(com)) {
+    size_t burst = serial_tx_head - serial_tx_tail;
+    if (burst > serial_tx_fifo_size) {
+      burst = serial_tx_fifo_size;
+    }
+
+    /* The burst may wrap around the end of the ring */
+    size_t index = serial_tx_tail & (SERIAL_TX_BUFFER_SIZE - 1);
+    size_t first = SERIAL_TX_BUFFER_SIZE - index;
+    if (first > burst) {
+      first = burst;
+    }
+
+    outsb(SERIAL_DATA_PORT(com), &serial_tx_buffer[index], first);
+    if (burst > first) {
+      outsb(SERIAL_DATA_PORT(com), serial_tx_buffer, burst - first);
+    }
+
+    serial_tx_tail += burst;
+  }
+}
+
+/** serial_write_polled:
+ *  Writes data to the serial port, waiting on the line status before every
+ *  FIFO sized burst. Used for ports without a transmit ring.
  *
  *  @param com the COM port
  *  @param data a pointer to the start of the data to write
  *  @param size the number of bytes to write
  */
-void serial_write(unsigned int com, const char *data, size_t size) {
+static void serial_write_polled(unsigned int com, const char *data,
+                                size_t size) {
+  size_t fifo_size = serial_fifo_size(com);
   size_t count = 0;
   while (count < size) {
     if (serial_is_transmit_fifo_empty(com)) {
-      outb(SERIAL_DATA_PORT(com), data[count]);
-      count++;
+      size_t burst = size - count;
+      if (burst > fifo_size) {
+        burst = fifo_size;
+      }
+      outsb(SERIAL_DATA_PORT(com), &data[count], burst);
+      count += burst;
+    }
+  }
+}
+
+/** serial_write:
+ *  Writes data to the serial port. On a port with a transmit ring the data is
+ *  copied into the ring and sent from the transmit interrupt, so this only
+ *  waits on the UART when the ring is full. If flow control is on and the
+ *  other end keeps CTS low, the rest of the data is dropped and counted.
+ *
+ *  @param com the COM port
+ *  @param data a pointer to the start of the data to write
+ *  @param size the number of bytes to write
+ */
+void serial_write(unsigned int com, const char *data, size_t size) {
+  if (com != serial_tx_com) {
+    serial_write_polled(com, data, size);
+    return;
+  }
+
+  uint32_t flags = interrupts_save();
+
+  for (size_t i = 0; i < size; i++) {
+    while (serial_tx_head - serial_tx_tail == SERIAL_TX_BUFFER_SIZE &&
+           serial_wait_cts(com)) {
+      serial_transmit_pending(com);
+    }
+    if (serial_tx_head - serial_tx_tail == SERIAL_TX_BUFFER_SIZE) {
+      serial_tx_dropped_count += size - i;
+      break;
     }
+    serial_tx_buffer[serial_tx_head & (SERIAL_TX_BUFFER_SIZE - 1)] = data[i];
+    serial_tx_head++;
+  }
+
+  /* Enabling the interrupt while the holding register is already empty
+   * raises it straight away, which starts the drain */
+  if (!serial_tx_active && serial_tx_head != serial_tx_tail) {
+    serial_tx_active = true;
+    outb(SERIAL_INTERRUPT_ENABLE_PORT(com), serial_interrupt_enable_bits());
+  }
+
+  interrupts_restore(flags);
+}
+
+/** serial_flush:
+ *  Synchronously drains the transmit ring, for use when interrupts can no
+ *  longer be relied upon (e.g. fatal exceptions). Gives up, leaving the data
+ *  in the ring, if the other end keeps CTS low.
+ *
+ *  @param com the COM port
+ */
+void serial_flush(unsigned int com) {
+  if (com != serial_tx_com) {
+    return;
+  }
+
+  uint32_t flags = interrupts_save();
+
+  while (serial_tx_head != serial_tx_tail && serial_wait_cts(com)) {
+    serial_transmit_pending(com);
   }
+
+  interrupts_restore(flags);
 }
+
+/** serial_receive_pending:
+ *  Moves every byte waiting in the receive FIFO into the receive ring and
+ *  drops RTS if the ring is nearly full. Must be called with interrupts
+ *  disabled.
+ *
+ *  @param com the COM port
+ *  @param known the number of bytes known to be waiting, these are read
+ *               with a single rep insb without checking the line status
+ */
+static void serial_receive_pending(unsigned int com, size_t known) {
+  size_t head = serial_rx_head;
+  size_t room = SERIAL_RX_BUFFER_SIZE - (head - serial_rx_tail);
+  if (known > room) {
+    known = room;
+  }
+
+  /* The block may wrap around the end of the ring */
+  size_t index = head & (SERIAL_RX_BUFFER_SIZE - 1);
+  size_t first = SERIAL_RX_BUFFER_SIZE - index;
+  if (first > known) {
+    first = known;
+  }
+  insb(SERIAL_DATA_PORT(com), &serial_rx_buffer[index], first);
+  if (known > first) {
+    insb(SERIAL_DATA_PORT(com), serial_rx_buffer, known - first);
+  }
+  head += known;
+
+  /* The rest of the FIFO, byte by byte. Bytes that don't fit are still read
+   * so the interrupt clears. */
+  for (;;) {
+    uint8_t status = inb(SERIAL_LINE_STATUS_PORT(com));
+    if (status & SERIAL_LINE_OVERRUN) {
+      serial_rx_overrun_count++;
+    }
+    if (!(status & SERIAL_LINE_DATA_READY)) {
+      break;
+    }
+
+    char c = inb(SERIAL_DATA_PORT(com));
+    if (head - serial_rx_tail == SERIAL_RX_BUFFER_SIZE) {
+      serial_rx_dropped_count++;
+      continue;
+    }
+    serial_rx_buffer[head & (SERIAL_RX_BUFFER_SIZE - 1)] = c;
+    head++;
+  }
+  serial_rx_head = head;
+
+  if (serial_flow_control && serial_rts &&
+      head - serial_rx_tail >= SERIAL_RX_HIGH_WATER) {
+    serial_set_rts(com, false);
+  }
+
+  if (serial_rx_waiter != NULL) {
+    thread_wake(serial_rx_waiter);
+  }
+}
+
+/** serial_interrupt_handler:
+ *  Handles the UART interrupt. Serves every pending cause, highest priority
+ *  first, until the UART reports none: receive errors, received data, the
+ *  transmitter running empty and CTS changes. Turns the transmit interrupt
+ *  off once the transmit ring is empty.
+ *
+ *  @param frame the interrupted state
+ *  @param ctx the COM port
+ */
+void serial_interrupt_handler(__attribute__((unused)) interrupt_frame_t *frame,
+                              void *ctx) {
+  unsigned int com = (uintptr_t)ctx;
+
+  for (unsigned int round = 0; round < SERIAL_INTERRUPT_ROUNDS; round++) {
+    /* Reading the identification register acknowledges a transmit
+     * interrupt */
+    uint8_t id = inb(SERIAL_INTERRUPT_IDENTIFICATION_PORT(com));
+    if (id & SERIAL_INTERRUPT_NONE_PENDING) {
+      break;
+    }
+    if (com != serial_tx_com) {
+      return;
+    }
+
+    switch (id & SERIAL_INTERRUPT_ID_MASK) {
+    case SERIAL_INTERRUPT_ID_LINE_STATUS:
+      if (inb(SERIAL_LINE_STATUS_PORT(com)) & SERIAL_LINE_OVERRUN) {
+        serial_rx_overrun_count++;
+      }
+      break;
+    case SERIAL_INTERRUPT_ID_RECEIVED_DATA:
+      /* the FIFO holds at least its trigger level */
+      serial_receive_pending(com, serial_rx_trigger);
+      break;
+    case SERIAL_INTERRUPT_ID_RECEIVE_TIMEOUT:
+      serial_receive_pending(com, 0);
+      break;
+    case SERIAL_INTERRUPT_ID_TRANSMIT_EMPTY:
+      serial_transmit_pending(com);
+      break;
+    case SERIAL_INTERRUPT_ID_MODEM_STATUS:
+      serial_update_cts(com);
+      serial_transmit_pending(com);
+      break;
+    }
+  }
+
+  if (serial_tx_active && serial_tx_head == serial_tx_tail) {
+    serial_tx_active = false;
+    outb(SERIAL_INTERRUPT_ENABLE_PORT(com), serial_interrupt_enable_bits());
+  }
+}
+
+/** serial_set_flow_control:
+ *  Turns RTS/CTS hardware flow control on COM1 on or off. With it on, RTS is
+ *  dropped while the receive ring is nearly full and nothing is sent while
+ *  the other end holds CTS low.
+ *
+ *  @param com the COM port
+ *  @param enabled whether to use flow control
+ */
+void serial_set_flow_control(unsigned int com, bool enabled) {
+  if (com != serial_tx_com) {
+    return;
+  }
+
+  uint32_t flags = interrupts_save();
+
+  serial_flow_control = enabled;
+  serial_tx_stalled = false;
+  serial_update_cts(com);
+  if (!enabled && !serial_rts) {
+    serial_set_rts(com, true);
+  }
+  outb(SERIAL_INTERRUPT_ENABLE_PORT(com), serial_interrupt_enable_bits());
+  serial_transmit_pending(com);
+
+  interrupts_restore(flags);
+}
+
+/** serial_get_flow_control:
+ *  Returns whether RTS/CTS flow control is on
+ *
+ *  @param com the COM port
+ */
+bool serial_get_flow_control(unsigned int com) {
+  return com == serial_tx_com && serial_flow_control;
+}
+
+/** serial_read:
+ *  Takes whatever has been received, up to the size of the buffer, without
+ *  waiting. Raises RTS again once the ring has drained far enough.
+ *
+ *  @param com the COM port
+ *  @param buffer where to store the data
+ *  @param size the size of the buffer
+ *  @return the number of bytes read
+ */
+size_t serial_read(unsigned int com, char *buffer, size_t size) {
+  if (com != serial_tx_com) {
+    return 0;
+  }
+
+  size_t tail = serial_rx_tail;
+  size_t count = serial_rx_head - tail;
+  if (count > size) {
+    count = size;
+  }
+
+  size_t index = tail & (SERIAL_RX_BUFFER_SIZE - 1);
+  size_t first = SERIAL_RX_BUFFER_SIZE - index;
+  if (first > count) {
+    first = count;
+  }
+  memcpy(buffer, &serial_rx_buffer[index], first);
+  memcpy(buffer + first, serial_rx_buffer, count - first);
+  serial_rx_tail = tail + count;
+
+  if (!serial_rts && serial_rx_head - serial_rx_tail <= SERIAL_RX_LOW_WATER) {
+    uint32_t flags = interrupts_save();
+    if (!serial_rts && serial_flow_control) {
+      serial_set_rts(com, true);
+    }
+    interrupts_restore(flags);
+  }
+
+  return count;
+}
+
+/** serial_wait_input:
+ *  Blocks the calling thread until something has been received
+ *
+ */
+static void serial_wait_input(void) {
+  /* the IRQ can't run between the check and blocking, so a byte that
+   * arrives after the check still wakes us */
+  disable_interrupts();
+  if (serial_rx_head == serial_rx_tail) {
+    serial_rx_waiter = thread_current();
+    thread_block();
+    serial_rx_waiter = NULL;
+  }
+  enable_interrupts();
+}
+
+/** serial_readline:
+ *  Reads a line, blocking until it is complete. Characters are echoed as
+ *  they are typed, backspace and delete erase the last one and ^U the whole
+ *  line. CR, LF and CR LF all end a line. Characters past the end of the
+ *  buffer and other control characters are ignored.
+ *
+ *  @param com the COM port
+ *  @param buffer where to store the line, null terminated and without the
+ *                line ending
+ *  @param size the size of the buffer
+ *  @return the length of the line
+ */
+size_t serial_readline(unsigned int com, char *buffer, size_t size) {
+  if (com != serial_tx_com || size == 0) {
+    return 0;
+  }
+
+  size_t length = 0;
+  for (;;) {
+    char c;
+    if (serial_read(com, &c, 1) == 0) {
+      serial_wait_input();
+      continue;
+    }
+
+    bool after_cr = serial_rx_last_cr;
+    serial_rx_last_cr = (c == '\r');
+    if (c == '\n' && after_cr) {
+      continue;
+    }
+
+    if (c == '\r' || c == '\n') {
+      serial_write(com, "\r\n", 2);
+      break;
+    } else if (c == '\b' || c == 0x7f) {
+      if (length > 0) {
+        length--;
+        serial_write(com, "\b \b", 3);
+      }
+    } else if (c == 0x15) {
+      while (length > 0) {
+        length--;
+        serial_write(com, "\b \b", 3);
+      }
+    } else if ((unsigned char)c >= 0x20 && length + 1 < size) {
+      buffer[length++] = c;
+      serial_write(com, &c, 1);
+    }
+  }
+
+  buffer[length] = '\0';
+  return length;
+}
+
+/** serial_rx_overruns:
+ *  Returns the number of times the UART's receive FIFO overflowed
+ *
+ */
+uint32_t serial_rx_overruns(void) { return serial_rx_overrun_count; }
+
+/** serial_rx_dropped:
+ *  Returns the number of received bytes lost because the ring was full
+ *
+ */
+uint32_t serial_rx_dropped(void) { return serial_rx_dropped_count; }
+
+/** serial_tx_dropped:
+ *  Returns the number of bytes not sent because CTS stayed low
+ *
+ */
+uint32_t serial_tx_dropped(void) { return serial_tx_dropped_count; }
+
 /** serial_writestring:
  *  Writes a null terminated string to the serial port
  *
@@ -1,18 +1,35 @@
 #ifndef INCLUDE_SERIAL_H
 #define INCLUDE_SERIAL_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "interrupts.h"
+
 /* All the I/O ports are calculated relative to the data port. This is because
  * all serial ports (COM1, COM2, COM3, COM4) have their ports in the same
  * order, but they start at different values.
  */
 
 #define SERIAL_COM1_BASE 0x3F8 /* COM1 base port */
+#define SERIAL_COM2_BASE 0x2F8 /* COM2 base port */
+#define SERIAL_COM3_BASE 0x3E8 /* COM3 base port */
+#define SERIAL_COM4_BASE 0x2E8 /* COM4 base port */
+
+#define SERIAL_COM1_IRQ 4 /* COM1 interrupt line on the master PIC */
 
 #define SERIAL_DATA_PORT(base) (base)
+#define SERIAL_INTERRUPT_ENABLE_PORT(base) (base + 1)
+#define SERIAL_INTERRUPT_IDENTIFICATION_PORT(base) (base + 2)
 #define SERIAL_FIFO_COMMAND_PORT(base) (base + 2)
 #define SERIAL_LINE_COMMAND_PORT(base) (base + 3)
 #define SERIAL_MODEM_COMMAND_PORT(base) (base + 4)
 #define SERIAL_LINE_STATUS_PORT(base) (base + 5)
+#define SERIAL_MODEM_STATUS_PORT(base) (base + 6)
+#define SERIAL_SCRATCH_PORT(base) (base + 7)
+
+#define SERIAL_NUM_PORTS 4
 
 /* The I/O port commands */
 
@@ -21,7 +38,132 @@
  * then the lowest 8 bits will follow
  */
 #define SERIAL_LINE_ENABLE_DLAB 0x80
+
+/* SERIAL_INTERRUPT_RECEIVED_DATA:
+ * Interrupt enable bit which raises an interrupt when the receive FIFO
+ * reaches its trigger level, or holds data that hasn't been read for four
+ * character times
+ */
+#define SERIAL_INTERRUPT_RECEIVED_DATA 0x01
+
+/* SERIAL_INTERRUPT_TRANSMIT_EMPTY:
+ * Interrupt enable bit which raises an interrupt whenever the transmit
+ * holding register becomes empty
+ */
+#define SERIAL_INTERRUPT_TRANSMIT_EMPTY 0x02
+
+/* SERIAL_INTERRUPT_LINE_STATUS:
+ * Interrupt enable bit which raises an interrupt on receive errors such as
+ * an overrun
+ */
+#define SERIAL_INTERRUPT_LINE_STATUS 0x04
+
+/* SERIAL_INTERRUPT_MODEM_STATUS:
+ * Interrupt enable bit which raises an interrupt when a modem input such as
+ * CTS changes
+ */
+#define SERIAL_INTERRUPT_MODEM_STATUS 0x08
+
+/* The cause of a pending interrupt, bits 3-1 of the interrupt identification
+ * register, in priority order */
+#define SERIAL_INTERRUPT_ID_MASK 0x0e
+#define SERIAL_INTERRUPT_ID_LINE_STATUS 0x06
+#define SERIAL_INTERRUPT_ID_RECEIVED_DATA 0x04
+#define SERIAL_INTERRUPT_ID_RECEIVE_TIMEOUT 0x0c
+#define SERIAL_INTERRUPT_ID_TRANSMIT_EMPTY 0x02
+#define SERIAL_INTERRUPT_ID_MODEM_STATUS 0x00
+
+/* SERIAL_INTERRUPT_NONE_PENDING:
+ * Set in the interrupt identification register when the UART has no
+ * interrupt pending
+ */
+#define SERIAL_INTERRUPT_NONE_PENDING 0x01
+
+/* SERIAL_MODEM_LOOPBACK:
+ * Modem control value used while probing for a UART: loopback mode with the
+ * outputs set, so bytes sent come straight back to the receiver
+ */
+#define SERIAL_MODEM_LOOPBACK 0x1e
+
+/* SERIAL_LINE_DATA_READY:
+ * Set in the line status register when a received byte is waiting
+ */
+#define SERIAL_LINE_DATA_READY 0x01
+
+/* SERIAL_LINE_OVERRUN:
+ * Set in the line status register when the receive FIFO overflowed and a
+ * byte was lost
+ */
+#define SERIAL_LINE_OVERRUN 0x02
+
+/* SERIAL_MODEM_RTS:
+ * Request to send bit of the modem control register. Dropping it asks the
+ * other end to stop sending.
+ */
+#define SERIAL_MODEM_RTS 0x02
+
+/* SERIAL_MODEM_STATUS_CTS:
+ * Clear to send bit of the modem status register, set while the other end
+ * is willing to receive
+ */
+#define SERIAL_MODEM_STATUS_CTS 0x10
+
+/* SERIAL_FIFO_DETECT:
+ * FIFO control value used while probing the UART: enable the FIFOs and ask
+ * for the 64 byte FIFO a 16750 would have
+ */
+#define SERIAL_FIFO_DETECT 0xe7
+
+/* Transmit FIFO depth of a 16550A, the number of bytes that can be written
+ * back to back once the line status reports the transmitter empty
+ */
+#define SERIAL_16550A_FIFO_SIZE 16
+
+/* Receive FIFO trigger level set by serial_configure_buffers, the number of
+ * bytes known to be waiting when a received data interrupt is raised
+ */
+#define SERIAL_16550A_RX_TRIGGER 14
+
+/* UART chips told apart by serial_detect_uart */
+enum serial_uart_type {
+  SERIAL_UART_NONE = 0,
+  SERIAL_UART_8250,
+  SERIAL_UART_16450,
+  SERIAL_UART_16550,  /* FIFO present but broken, used as a 16450 */
+  SERIAL_UART_16550A,
+  SERIAL_UART_16750,
+};
+
+/* Size of the transmit ring, must be a power of two */
+#define SERIAL_TX_BUFFER_SIZE 4096
+
+/* Size of the receive ring, must be a power of two. RTS is dropped when the
+ * ring fills past the high water mark and raised again once the reader has
+ * drained it below the low water mark. The headroom above the high water
+ * mark covers what the other end sends before it notices. */
+#define SERIAL_RX_BUFFER_SIZE 4096
+#define SERIAL_RX_HIGH_WATER (SERIAL_RX_BUFFER_SIZE - 512)
+#define SERIAL_RX_LOW_WATER (SERIAL_RX_BUFFER_SIZE / 4)
+
+/* Modem status reads serial_write and serial_flush make while the transmit
+ * ring is full and the other end holds CTS low, before they give up and drop
+ * the data. Each read is an ISA bus cycle of about a microsecond, so this is
+ * on the order of 100 ms. Until CTS comes back a full ring drops at once. */
+#define SERIAL_CTS_POLL_LIMIT 100000
+
+bool serial_probe(unsigned short com);
 void serial_initialize(unsigned short com, unsigned short divisor);
+enum serial_uart_type serial_uart_type(unsigned int com);
+void serial_write(unsigned int com, const char *data, size_t size);
 void serial_writestring(unsigned int com, const char *data);
+void serial_flush(unsigned int com);
+void serial_set_flow_control(unsigned int com, bool enabled);
+bool serial_get_flow_control(unsigned int com);
+size_t serial_read(unsigned int com, char *buffer, size_t size);
+size_t serial_readline(unsigned int com, char *buffer, size_t size);
+uint32_t serial_rx_overruns(void);
+uint32_t serial_rx_dropped(void);
+uint32_t serial_tx_dropped(void);
+void serial_interrupt_handler(interrupt_frame_t *frame, void *ctx);
 
 #endif /* INCLUDE_SERIAL_H */
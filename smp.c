@@ -0,0 +1,226 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "acpi.h"
+#include "apic.h"
+#include "clock.h"
+#include "cpu.h"
+#include "fpu.h"
+#include "gdt.h"
+#include "interrupts.h"
+#include "io.h"
+#include "klog.h"
+#include "pmm.h"
+#include "smp.h"
+#include "str.h"
+#include "syscall.h"
+#include "vmm.h"
+
+/* smp_trampoline.asm */
+extern const uint8_t smp_trampoline_start[];
+extern const uint8_t smp_trampoline_end[];
+extern const uint8_t smp_trampoline_params[];
+
+static smp_cpu_t smp_cpus[ACPI_MAX_CPUS];
+static uint32_t smp_count = 1;
+
+/** smp_delay:
+ *  Spins for at least the given time
+ *
+ *  @param ns The time to wait in nanoseconds
+ */
+static void smp_delay(uint64_t ns) {
+  uint64_t end = clock_monotonic_ns() + ns;
+  while (clock_monotonic_ns() < end) {
+    asm volatile("pause");
+  }
+}
+
+/** smp_initialize_cpu:
+ *  Loads the calling CPU's GDT and TSS and points its fs segment at its
+ *  per-CPU data
+ *
+ *  @param cpu The calling CPU
+ */
+static void smp_initialize_cpu(smp_cpu_t *cpu) {
+  cpu->self = cpu;
+  gdt_init_cpu(cpu->gdt, &cpu->tss, cpu, sizeof(*cpu));
+}
+
+/** smp_ap_main:
+ *  Entered from the trampoline on an application processor's own stack.
+ *  Sets up the CPU and parks it.
+ *
+ *  @param cpu The CPU that is starting
+ */
+static void smp_ap_main(smp_cpu_t *cpu) {
+  smp_initialize_cpu(cpu);
+  idt_load();
+  vmm_initialize_cpu();
+  fpu_initialize_cpu();
+  syscall_initialize_cpu();
+  apic_local_initialize();
+
+  __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+
+  /* The interrupt path, the scheduler and the timers still keep their state
+   * in globals, so the CPU idles here with interrupts off. Only NMIs and
+   * IPIs that wake it on purpose get through. */
+  for (;;) {
+    asm volatile("cli; hlt");
+  }
+}
+
+/** smp_start_cpu:
+ *  Starts one application processor with the INIT-SIPI-SIPI sequence and
+ *  waits for it to come online. The trampoline must be in place.
+ *
+ *  @param cpu The CPU to start, its id and apic_id set
+ *  @param params The trampoline's parameter block
+ *  @return false if the CPU didn't come online
+ */
+static bool smp_start_cpu(smp_cpu_t *cpu, smp_trampoline_params_t *params) {
+  uint32_t phys = pmm_alloc_pages(SMP_STACK_ORDER);
+  if (phys == 0) {
+    klog(KLOG_WARNING, "smp: no memory for the stack of cpu %u",
+         (unsigned int)cpu->id);
+    return false;
+  }
+  cpu->stack = (uint32_t)phys_to_virt(phys) +
+               (PMM_PAGE_SIZE << SMP_STACK_ORDER);
+
+  params->cr3 = read_cr3();
+  params->cr4 = read_cr4();
+  params->stack = cpu->stack;
+  params->entry = (uint32_t)smp_ap_main;
+  params->arg = (uint32_t)cpu;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  apic_send_ipi(cpu->apic_id, APIC_ICR_INIT | APIC_ICR_LEVEL_ASSERT);
+  smp_delay(SMP_INIT_DELAY_NS);
+
+  /* a second startup IPI only if the first one was missed */
+  for (int attempt = 0; attempt < 2; attempt++) {
+    apic_send_ipi(cpu->apic_id, APIC_ICR_STARTUP | SMP_STARTUP_VECTOR);
+    smp_delay(SMP_STARTUP_DELAY_NS);
+    if (__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE)) {
+      return true;
+    }
+  }
+
+  uint64_t end = clock_monotonic_ns() + SMP_ONLINE_TIMEOUT_NS;
+  while (clock_monotonic_ns() < end) {
+    if (__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE)) {
+      return true;
+    }
+    asm volatile("pause");
+  }
+
+  /* the stack stays allocated, the CPU might still be using it */
+  klog(KLOG_WARNING, "smp: cpu %u (apic %u) didn't start",
+       (unsigned int)cpu->id, (unsigned int)cpu->apic_id);
+  return false;
+}
+
+/** smp_initialize_boot_cpu:
+ *  Gives the boot CPU its per-CPU GDT, TSS and data. Run right after
+ *  gdt_init, before anything uses smp_current_cpu.
+ *
+ */
+void smp_initialize_boot_cpu(void) {
+  smp_cpu_t *cpu = &smp_cpus[0];
+  cpu->id = 0;
+  cpu->online = true;
+  smp_initialize_cpu(cpu);
+}
+
+/** smp_initialize:
+ *  Starts every other processor the MADT lists, one at a time. Needs the
+ *  APICs, the clock and the page allocator.
+ *
+ */
+void smp_initialize(void) {
+  const acpi_madt_info_t *madt = acpi_madt_info();
+  if (!apic_active() || madt == NULL) {
+    klog(KLOG_INFO, "smp: no APIC, running on the boot cpu only");
+    return;
+  }
+
+  smp_cpus[0].apic_id = apic_id();
+  if (madt->cpu_count <= 1) {
+    return;
+  }
+
+  memcpy(phys_to_virt(SMP_TRAMPOLINE_BASE), smp_trampoline_start,
+         smp_trampoline_end - smp_trampoline_start);
+  smp_trampoline_params_t *params = phys_to_virt(
+      SMP_TRAMPOLINE_BASE + (smp_trampoline_params - smp_trampoline_start));
+
+  /* the trampoline keeps running at its physical address as it turns on
+   * paging */
+  vmm_set_low_identity(true);
+
+  uint32_t online = 1;
+  for (uint32_t i = 0; i < madt->cpu_count; i++) {
+    if (madt->cpus[i].apic_id == smp_cpus[0].apic_id) {
+      continue;
+    }
+
+    smp_cpu_t *cpu = &smp_cpus[smp_count];
+    cpu->id = smp_count;
+    cpu->apic_id = madt->cpus[i].apic_id;
+    smp_count++;
+    if (smp_start_cpu(cpu, params)) {
+      online++;
+    }
+  }
+
+  vmm_set_low_identity(false);
+
+  klog(KLOG_INFO, "smp: %u of %u cpus online", (unsigned int)online,
+       (unsigned int)smp_count);
+}
+
+/** smp_cpu_count:
+ *  Returns the number of CPUs found, online or not
+ *
+ */
+uint32_t smp_cpu_count(void) { return smp_count; }
+
+/** smp_online_count:
+ *  Returns the number of CPUs that came online
+ *
+ */
+uint32_t smp_online_count(void) {
+  uint32_t online = 0;
+  for (uint32_t i = 0; i < smp_count; i++) {
+    online += __atomic_load_n(&smp_cpus[i].online, __ATOMIC_ACQUIRE);
+  }
+  return online;
+}
+
+/** smp_cpu:
+ *  Returns the per-CPU data of a CPU
+ *
+ *  @param id The CPU index, below smp_cpu_count
+ *  @return The CPU, NULL if there is no such CPU
+ */
+smp_cpu_t *smp_cpu(uint32_t id) {
+  return id < smp_count ? &smp_cpus[id] : NULL;
+}
+
+/** smp_dump:
+ *  Writes the CPUs and their state to serial
+ *
+ */
+void smp_dump(void) {
+  for (uint32_t i = 0; i < smp_count; i++) {
+    const smp_cpu_t *cpu = &smp_cpus[i];
+    fprintf(SERIAL, "cpu %2u: apic %3u %-7s stack %08x\n",
+            (unsigned int)cpu->id, (unsigned int)cpu->apic_id,
+            __atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE) ? "online"
+                                                            : "offline",
+            (unsigned int)cpu->stack);
+  }
+}
@@ -0,0 +1,66 @@
+#ifndef INCLUDE_SMP_H
+#define INCLUDE_SMP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "acpi.h"
+#include "gdt.h"
+
+/* Physical address the real mode trampoline is copied to, page aligned and
+ * below 1 MiB. The startup IPI vector is its page number. */
+#define SMP_TRAMPOLINE_BASE 0x8000
+#define SMP_STARTUP_VECTOR (SMP_TRAMPOLINE_BASE >> 12)
+
+/* Boot stack of each application processor, 2^order pages */
+#define SMP_STACK_ORDER 2
+
+/* Waits of the INIT-SIPI-SIPI sequence */
+#define SMP_INIT_DELAY_NS 10000000ULL
+#define SMP_STARTUP_DELAY_NS 200000ULL
+#define SMP_ONLINE_TIMEOUT_NS 100000000ULL
+
+/* Per-CPU data. Each CPU's fs segment covers its own smp_cpu_t, so
+ * smp_current_cpu is a single load from fs:0. */
+struct smp_cpu {
+  struct smp_cpu *self; /* must stay first */
+  uint32_t id;          /* index in smp_cpus, the boot CPU is 0 */
+  uint32_t apic_id;
+  uint32_t stack; /* top of the boot stack, 0 for the boot CPU */
+  bool online;
+  gdt_entry_t gdt[GDT_NUM_ENTRIES];
+  tss_t tss;
+};
+
+typedef struct smp_cpu smp_cpu_t;
+
+/* Handed to the trampoline, laid out like smp_trampoline_params */
+struct smp_trampoline_params {
+  uint32_t cr3;
+  uint32_t cr4;
+  uint32_t stack;
+  uint32_t entry;
+  uint32_t arg;
+};
+
+typedef struct smp_trampoline_params smp_trampoline_params_t;
+
+/** smp_current_cpu:
+ *  Returns the per-CPU data of the calling CPU
+ *
+ */
+static inline smp_cpu_t *smp_current_cpu(void) {
+  smp_cpu_t *cpu;
+  asm volatile("mov %%fs:0, %0" : "=r"(cpu));
+  return cpu;
+}
+
+void smp_initialize_boot_cpu(void);
+void smp_initialize(void);
+uint32_t smp_cpu_count(void);
+uint32_t smp_online_count(void);
+smp_cpu_t *smp_cpu(uint32_t id);
+void smp_dump(void);
+
+#endif /* INCLUDE_SMP_H */
@@ -0,0 +1,84 @@
+; Real mode entry of the application processors. The code is position
+; dependent, so smp_initialize copies it to SMP_TRAMPOLINE_BASE before sending
+; the startup IPIs and every address is computed relative to that copy.
+
+global smp_trampoline_start
+global smp_trampoline_end
+global smp_trampoline_params
+
+SMP_TRAMPOLINE_BASE equ 0x8000 ; must match smp.h
+
+SEGSEL_KERNEL_CS equ 0x08
+SEGSEL_KERNEL_DS equ 0x10
+
+CR0_PE equ 0x00000001
+CR0_PG_WP equ 0x80010000
+
+; address of a trampoline label in the copy
+%define TRAMPOLINE(label) (SMP_TRAMPOLINE_BASE + (label - smp_trampoline_start))
+
+section .rodata
+
+align 16
+[bits 16]
+smp_trampoline_start:
+  cli
+  cld
+  xor ax, ax
+  mov ds, ax
+  lgdt [TRAMPOLINE(trampoline_gdt_ptr)]
+
+  mov eax, cr0
+  or eax, CR0_PE
+  mov cr0, eax
+  jmp dword SEGSEL_KERNEL_CS:TRAMPOLINE(trampoline_protected)
+
+[bits 32]
+trampoline_protected:
+  mov ax, SEGSEL_KERNEL_DS
+  mov ds, ax
+  mov es, ax
+  mov ss, ax
+  mov fs, ax
+  mov gs, ax
+
+  ; same paging setup as the boot CPU, the first 4 MiB are identity mapped
+  ; while the trampoline runs
+  mov eax, [TRAMPOLINE(smp_trampoline_params.cr4)]
+  mov cr4, eax
+  mov eax, [TRAMPOLINE(smp_trampoline_params.cr3)]
+  mov cr3, eax
+  mov eax, cr0
+  or eax, CR0_PG_WP
+  mov cr0, eax
+
+  mov esp, [TRAMPOLINE(smp_trampoline_params.stack)]
+  push dword [TRAMPOLINE(smp_trampoline_params.arg)]
+  mov eax, [TRAMPOLINE(smp_trampoline_params.entry)]
+  call eax          ; never returns
+
+.halt:
+  cli
+  hlt
+  jmp .halt
+
+align 8
+trampoline_gdt:
+  dq 0                  ; null
+  dq 0x00cf9a000000ffff ; flat code, selector 0x08
+  dq 0x00cf92000000ffff ; flat data, selector 0x10
+
+trampoline_gdt_ptr:
+  dw trampoline_gdt_ptr - trampoline_gdt - 1
+  dd TRAMPOLINE(trampoline_gdt)
+
+; filled in by smp_initialize for each processor, see smp_trampoline_params_t
+align 4
+smp_trampoline_params:
+.cr3:   dd 0
+.cr4:   dd 0
+.stack: dd 0
+.entry: dd 0
+.arg:   dd 0
+
+smp_trampoline_end:
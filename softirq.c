@@ -0,0 +1,262 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "atomic.h"
+#include "clock.h"
+#include "cpu.h"
+#include "interrupts.h"
+#include "io.h"
+#include "softirq.h"
+
+struct softirq {
+  const char *name;
+  softirq_handler_t handler;
+  softirq_stats_t stats;
+};
+
+static struct softirq softirqs[SOFTIRQ_COUNT];
+
+/* Bit n is set when type n needs to run. Set from interrupt handlers,
+ * cleared by softirq_run. */
+static uint32_t softirq_pending_mask;
+
+/* Whether softirq_run is draining, so interrupts arriving meanwhile leave the
+ * work to it */
+static bool softirq_active;
+
+/* Times softirq_run gave up with work still pending */
+static uint32_t softirq_deferred;
+
+static bool softirq_have_tsc;
+
+/* Scheduled tasklets in the order they were scheduled */
+static tasklet_t *tasklet_head;
+static tasklet_t *tasklet_tail;
+
+/* Every initialized tasklet, for softirq_dump */
+static tasklet_t *tasklet_all;
+
+/** softirq_account:
+ *  Adds a run of deferred work to its statistics
+ *
+ *  @param stats The statistics to update
+ *  @param start The TSC when the work started
+ */
+static void softirq_account(softirq_stats_t *stats, uint64_t start) {
+  uint64_t cycles = softirq_have_tsc ? rdtsc() - start : 0;
+  stats->count++;
+  stats->total_cycles += cycles;
+  if (cycles > stats->max_cycles) {
+    stats->max_cycles = cycles;
+  }
+}
+
+/** tasklet_run_all:
+ *  Bottom half of SOFTIRQ_TASKLET, runs the tasklets scheduled so far. Ones
+ *  scheduled while this runs wait for the next pass.
+ *
+ */
+static void tasklet_run_all(void) {
+  uint32_t flags = interrupts_save();
+  tasklet_t *tasklet = tasklet_head;
+  tasklet_head = NULL;
+  tasklet_tail = NULL;
+  interrupts_restore(flags);
+
+  while (tasklet != NULL) {
+    flags = interrupts_save();
+    tasklet_t *next = tasklet->next;
+    tasklet->next = NULL;
+    tasklet->scheduled = false;
+    interrupts_restore(flags);
+
+    uint64_t start = softirq_have_tsc ? rdtsc() : 0;
+    tasklet->func(tasklet, tasklet->ctx);
+    softirq_account(&tasklet->stats, start);
+
+    tasklet = next;
+  }
+}
+
+/** softirq_initialize:
+ *  Sets up the tasklet softirq, the other types register themselves
+ *
+ */
+void softirq_initialize(void) {
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+  softirq_have_tsc = edx & CPUID_FEATURE_EDX_TSC;
+
+  softirq_register(SOFTIRQ_TASKLET, "tasklet", tasklet_run_all);
+}
+
+/** softirq_register:
+ *  Sets the bottom half run for a softirq type
+ *
+ *  @param type One of the SOFTIRQ_* types
+ *  @param name The name shown by softirq_dump
+ *  @param handler The function to run when the type is raised
+ */
+void softirq_register(uint32_t type, const char *name,
+                      softirq_handler_t handler) {
+  if (type >= SOFTIRQ_COUNT) {
+    return;
+  }
+  uint32_t flags = interrupts_save();
+  softirqs[type].name = name;
+  softirqs[type].handler = handler;
+  interrupts_restore(flags);
+}
+
+/** softirq_raise:
+ *  Marks a softirq type as pending. Safe to call from interrupt handlers,
+ *  the work runs when the outermost interrupt returns or from the idle loop.
+ *
+ *  @param type One of the SOFTIRQ_* types
+ */
+void softirq_raise(uint32_t type) {
+  __atomic_fetch_or(&softirq_pending_mask, 1u << type, __ATOMIC_RELEASE);
+}
+
+/** softirq_pending:
+ *  Returns whether any softirq type is waiting to run
+ *
+ */
+bool softirq_pending(void) {
+  return atomic_load(&softirq_pending_mask) != 0;
+}
+
+/** softirq_run:
+ *  Runs the pending softirqs with interrupts enabled, making no more than
+ *  SOFTIRQ_MAX_RESTARTS passes. Must be called with interrupts disabled and
+ *  returns with them disabled. Does nothing when a run is already in
+ *  progress further up the stack.
+ *
+ */
+void softirq_run(void) {
+  if (softirq_active || !softirq_pending()) {
+    return;
+  }
+  softirq_active = true;
+
+  for (int pass = 0; pass < SOFTIRQ_MAX_RESTARTS; pass++) {
+    uint32_t pending = atomic_exchange(&softirq_pending_mask, 0);
+    if (pending == 0) {
+      break;
+    }
+
+    enable_interrupts();
+    while (pending != 0) {
+      uint32_t type = __builtin_ctz(pending);
+      pending &= pending - 1;
+
+      struct softirq *softirq = &softirqs[type];
+      if (softirq->handler == NULL) {
+        continue;
+      }
+      uint64_t start = softirq_have_tsc ? rdtsc() : 0;
+      softirq->handler();
+      softirq_account(&softirq->stats, start);
+    }
+    disable_interrupts();
+  }
+
+  if (softirq_pending()) {
+    softirq_deferred++;
+  }
+  softirq_active = false;
+}
+
+/** in_softirq:
+ *  Returns whether the caller runs inside softirq_run
+ *
+ */
+bool in_softirq(void) { return softirq_active; }
+
+/** tasklet_init:
+ *  Initializes a tasklet that isn't scheduled
+ *
+ *  @param tasklet The tasklet
+ *  @param name The name shown by softirq_dump
+ *  @param func The function to run
+ *  @param ctx Passed to the function
+ */
+void tasklet_init(tasklet_t *tasklet, const char *name, tasklet_func_t func,
+                  void *ctx) {
+  *tasklet = (tasklet_t){.func = func, .ctx = ctx, .name = name};
+
+  uint32_t flags = interrupts_save();
+  tasklet->list_next = tasklet_all;
+  tasklet_all = tasklet;
+  interrupts_restore(flags);
+}
+
+/** tasklet_schedule:
+ *  Queues a tasklet to run from the tasklet softirq, unless it is queued
+ *  already. Safe to call from interrupt handlers.
+ *
+ *  @param tasklet The tasklet to run
+ */
+void tasklet_schedule(tasklet_t *tasklet) {
+  uint32_t flags = interrupts_save();
+  if (!tasklet->scheduled) {
+    tasklet->scheduled = true;
+    tasklet->next = NULL;
+    if (tasklet_tail != NULL) {
+      tasklet_tail->next = tasklet;
+    } else {
+      tasklet_head = tasklet;
+    }
+    tasklet_tail = tasklet;
+    softirq_raise(SOFTIRQ_TASKLET);
+  }
+  interrupts_restore(flags);
+}
+
+/** softirq_dump_stats:
+ *  Writes one line of deferred work statistics to serial
+ *
+ *  @param name The name of the work
+ *  @param stats Its statistics
+ */
+static void softirq_dump_stats(const char *name,
+                               const softirq_stats_t *stats) {
+  uint64_t average =
+      stats->count != 0 ? stats->total_cycles / stats->count : 0;
+  fprintf(SERIAL, "softirq: %-12s %10u %12llu %12llu %12llu\n", name,
+          (unsigned int)stats->count, clock_cycles_to_ns(average),
+          clock_cycles_to_ns(stats->max_cycles),
+          clock_cycles_to_ns(stats->total_cycles) / 1000);
+}
+
+/** softirq_dump:
+ *  Writes the run counts and times of every softirq and tasklet to serial
+ *
+ */
+void softirq_dump(void) {
+  fprintf(SERIAL, "softirq: %-12s %10s %12s %12s %12s\n", "name", "runs",
+          "avg ns", "max ns", "total us");
+
+  /* copy each set of counters with interrupts off, print with them on */
+  for (uint32_t type = 0; type < SOFTIRQ_COUNT; type++) {
+    if (softirqs[type].handler == NULL) {
+      continue;
+    }
+    uint32_t flags = interrupts_save();
+    softirq_stats_t stats = softirqs[type].stats;
+    interrupts_restore(flags);
+    softirq_dump_stats(softirqs[type].name, &stats);
+  }
+  /* tasklets are only ever added at the head, so the walk needs no lock */
+  for (tasklet_t *tasklet = __atomic_load_n(&tasklet_all, __ATOMIC_ACQUIRE);
+       tasklet != NULL; tasklet = tasklet->list_next) {
+    uint32_t flags = interrupts_save();
+    softirq_stats_t stats = tasklet->stats;
+    interrupts_restore(flags);
+    softirq_dump_stats(tasklet->name, &stats);
+  }
+
+  fprintf(SERIAL, "softirq: %u runs left work to the idle loop\n",
+          (unsigned int)softirq_deferred);
+}
@@ -0,0 +1,69 @@
+#ifndef INCLUDE_SOFTIRQ_H
+#define INCLUDE_SOFTIRQ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Softirq types, run in this order when several are pending */
+#define SOFTIRQ_TIMER 0
+#define SOFTIRQ_TASKLET 1
+#define SOFTIRQ_COUNT 2
+
+/* Passes over the pending bits one softirq_run makes before it leaves the
+ * rest to the idle loop, so a flood of interrupts can't starve threads */
+#define SOFTIRQ_MAX_RESTARTS 4
+
+/* How many times deferred work ran and the TSC cycles it took */
+struct softirq_stats {
+  uint32_t count;
+  uint64_t total_cycles;
+  uint64_t max_cycles;
+};
+
+typedef struct softirq_stats softirq_stats_t;
+
+/** softirq_handler_t:
+ *  Bottom half of a softirq type. Runs with interrupts enabled.
+ */
+typedef void (*softirq_handler_t)(void);
+
+struct tasklet;
+
+/** tasklet_func_t:
+ *  Work queued by tasklet_schedule. Runs with interrupts enabled.
+ *
+ *  @param tasklet The tasklet being run
+ *  @param ctx The pointer passed to tasklet_init
+ */
+typedef void (*tasklet_func_t)(struct tasklet *tasklet, void *ctx);
+
+/* A work item an interrupt handler queues to run later. Scheduling a tasklet
+ * that is already queued does nothing, so it runs once for any number of
+ * schedules before it starts. */
+struct tasklet {
+  struct tasklet *next;
+  tasklet_func_t func;
+  void *ctx;
+  const char *name;
+  bool scheduled;
+  softirq_stats_t stats;
+  struct tasklet *list_next; /* in the list softirq_dump walks */
+};
+
+typedef struct tasklet tasklet_t;
+
+void softirq_initialize(void);
+void softirq_register(uint32_t type, const char *name,
+                      softirq_handler_t handler);
+void softirq_raise(uint32_t type);
+bool softirq_pending(void);
+void softirq_run(void);
+bool in_softirq(void);
+void softirq_dump(void);
+
+void tasklet_init(tasklet_t *tasklet, const char *name, tasklet_func_t func,
+                  void *ctx);
+void tasklet_schedule(tasklet_t *tasklet);
+
+#endif /* INCLUDE_SOFTIRQ_H */
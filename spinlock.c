@@ -0,0 +1,202 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "atomic.h"
+#include "cpu.h"
+#include "interrupts.h"
+#include "io.h"
+#include "spinlock.h"
+
+/* Every lock that was initialized, newest first */
+static lock_stats_t *spinlock_registry;
+
+static bool spinlock_have_tsc;
+
+/** spinlock_initialize:
+ *  Turns on counting of the cycles spent waiting for locks. Locks can be
+ *  used before this, their waits count as 0 cycles.
+ *
+ */
+void spinlock_initialize(void) {
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+  spinlock_have_tsc = edx & CPUID_FEATURE_EDX_TSC;
+}
+
+/** spinlock_register:
+ *  Adds a lock's counters to the list spinlock_dump reports
+ *
+ *  @param stats The counters of the lock
+ *  @param name The name reported for the lock
+ */
+static void spinlock_register(lock_stats_t *stats, const char *name) {
+  *stats = (lock_stats_t){.name = name};
+  lock_stats_t *head = __atomic_load_n(&spinlock_registry, __ATOMIC_RELAXED);
+  do {
+    stats->next = head;
+  } while (!__atomic_compare_exchange_n(&spinlock_registry, &head, stats,
+                                        false, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+}
+
+/** spinlock_init:
+ *  Initializes an unlocked spinlock. Only call once per lock.
+ *
+ *  @param lock The lock
+ *  @param name The name shown by spinlock_dump
+ */
+void spinlock_init(spinlock_t *lock, const char *name) {
+  lock->ticket = 0;
+  spinlock_register(&lock->stats, name);
+}
+
+/** spinlock_lock:
+ *  Takes a spinlock, spinning until it is this caller's turn. Locks that are
+ *  also taken in interrupt handlers must use spinlock_lock_irqsave instead.
+ *
+ *  @param lock The lock
+ */
+void spinlock_lock(spinlock_t *lock) {
+  uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) == ticket) {
+    lock->stats.acquisitions++;
+    return;
+  }
+
+  uint64_t start = spinlock_have_tsc ? rdtsc() : 0;
+  while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+    cpu_relax();
+  }
+  lock->stats.acquisitions++;
+  lock->stats.contended++;
+  if (spinlock_have_tsc) {
+    lock->stats.wait_cycles += rdtsc() - start;
+  }
+}
+
+/** spinlock_trylock:
+ *  Takes a spinlock if nobody holds or waits for it
+ *
+ *  @param lock The lock
+ *  @return whether the lock was taken
+ */
+bool spinlock_trylock(spinlock_t *lock) {
+  uint32_t ticket = __atomic_load_n(&lock->ticket, __ATOMIC_RELAXED);
+  uint16_t owner = ticket & 0xffff;
+  if (owner != ticket >> 16) {
+    return false;
+  }
+  uint32_t taken = ticket + (1u << 16);
+  if (!__atomic_compare_exchange_n(&lock->ticket, &ticket, taken, false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    return false;
+  }
+  lock->stats.acquisitions++;
+  return true;
+}
+
+/** spinlock_unlock:
+ *  Releases a spinlock to the next waiter
+ *
+ *  @param lock The lock
+ */
+void spinlock_unlock(spinlock_t *lock) {
+  /* only the holder writes owner, so this needs no locked instruction */
+  __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+/** spinlock_lock_irqsave:
+ *  Disables interrupts on this CPU and takes a spinlock, for locks that
+ *  interrupt handlers take too
+ *
+ *  @param lock The lock
+ *  @return The flags to pass to spinlock_unlock_irqrestore
+ */
+uint32_t spinlock_lock_irqsave(spinlock_t *lock) {
+  uint32_t flags = interrupts_save();
+  spinlock_lock(lock);
+  return flags;
+}
+
+/** spinlock_unlock_irqrestore:
+ *  Releases a spinlock taken with spinlock_lock_irqsave and puts the
+ *  interrupt flag back
+ *
+ *  @param lock The lock
+ *  @param flags The value spinlock_lock_irqsave returned
+ */
+void spinlock_unlock_irqrestore(spinlock_t *lock, uint32_t flags) {
+  spinlock_unlock(lock);
+  interrupts_restore(flags);
+}
+
+/** seqlock_init:
+ *  Initializes a seqlock with no writer
+ *
+ *  @param lock The seqlock
+ *  @param name The name shown by spinlock_dump
+ */
+void seqlock_init(seqlock_t *lock, const char *name) {
+  lock->sequence = 0;
+  spinlock_init(&lock->writer, name);
+}
+
+/** seqlock_write_begin:
+ *  Starts an update of the data a seqlock protects. Interrupts stay off
+ *  until seqlock_write_end so a reader can't interrupt the writer and spin
+ *  on its own CPU.
+ *
+ *  @param lock The seqlock
+ *  @return The flags to pass to seqlock_write_end
+ */
+uint32_t seqlock_write_begin(seqlock_t *lock) {
+  uint32_t flags = spinlock_lock_irqsave(&lock->writer);
+  atomic_store(&lock->sequence, lock->sequence + 1);
+  write_barrier();
+  return flags;
+}
+
+/** seqlock_write_end:
+ *  Publishes the update started by seqlock_write_begin
+ *
+ *  @param lock The seqlock
+ *  @param flags The value seqlock_write_begin returned
+ */
+void seqlock_write_end(seqlock_t *lock, uint32_t flags) {
+  atomic_store(&lock->sequence, lock->sequence + 1);
+  spinlock_unlock_irqrestore(&lock->writer, flags);
+}
+
+/** spinlock_dump:
+ *  Writes the contention counters of every lock to serial
+ *
+ */
+void spinlock_dump(void) {
+  fprintf(SERIAL, "%-16s %10s %10s %14s %8s\n", "lock", "acquired",
+          "contended", "wait cycles", "retries");
+  for (lock_stats_t *stats =
+           __atomic_load_n(&spinlock_registry, __ATOMIC_ACQUIRE);
+       stats != NULL; stats = stats->next) {
+    fprintf(SERIAL, "%-16s %10u %10u %14llu %8u\n", stats->name,
+            (unsigned int)stats->acquisitions,
+            (unsigned int)stats->contended, stats->wait_cycles,
+            (unsigned int)stats->read_retries);
+  }
+}
+
+/** spinlock_reset_stats:
+ *  Clears the contention counters of every lock. Counts from acquisitions
+ *  racing with the reset may be lost.
+ *
+ */
+void spinlock_reset_stats(void) {
+  for (lock_stats_t *stats =
+           __atomic_load_n(&spinlock_registry, __ATOMIC_ACQUIRE);
+       stats != NULL; stats = stats->next) {
+    stats->acquisitions = 0;
+    stats->contended = 0;
+    stats->wait_cycles = 0;
+    stats->read_retries = 0;
+  }
+}
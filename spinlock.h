@@ -0,0 +1,92 @@
+#ifndef INCLUDE_SPINLOCK_H
+#define INCLUDE_SPINLOCK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "atomic.h"
+
+/* Contention counters kept by every lock. The holder updates them, so they
+ * need no atomics, except read_retries which seqlock readers bump. */
+struct lock_stats {
+  const char *name;
+  uint32_t acquisitions;
+  uint32_t contended;   /* acquisitions that had to wait */
+  uint64_t wait_cycles; /* TSC cycles spent waiting */
+  uint32_t read_retries; /* seqlock reads that raced a writer */
+  struct lock_stats *next; /* in the list spinlock_dump walks */
+};
+
+typedef struct lock_stats lock_stats_t;
+
+/* Ticket lock: callers take tickets from next and are served in order as
+ * owner catches up, so a CPU can't be starved by the others. */
+struct spinlock {
+  union {
+    uint32_t ticket; /* both halves, for spinlock_trylock */
+    struct {
+      uint16_t owner; /* ticket being served */
+      uint16_t next;  /* ticket handed to the next caller */
+    };
+  };
+  lock_stats_t stats;
+};
+
+typedef struct spinlock spinlock_t;
+
+/* Sequence lock for small read-mostly data. Writers serialize on the
+ * spinlock and make the sequence odd while they write, readers never write
+ * and retry when the sequence moved under them. */
+struct seqlock {
+  uint32_t sequence;
+  spinlock_t writer;
+};
+
+typedef struct seqlock seqlock_t;
+
+void spinlock_initialize(void);
+void spinlock_init(spinlock_t *lock, const char *name);
+void spinlock_lock(spinlock_t *lock);
+bool spinlock_trylock(spinlock_t *lock);
+void spinlock_unlock(spinlock_t *lock);
+uint32_t spinlock_lock_irqsave(spinlock_t *lock);
+void spinlock_unlock_irqrestore(spinlock_t *lock, uint32_t flags);
+void spinlock_dump(void);
+void spinlock_reset_stats(void);
+
+void seqlock_init(seqlock_t *lock, const char *name);
+uint32_t seqlock_write_begin(seqlock_t *lock);
+void seqlock_write_end(seqlock_t *lock, uint32_t flags);
+
+/** seqlock_read_begin:
+ *  Starts a read of the data a seqlock protects, waiting out a writer
+ *
+ *  @param lock The seqlock
+ *  @return The sequence to pass to seqlock_read_retry
+ */
+static inline uint32_t seqlock_read_begin(const seqlock_t *lock) {
+  uint32_t sequence;
+  while ((sequence = atomic_load(&lock->sequence)) & 1) {
+    cpu_relax();
+  }
+  return sequence;
+}
+
+/** seqlock_read_retry:
+ *  Ends a read, the values read must be thrown away if a writer got in
+ *
+ *  @param lock The seqlock
+ *  @param sequence The value seqlock_read_begin returned
+ *  @return true if the read has to be done again
+ */
+static inline bool seqlock_read_retry(seqlock_t *lock, uint32_t sequence) {
+  read_barrier();
+  if (atomic_load(&lock->sequence) == sequence) {
+    return false;
+  }
+  atomic_inc(&lock->writer.stats.read_retries);
+  return true;
+}
+
+#endif /* INCLUDE_SPINLOCK_H */
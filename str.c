@@ -1,76 +1,675 @@
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#include "cpu.h"
+#include "fpu.h"
+#include "klog.h"
 #include "str.h"
 
+/* Implementations picked by str_initialize, the rep string variants work
+ * on every CPU and are used until then */
+static void *memcpy_rep(void *restrict dest, const void *restrict src,
+                        size_t n);
+static void *memset_rep(void *dest, int c, size_t n);
+
+static void *(*memcpy_impl)(void *restrict, const void *restrict,
+                            size_t) = memcpy_rep;
+static void *(*memset_impl)(void *, int, size_t) = memset_rep;
+
+/* What the SSE variants use for the unaligned ends and short buffers */
+static void *(*memcpy_small)(void *restrict, const void *restrict,
+                             size_t) = memcpy_rep;
+static void *(*memset_small)(void *, int, size_t) = memset_rep;
+
 /** strlen
- *  Returns the length of a null terminated string
+ *  Returns the length of a null terminated string. Scans a word at a time
+ *  once aligned; an aligned word never crosses into another page, so reading
+ *  past the terminator is harmless.
  *
  *  @param str A pointer to a null terminated string
  */
 size_t strlen(const char *str) {
-  size_t len = 0;
-  while (str[len]) {
-    len++;
+  const char *p = str;
+  while ((uintptr_t)p & (sizeof(uint32_t) - 1)) {
+    if (*p == '\0') {
+      return p - str;
+    }
+    p++;
+  }
+
+  const uint32_t *word = (const uint32_t *)p;
+  /* a byte is zero iff subtracting one borrows into its top bit */
+  while (!((*word - 0x01010101u) & ~*word & 0x80808080u)) {
+    word++;
+  }
+
+  p = (const char *)word;
+  while (*p != '\0') {
+    p++;
   }
-  return len;
+  return p - str;
+}
+
+/** strcmp
+ *  Compares two null terminated strings
+ *
+ *  @param a The first string
+ *  @param b The second string
+ *  @return 0 if they are equal, otherwise the sign of the first difference
+ */
+int strcmp(const char *a, const char *b) {
+  while (*a != '\0' && *a == *b) {
+    a++;
+    b++;
+  }
+  return (unsigned char)*a - (unsigned char)*b;
+}
+
+/** memcpy_rep:
+ *  memcpy with rep movsl for the bulk and rep movsb for the tail
+ *
+ */
+static void *memcpy_rep(void *restrict dest, const void *restrict src,
+                        size_t n) {
+  void *d = dest;
+  size_t count;
+  asm volatile("rep movsl\n\t"
+               "mov %[tail], %%ecx\n\t"
+               "rep movsb"
+               : "=&c"(count), "+D"(d), "+S"(src)
+               : "0"(n / 4), [tail] "r"(n % 4)
+               : "memory");
+  return dest;
+}
+
+/** memcpy_erms:
+ *  memcpy with a single rep movsb, for CPUs with fast string moves
+ *
+ */
+static void *memcpy_erms(void *restrict dest, const void *restrict src,
+                         size_t n) {
+  void *d = dest;
+  asm volatile("rep movsb" : "+c"(n), "+D"(d), "+S"(src) : : "memory");
+  return dest;
 }
 
-size_t format_param_count(const char *str) {
-  size_t num = 0;
-  size_t i;
+/** memcpy_sse:
+ *  memcpy moving 64 bytes per iteration through the SSE registers, with
+ *  aligned stores, in sections of STR_SSE_CHUNK_SIZE bytes. Short copies
+ *  don't pay for the FPU handover.
+ *
+ */
+static void *memcpy_sse(void *restrict dest, const void *restrict src,
+                        size_t n) {
+  if (n < STR_SSE_MIN_SIZE) {
+    return memcpy_small(dest, src, n);
+  }
+
+  uint8_t *d = dest;
+  const uint8_t *s = src;
+  size_t head = -(uintptr_t)d & 15;
+  memcpy_small(d, s, head);
+  d += head;
+  s += head;
+  n -= head;
+
+  size_t blocks = n / 64;
+  while (blocks != 0) {
+    size_t chunk = blocks < STR_SSE_CHUNK_SIZE / 64 ? blocks
+                                                     : STR_SSE_CHUNK_SIZE / 64;
+    blocks -= chunk;
+    uint32_t flags = fpu_kernel_begin();
+    asm volatile("1:\n\t"
+                 "movups (%[s]), %%xmm0\n\t"
+                 "movups 16(%[s]), %%xmm1\n\t"
+                 "movups 32(%[s]), %%xmm2\n\t"
+                 "movups 48(%[s]), %%xmm3\n\t"
+                 "movaps %%xmm0, (%[d])\n\t"
+                 "movaps %%xmm1, 16(%[d])\n\t"
+                 "movaps %%xmm2, 32(%[d])\n\t"
+                 "movaps %%xmm3, 48(%[d])\n\t"
+                 "add $64, %[s]\n\t"
+                 "add $64, %[d]\n\t"
+                 "dec %[blocks]\n\t"
+                 "jnz 1b"
+                 : [s] "+r"(s), [d] "+r"(d), [blocks] "+r"(chunk)
+                 :
+                 /* the kernel is built without SSE, so the compiler keeps
+                  * nothing in the xmm registers and they needn't be listed */
+                 : "memory", "cc");
+    fpu_kernel_end(flags);
+  }
+
+  memcpy_small(d, s, n % 64);
+  return dest;
+}
 
-  for (i = 0; i < strlen(str); i++) {
-    if (str[i] == '%' && str[i + 1] == '%') {
-      num += 1;
-      i += 1;
+/** memcpy
+ *  Copies bytes between two non overlapping buffers
+ *
+ *  @param dest The buffer to copy to
+ *  @param src The buffer to copy from
+ *  @param n The number of bytes to copy
+ *  @return dest
+ */
+void *memcpy(void *restrict dest, const void *restrict src, size_t n) {
+  return memcpy_impl(dest, src, n);
+}
+
+/** memcmp
+ *  Compares two buffers
+ *
+ *  @param a The first buffer
+ *  @param b The second buffer
+ *  @param n The number of bytes to compare
+ *  @return 0 if they are equal, otherwise the sign of the first difference
+ */
+int memcmp(const void *a, const void *b, size_t n) {
+  const uint8_t *x = a;
+  const uint8_t *y = b;
+  for (size_t i = 0; i < n; i++) {
+    if (x[i] != y[i]) {
+      return x[i] - y[i];
     }
   }
+  return 0;
+}
+
+/** memmove
+ *  Copies bytes between two buffers which may overlap. Forward copies are
+ *  safe with the string instructions whenever dest is below src, the
+ *  backward case runs them with the direction flag set.
+ *
+ *  @param dest The buffer to copy to
+ *  @param src The buffer to copy from
+ *  @param n The number of bytes to copy
+ *  @return dest
+ */
+void *memmove(void *dest, const void *src, size_t n) {
+  uint8_t *d = dest;
+  const uint8_t *s = src;
+  if (d <= s || d >= s + n) {
+    return memcpy_rep(dest, src, n);
+  }
+
+  /* the odd bytes at the top first, then whole words downwards */
+  for (size_t i = n; i > n - n % 4; i--) {
+    d[i - 1] = s[i - 1];
+  }
+  size_t words = n / 4;
+  if (words != 0) {
+    void *dw = d + (words - 1) * 4;
+    const void *sw = s + (words - 1) * 4;
+    asm volatile("std\n\t"
+                 "rep movsl\n\t"
+                 "cld"
+                 : "+c"(words), "+D"(dw), "+S"(sw)
+                 :
+                 : "memory");
+  }
+  return dest;
+}
+
+/** memset_rep:
+ *  memset with rep stosl for the bulk and rep stosb for the tail
+ *
+ */
+static void *memset_rep(void *dest, int c, size_t n) {
+  void *d = dest;
+  size_t count;
+  uint32_t pattern = (uint8_t)c * 0x01010101u;
+  asm volatile("rep stosl\n\t"
+               "mov %[tail], %%ecx\n\t"
+               "rep stosb"
+               : "=&c"(count), "+D"(d)
+               : "0"(n / 4), "a"(pattern), [tail] "r"(n % 4)
+               : "memory");
+  return dest;
+}
+
+/** memset_erms:
+ *  memset with a single rep stosb, for CPUs with fast string stores
+ *
+ */
+static void *memset_erms(void *dest, int c, size_t n) {
+  void *d = dest;
+  asm volatile("rep stosb" : "+c"(n), "+D"(d) : "a"(c) : "memory");
+  return dest;
+}
+
+/** memset_sse:
+ *  memset storing 64 bytes per iteration from an SSE register, in sections
+ *  of STR_SSE_CHUNK_SIZE bytes
+ *
+ */
+static void *memset_sse(void *dest, int c, size_t n) {
+  if (n < STR_SSE_MIN_SIZE) {
+    return memset_small(dest, c, n);
+  }
+
+  uint8_t *d = dest;
+  size_t head = -(uintptr_t)d & 15;
+  memset_small(d, c, head);
+  d += head;
+  n -= head;
+
+  uint32_t pattern[4] __attribute__((aligned(16)));
+  pattern[0] = pattern[1] = pattern[2] = pattern[3] =
+      (uint8_t)c * 0x01010101u;
+
+  size_t blocks = n / 64;
+  while (blocks != 0) {
+    size_t chunk = blocks < STR_SSE_CHUNK_SIZE / 64 ? blocks
+                                                     : STR_SSE_CHUNK_SIZE / 64;
+    blocks -= chunk;
+    uint32_t flags = fpu_kernel_begin();
+    asm volatile("movaps (%[pattern]), %%xmm0\n\t"
+                 "1:\n\t"
+                 "movaps %%xmm0, (%[d])\n\t"
+                 "movaps %%xmm0, 16(%[d])\n\t"
+                 "movaps %%xmm0, 32(%[d])\n\t"
+                 "movaps %%xmm0, 48(%[d])\n\t"
+                 "add $64, %[d]\n\t"
+                 "dec %[blocks]\n\t"
+                 "jnz 1b"
+                 : [d] "+r"(d), [blocks] "+r"(chunk)
+                 : [pattern] "r"(pattern)
+                 : "memory", "cc");
+    fpu_kernel_end(flags);
+  }
+
+  memset_small(d, c, n % 64);
+  return dest;
+}
+
+/** memset
+ *  Fills a buffer with a byte value
+ *
+ *  @param dest The buffer to fill
+ *  @param c The value to fill with, converted to an unsigned char
+ *  @param n The number of bytes to fill
+ *  @return dest
+ */
+void *memset(void *dest, int c, size_t n) { return memset_impl(dest, c, n); }
+
+/** memset16
+ *  Fills a buffer with a 16 bit value, two at a time once aligned
+ *
+ *  @param dest The buffer to fill, 2 byte aligned
+ *  @param value The value to fill with
+ *  @param count The number of values to store
+ *  @return dest
+ */
+uint16_t *memset16(uint16_t *dest, uint16_t value, size_t count) {
+  uint16_t *d = dest;
+  if (count != 0 && ((uintptr_t)d & 2)) {
+    *d++ = value;
+    count--;
+  }
+
+  size_t pairs = count / 2;
+  uint32_t pattern = value | (uint32_t)value << 16;
+  asm volatile("rep stosl"
+               : "+c"(pairs), "+D"(d)
+               : "a"(pattern)
+               : "memory");
+
+  if (count & 1) {
+    *d = value;
+  }
+  return dest;
+}
+
+/** str_initialize:
+ *  Picks the memcpy and memset for this CPU: SSE for large buffers when
+ *  fpu_initialize enabled it, rep movsb and stosb on CPUs where those are
+ *  fast, rep movsl and stosl otherwise
+ *
+ */
+void str_initialize(void) {
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(0, &eax, &ebx, &ecx, &edx);
+  bool erms = false;
+  if (eax >= CPUID_EXTENDED_FEATURES) {
+    cpuid(CPUID_EXTENDED_FEATURES, &eax, &ebx, &ecx, &edx);
+    erms = ebx & CPUID_FEATURE7_EBX_ERMS;
+  }
+
+  if (erms) {
+    memcpy_small = memcpy_erms;
+    memset_small = memset_erms;
+  }
+  if (fpu_have_sse()) {
+    memcpy_impl = memcpy_sse;
+    memset_impl = memset_sse;
+  } else {
+    memcpy_impl = memcpy_small;
+    memset_impl = memset_small;
+  }
 
-  return num;
+  klog(KLOG_INFO, "str: %s memcpy and memset",
+       fpu_have_sse() ? "sse" : erms ? "rep movsb" : "rep movsl");
 }
 
-uint8_t hex_representation(unsigned short nibble) {
-  uint8_t output;
+/* Enough for a 64 bit value in decimal (20 digits) or a 0x prefixed pointer */
+#define FORMAT_NUMBER_BUFFER_SIZE 24
+
+static const char format_padding_spaces[] = "                ";
+static const char format_padding_zeros[] = "0000000000000000";
+
+/** format_pad:
+ *  Sends count copies of the padding character to the sink
+ *
+ *  @param sink The sink to write to
+ *  @param ctx The sink's context
+ *  @param zero Pad with '0' instead of ' '
+ *  @param count The number of padding characters
+ */
+static void format_pad(format_sink_t sink, void *ctx, bool zero,
+                       size_t count) {
+  const char *padding = zero ? format_padding_zeros : format_padding_spaces;
+  while (count > 0) {
+    size_t chunk = count < 16 ? count : 16;
+    sink(ctx, padding, chunk);
+    count -= chunk;
+  }
+}
 
-  output = ((nibble & 0x0f) + 0x30);
+/** format_number:
+ *  Renders an unsigned value into the end of a buffer
+ *
+ *  @param end One past the last byte of the buffer
+ *  @param value The value to render
+ *  @param base 10 or 16
+ *  @param upper Use upper case hex digits
+ *  @return A pointer to the first digit
+ */
+static char *format_number(char *end, uint64_t value, unsigned int base,
+                           bool upper) {
+  const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+  char *p = end;
 
-  if (output > 0x39) {
-    output += 0x27;
+  if (base == 16) {
+    do {
+      *--p = digits[value & 0x0f];
+      value >>= 4;
+    } while (value);
+  } else if (value <= UINT32_MAX) {
+    /* stay on 32 bit division for values that fit */
+    uint32_t v = (uint32_t)value;
+    do {
+      *--p = digits[v % 10];
+      v /= 10;
+    } while (v);
+  } else {
+    do {
+      *--p = digits[value % 10];
+      value /= 10;
+    } while (value);
   }
 
-  return output;
+  return p;
 }
 
-/** format_string
- *  Takes a format string and a list of vals and
- *  puts the properly interpolated values into the
- *  output string.
- *  '%%' will signify the byte to be interpolated
- *  Currently vals can only be bytes represented by uint8_t
- *  TODO: Return an error code?
- *  TODO: Handle other types
+/** vformat
+ *  Formats a string in a single pass, sending literal runs and converted
+ *  values straight to the sink as they are produced. Supports the flags '-'
+ *  and '0', a field width (or '*'), a precision for %s, the length modifiers
+ *  hh, h, l, ll and z, and the conversions d, i, u, x, X, p, s, c and %.
  *
- *  @param output A pointer to the string to write formatted string to
- *  @param input A null terminated string
- *  @param vals A pointer to an array of bytes to interpolate
+ *  @param sink The function called with each chunk of output
+ *  @param ctx Passed through to the sink
+ *  @param format A null terminated format string
+ *  @param args The values to format
+ *  @return The number of characters produced
  */
-void format_string(char *output, const char *input, uint8_t *vals) {
-  size_t i;
-  size_t val_index = 0;
+int vformat(format_sink_t sink, void *ctx, const char *format, va_list args) {
+  size_t total = 0;
+  const char *literal = format;
+
+  while (*format) {
+    if (*format != '%') {
+      format++;
+      continue;
+    }
+
+    if (format != literal) {
+      sink(ctx, literal, format - literal);
+      total += format - literal;
+    }
+    format++;
 
-  for (i = 0; i < strlen(input); i++) {
-    if (input[i] == '%' && input[i + 1] == '%') {
-      output[i] = (char)hex_representation(vals[val_index] >> 4);
-      output[i + 1] = (char)hex_representation(vals[val_index]);
+    bool left = false;
+    bool zero = false;
+    for (;; format++) {
+      if (*format == '-') {
+        left = true;
+      } else if (*format == '0') {
+        zero = true;
+      } else {
+        break;
+      }
+    }
 
-      val_index += 1;
-      i += 1;
+    size_t width = 0;
+    if (*format == '*') {
+      int w = va_arg(args, int);
+      if (w < 0) {
+        left = true;
+        w = -w;
+      }
+      width = w;
+      format++;
     } else {
-      output[i] = input[i];
+      while (*format >= '0' && *format <= '9') {
+        width = width * 10 + (*format++ - '0');
+      }
+    }
+
+    size_t precision = SIZE_MAX;
+    if (*format == '.') {
+      format++;
+      precision = 0;
+      if (*format == '*') {
+        int p = va_arg(args, int);
+        precision = p < 0 ? SIZE_MAX : (size_t)p;
+        format++;
+      } else {
+        while (*format >= '0' && *format <= '9') {
+          precision = precision * 10 + (*format++ - '0');
+        }
+      }
     }
+
+    int length = 0; /* number of 'l's, -1 for 'h', -2 for 'hh' */
+    while (*format == 'l' || *format == 'h' || *format == 'z') {
+      if (*format == 'l') {
+        length++;
+      } else if (*format == 'h') {
+        length = length < 0 ? -2 : -1;
+      }
+      format++;
+    }
+
+    char number[FORMAT_NUMBER_BUFFER_SIZE];
+    char *end = number + sizeof(number);
+    const char *str = NULL;
+    size_t len = 0;
+    char sign = 0;
+    char c;
+
+    switch (*format) {
+    case 'd':
+    case 'i': {
+      int64_t value;
+      if (length >= 2) {
+        value = va_arg(args, long long);
+      } else if (length == 1) {
+        value = va_arg(args, long);
+      } else {
+        value = va_arg(args, int);
+      }
+      /* short and char arguments arrive promoted to int */
+      if (length == -1) {
+        value = (short)value;
+      } else if (length <= -2) {
+        value = (signed char)value;
+      }
+      uint64_t magnitude = value;
+      if (value < 0) {
+        sign = '-';
+        magnitude = -magnitude;
+      }
+      str = format_number(end, magnitude, 10, false);
+      len = end - str;
+      break;
+    }
+    case 'u':
+    case 'x':
+    case 'X': {
+      uint64_t value;
+      if (length >= 2) {
+        value = va_arg(args, unsigned long long);
+      } else if (length == 1) {
+        value = va_arg(args, unsigned long);
+      } else {
+        value = va_arg(args, unsigned int);
+      }
+      if (length == -1) {
+        value = (unsigned short)value;
+      } else if (length <= -2) {
+        value = (unsigned char)value;
+      }
+      str = format_number(end, value, *format == 'u' ? 10 : 16,
+                          *format == 'X');
+      len = end - str;
+      break;
+    }
+    case 'p': {
+      char *digits =
+          format_number(end, (uintptr_t)va_arg(args, void *), 16, false);
+      /* pointers are always shown at full width with a 0x prefix */
+      while (end - digits < (ptrdiff_t)(2 * sizeof(void *))) {
+        *--digits = '0';
+      }
+      *--digits = 'x';
+      *--digits = '0';
+      str = digits;
+      len = end - str;
+      break;
+    }
+    case 's':
+      str = va_arg(args, const char *);
+      if (str == NULL) {
+        str = "(null)";
+      }
+      while (len < precision && str[len]) {
+        len++;
+      }
+      zero = false;
+      break;
+    case 'c':
+      c = (char)va_arg(args, int);
+      str = &c;
+      len = 1;
+      zero = false;
+      break;
+    case '%':
+      str = "%";
+      len = 1;
+      width = 0;
+      break;
+    default:
+      /* unknown conversion, print it as is */
+      if (*format == 0) {
+        literal = format;
+        continue;
+      }
+      str = format - 1;
+      len = 2;
+      width = 0;
+      break;
+    }
+
+    size_t field = len + (sign ? 1 : 0);
+    size_t pad = width > field ? width - field : 0;
+
+    if (!left && !zero) {
+      format_pad(sink, ctx, false, pad);
+    }
+    if (sign) {
+      sink(ctx, &sign, 1);
+    }
+    if (!left && zero) {
+      format_pad(sink, ctx, true, pad);
+    }
+    sink(ctx, str, len);
+    if (left) {
+      format_pad(sink, ctx, false, pad);
+    }
+    total += field + pad;
+
+    format++;
+    literal = format;
   }
 
-  output[i] = 0x00;
+  if (format != literal) {
+    sink(ctx, literal, format - literal);
+    total += format - literal;
+  }
+
+  return total;
+}
+
+struct snprintf_buffer {
+  char *buffer;
+  size_t size; /* space left, including the terminator */
+};
+
+/** snprintf_sink:
+ *  vformat sink that copies into a bounded buffer, dropping what doesn't fit
+ */
+static void snprintf_sink(void *ctx, const char *data, size_t size) {
+  struct snprintf_buffer *out = ctx;
+  if (out->size <= 1) {
+    return;
+  }
+  if (size > out->size - 1) {
+    size = out->size - 1;
+  }
+  memcpy(out->buffer, data, size);
+  out->buffer += size;
+  out->size -= size;
+}
+
+/** vsnprintf
+ *  Formats a string into a buffer, see vformat for the supported conversions
+ *
+ *  @param buffer The buffer to write to, always null terminated when size > 0
+ *  @param size The size of the buffer
+ *  @param format A null terminated format string
+ *  @param args The values to format
+ *  @return The length of the full formatted string, which may be more than was
+ *          written if the buffer was too small
+ */
+int vsnprintf(char *buffer, size_t size, const char *format, va_list args) {
+  struct snprintf_buffer out = {.buffer = buffer, .size = size};
+  int total = vformat(snprintf_sink, &out, format, args);
+  if (size > 0) {
+    *out.buffer = 0x00;
+  }
+  return total;
+}
+
+/** snprintf
+ *  Formats a string into a buffer, see vsnprintf
+ */
+int snprintf(char *buffer, size_t size, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int total = vsnprintf(buffer, size, format, args);
+  va_end(args);
+  return total;
 }
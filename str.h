@@ -1,11 +1,35 @@
 #ifndef INCLUDE_STR_H
 #define INCLUDE_STR_H
 
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 
+/* Buffers from this size on are copied and filled with SSE when the CPU has
+ * it, below it the FPU handover costs more than it saves */
+#define STR_SSE_MIN_SIZE 1024
+
+/* SSE copies and fills run with interrupts disabled, one section of at most
+ * this many bytes at a time, so large buffers don't hold them off for long */
+#define STR_SSE_CHUNK_SIZE 4096
+
+void str_initialize(void);
 size_t strlen(const char *str);
-size_t format_param_count(const char *str);
-void format_string(char *output, const char *input, uint8_t *vals);
+int strcmp(const char *a, const char *b);
+void *memcpy(void *restrict dest, const void *restrict src, size_t n);
+void *memmove(void *dest, const void *src, size_t n);
+int memcmp(const void *a, const void *b, size_t n);
+void *memset(void *dest, int c, size_t n);
+uint16_t *memset16(uint16_t *dest, uint16_t value, size_t count);
+
+/** format_sink_t:
+ *  Receives each chunk of output produced by vformat. The data is not null
+ *  terminated and is only valid for the duration of the call.
+ */
+typedef void (*format_sink_t)(void *ctx, const char *data, size_t size);
+
+int vformat(format_sink_t sink, void *ctx, const char *format, va_list args);
+int vsnprintf(char *buffer, size_t size, const char *format, va_list args);
+int snprintf(char *buffer, size_t size, const char *format, ...);
 
 #endif /* INCLUDE_STR_H */
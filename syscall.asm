@@ -0,0 +1,171 @@
+; System call entry points and the user program of syscall_bench, see
+; syscall.c. Both entry points take the number in eax and the arguments in
+; ebx, esi and edi, and return the result in eax.
+
+extern syscall_dispatch
+
+global syscall_interrupt_entry
+global syscall_sysenter_entry
+global syscall_user_enter
+global syscall_user_bench_start
+global syscall_user_bench_end
+
+SEGSEL_KERNEL_DS equ 0x10
+SEGSEL_USER_CS equ 0x1b
+SEGSEL_USER_DS equ 0x23
+SEGSEL_PERCPU equ 0x30
+
+EFLAGS_INTERRUPT_ENABLE equ 0x200
+EFLAGS_RESERVED equ 0x2
+
+; must match syscall.h
+SYSCALL_NOP equ 0
+SYSCALL_EXIT equ 1
+SYSCALL_BENCH_REPORT equ 2
+SYSCALL_BENCH_INT equ 0
+SYSCALL_BENCH_SYSENTER equ 1
+
+; call_dispatch - Switches to the kernel data segments, calls syscall_dispatch
+; with the caller's registers and puts the user segments back. Every register
+; but eax is preserved, the return address and stack of the caller must
+; already be saved by the entry point.
+%macro call_dispatch 0
+  push ds
+  push es
+  push fs
+  mov cx, SEGSEL_KERNEL_DS
+  mov ds, cx
+  mov es, cx
+  mov cx, SEGSEL_PERCPU
+  mov fs, cx
+  cld
+
+  push edi
+  push esi
+  push ebx
+  push eax
+  call syscall_dispatch
+  add esp, 16
+%endmacro
+
+section .text
+
+; syscall_interrupt_entry - The int 0x80 trap gate. Interrupts stay as the
+; caller had them, so a long system call can be preempted.
+syscall_interrupt_entry:
+  push ecx          ; caller saved in C, but not for the caller of int 0x80
+  push edx
+  call_dispatch
+  pop fs
+  pop es
+  pop ds
+  pop edx
+  pop ecx
+  iret
+
+; syscall_sysenter_entry - The target of sysenter. The CPU loads the kernel
+; code and stack segments but neither saves nor restores anything, so the
+; caller passes its stack in ecx and where to return in edx. esp is loaded
+; from MSR_IA32_SYSENTER_ESP, which points at the CPU's tss.esp0, and that
+; holds the top of the running thread's kernel stack.
+syscall_sysenter_entry:
+  mov esp, [esp]
+  push ecx          ; user stack, for sysexit
+  push edx          ; user return address, for sysexit
+  sti               ; sysenter clears the interrupt flag, let it be preempted
+  call_dispatch
+  cli               ; segments and stack stay consistent up to sysexit
+  pop fs
+  pop es
+  pop ds
+  pop edx
+  pop ecx
+  sti               ; takes effect after sysexit, which leaves eflags alone
+  sysexit
+
+; syscall_user_enter - Drops to user mode, never returns. The thread's
+; kernel stack is reused from the top by the next entry into the kernel.
+; stack: [esp + 8] the user stack pointer
+;        [esp + 4] the user address to start at
+;        [esp    ] the return address
+syscall_user_enter:
+  mov eax, [esp+4]
+  mov edx, [esp+8]
+
+  mov cx, SEGSEL_USER_DS
+  mov ds, cx
+  mov es, cx
+  mov fs, cx
+  mov gs, cx
+
+  ; the frame iret pops when returning to an outer privilege level
+  push dword SEGSEL_USER_DS
+  push edx
+  push dword EFLAGS_INTERRUPT_ENABLE | EFLAGS_RESERVED
+  push dword SEGSEL_USER_CS
+  push eax
+  iret
+
+; The user program of syscall_bench. It is copied to its own page, so it only
+; uses relative addresses.
+; stack: [esp + 4] nonzero if sysenter can be used
+;        [esp    ] the number of round trips per method, at least one
+section .rodata
+
+syscall_user_bench_start:
+  call .base
+.base:
+  pop ebp           ; where the program was copied to
+
+  ; int 0x80
+  mov esi, [esp]
+  rdtsc
+  push edx
+  push eax
+.int_loop:
+  mov eax, SYSCALL_NOP
+  int 0x80
+  dec esi
+  jnz .int_loop
+  rdtsc
+  pop ebx
+  pop ecx
+  sub eax, ebx
+  sbb edx, ecx
+  mov ebx, SYSCALL_BENCH_INT
+  mov esi, eax
+  mov edi, edx
+  mov eax, SYSCALL_BENCH_REPORT
+  int 0x80
+
+  cmp dword [esp+4], 0
+  je .exit
+
+  ; sysenter
+  mov esi, [esp]
+  rdtsc
+  push edx
+  push eax
+.sysenter_loop:
+  mov eax, SYSCALL_NOP
+  mov ecx, esp
+  lea edx, [ebp + .sysenter_return - .base]
+  sysenter
+.sysenter_return:
+  dec esi
+  jnz .sysenter_loop
+  rdtsc
+  pop ebx
+  pop ecx
+  sub eax, ebx
+  sbb edx, ecx
+  mov ebx, SYSCALL_BENCH_SYSENTER
+  mov esi, eax
+  mov edi, edx
+  mov eax, SYSCALL_BENCH_REPORT
+  int 0x80
+
+.exit:
+  mov eax, SYSCALL_EXIT
+  int 0x80
+syscall_user_bench_end:
@@ -0,0 +1,235 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clock.h"
+#include "constants.h"
+#include "cpu.h"
+#include "gdt.h"
+#include "interrupts.h"
+#include "io.h"
+#include "pmm.h"
+#include "smp.h"
+#include "str.h"
+#include "syscall.h"
+#include "thread.h"
+#include "vmm.h"
+
+/* From syscall.asm */
+extern const uint8_t syscall_user_bench_start[];
+extern const uint8_t syscall_user_bench_end[];
+void syscall_interrupt_entry(void);
+void syscall_sysenter_entry(void);
+void syscall_user_enter(uint32_t eip, uint32_t esp) __attribute__((noreturn));
+
+typedef uint32_t (*syscall_handler_t)(uint32_t arg1, uint32_t arg2,
+                                      uint32_t arg3);
+
+static bool syscall_sysenter;
+
+/* Set while the benchmark thread exists, there is one user program at a
+ * time */
+static bool syscall_bench_running;
+
+/* Pages of the user program, 0 when unused */
+static uint32_t syscall_user_code;
+static uint32_t syscall_user_stack;
+
+/* int 0x80 result of the running benchmark, to compare sysenter with */
+static uint64_t syscall_bench_int_cycles;
+
+/** syscall_user_release:
+ *  Unmaps and frees the pages of the user program and lets the benchmark be
+ *  started again
+ *
+ */
+static void syscall_user_release(void) {
+  if (syscall_user_code != 0) {
+    vmm_unmap(SYSCALL_USER_CODE);
+    pmm_free_pages(syscall_user_code);
+    syscall_user_code = 0;
+  }
+  if (syscall_user_stack != 0) {
+    vmm_unmap(SYSCALL_USER_STACK);
+    pmm_free_pages(syscall_user_stack);
+    syscall_user_stack = 0;
+  }
+  syscall_bench_int_cycles = 0;
+  __atomic_store_n(&syscall_bench_running, false, __ATOMIC_RELEASE);
+}
+
+/** syscall_nop:
+ *  Does nothing, for timing the way in and out of the kernel
+ *
+ */
+static uint32_t syscall_nop(__attribute__((unused)) uint32_t arg1,
+                            __attribute__((unused)) uint32_t arg2,
+                            __attribute__((unused)) uint32_t arg3) {
+  return 0;
+}
+
+/** syscall_exit:
+ *  Ends the calling thread and frees its user program
+ *
+ */
+static uint32_t syscall_exit(__attribute__((unused)) uint32_t arg1,
+                             __attribute__((unused)) uint32_t arg2,
+                             __attribute__((unused)) uint32_t arg3) {
+  syscall_user_release();
+  thread_exit();
+}
+
+/** syscall_bench_report:
+ *  Writes the time the benchmark program measured for one entry method to
+ *  serial
+ *
+ *  @param method SYSCALL_BENCH_INT or SYSCALL_BENCH_SYSENTER
+ *  @param low The low 32 bits of the TSC cycles all the round trips took
+ *  @param high The high 32 bits
+ */
+static uint32_t syscall_bench_report(uint32_t method, uint32_t low,
+                                     uint32_t high) {
+  uint64_t cycles = (uint64_t)high << 32 | low;
+  uint64_t ns = clock_cycles_to_ns(cycles);
+
+  fprintf(SERIAL, "syscall: %-8s %6u cycles %6u ns per round trip\n",
+          method == SYSCALL_BENCH_INT ? "int 0x80" : "sysenter",
+          (unsigned int)(cycles / SYSCALL_BENCH_ITERATIONS),
+          (unsigned int)(ns / SYSCALL_BENCH_ITERATIONS));
+
+  if (method == SYSCALL_BENCH_INT) {
+    syscall_bench_int_cycles = cycles;
+  } else if (cycles != 0 && syscall_bench_int_cycles != 0) {
+    uint32_t tenths = syscall_bench_int_cycles * 10 / cycles;
+    fprintf(SERIAL, "syscall: sysenter is %u.%ux as fast\n",
+            (unsigned int)(tenths / 10), (unsigned int)(tenths % 10));
+  }
+  return 0;
+}
+
+static const syscall_handler_t syscall_table[SYSCALL_COUNT] = {
+    [SYSCALL_NOP] = syscall_nop,
+    [SYSCALL_EXIT] = syscall_exit,
+    [SYSCALL_BENCH_REPORT] = syscall_bench_report,
+};
+
+/** syscall_dispatch:
+ *  Runs a system call, called by both entry points in syscall.asm with the
+ *  kernel segments loaded and the caller's registers as arguments
+ *
+ *  @param number One of the SYSCALL_* numbers, from eax
+ *  @param arg1 From ebx
+ *  @param arg2 From esi
+ *  @param arg3 From edi
+ *  @return the result, left in eax, SYSCALL_ERROR_NO_SYSCALL for an unknown
+ *          number
+ */
+uint32_t syscall_dispatch(uint32_t number, uint32_t arg1, uint32_t arg2,
+                          uint32_t arg3) {
+  if (number >= SYSCALL_COUNT) {
+    return SYSCALL_ERROR_NO_SYSCALL;
+  }
+  return syscall_table[number](arg1, arg2, arg3);
+}
+
+/** syscall_initialize:
+ *  Opens int 0x80 to user mode and sets up sysenter on the boot CPU. Needs
+ *  the IDT and the per-CPU data.
+ *
+ */
+void syscall_initialize(void) {
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+
+  /* the Pentium Pro reports SEP without having working sysenter */
+  uint32_t family = (eax >> 8) & 0xf;
+  uint32_t model = (eax >> 4) & 0xf;
+  uint32_t stepping = eax & 0xf;
+  syscall_sysenter = (edx & CPUID_FEATURE_EDX_SEP) &&
+                     !(family == 6 && model < 3 && stepping < 3);
+
+  /* a trap gate, so the system call runs with interrupts enabled */
+  set_idt_entry(IDT_SYSCALL_INDEX, (uint32_t)syscall_interrupt_entry,
+                IDT_TRAP_GATE_TYPE, PL3);
+
+  syscall_initialize_cpu();
+}
+
+/** syscall_initialize_cpu:
+ *  Points the calling CPU's sysenter at the kernel. The stack MSR holds the
+ *  address of the CPU's tss.esp0 rather than a stack, the entry point loads
+ *  the stack from there, so it doesn't have to be rewritten on every thread
+ *  switch.
+ *
+ */
+void syscall_initialize_cpu(void) {
+  if (!syscall_sysenter) {
+    return;
+  }
+
+  wrmsr(MSR_IA32_SYSENTER_CS, GDT_KERNEL_CODE_SELECTOR);
+  wrmsr(MSR_IA32_SYSENTER_ESP, (uint32_t)&smp_current_cpu()->tss.esp0);
+  wrmsr(MSR_IA32_SYSENTER_EIP, (uint32_t)syscall_sysenter_entry);
+}
+
+/** syscall_have_sysenter:
+ *  Returns whether user programs can use sysenter
+ *
+ */
+bool syscall_have_sysenter(void) { return syscall_sysenter; }
+
+/** syscall_bench_thread:
+ *  Maps the benchmark program and its stack and drops to user mode to run
+ *  it. The program ends the thread with SYSCALL_EXIT.
+ *
+ */
+static void syscall_bench_thread(__attribute__((unused)) void *arg) {
+  syscall_user_code = pmm_alloc_page();
+  syscall_user_stack = pmm_alloc_page();
+  if (syscall_user_code == 0 || syscall_user_stack == 0) {
+    fprintf(SERIAL, "syscall: no memory for the user program\n");
+    syscall_user_release();
+    return;
+  }
+
+  size_t size = syscall_user_bench_end - syscall_user_bench_start;
+  memcpy(phys_to_virt(syscall_user_code), syscall_user_bench_start, size);
+
+  /* the program's arguments, see syscall.asm */
+  uint32_t *stack =
+      (uint32_t *)((uint8_t *)phys_to_virt(syscall_user_stack) +
+                   VMM_PAGE_SIZE) - 2;
+  stack[0] = SYSCALL_BENCH_ITERATIONS;
+  stack[1] = syscall_sysenter;
+
+  if (!vmm_map(SYSCALL_USER_CODE, syscall_user_code, VMM_USER) ||
+      !vmm_map(SYSCALL_USER_STACK, syscall_user_stack,
+               VMM_WRITABLE | VMM_USER)) {
+    fprintf(SERIAL, "syscall: couldn't map the user program\n");
+    syscall_user_release();
+    return;
+  }
+
+  fprintf(SERIAL, "syscall: %u round trips per method%s\n",
+          (unsigned int)SYSCALL_BENCH_ITERATIONS,
+          syscall_sysenter ? "" : ", no sysenter");
+  syscall_user_enter(SYSCALL_USER_CODE, SYSCALL_USER_STACK_TOP - 8);
+}
+
+/** syscall_bench:
+ *  Times system call round trips from user mode, through int 0x80 and
+ *  through sysenter, in a thread of its own. Writes the results to serial.
+ *
+ */
+void syscall_bench(void) {
+  if (__atomic_exchange_n(&syscall_bench_running, true, __ATOMIC_ACQUIRE)) {
+    fprintf(SERIAL, "syscall: the benchmark is already running\n");
+    return;
+  }
+
+  if (thread_create("syscall-bench", THREAD_PRIORITY_DEFAULT,
+                    syscall_bench_thread, NULL) == NULL) {
+    fprintf(SERIAL, "syscall: couldn't start the benchmark thread\n");
+    __atomic_store_n(&syscall_bench_running, false, __ATOMIC_RELEASE);
+  }
+}
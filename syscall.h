@@ -0,0 +1,40 @@
+#ifndef INCLUDE_SYSCALL_H
+#define INCLUDE_SYSCALL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* System call numbers, passed in eax. The arguments go in ebx, esi and edi
+ * and the result comes back in eax, whether the call is made with int 0x80
+ * or with sysenter. sysenter also takes the user stack pointer in ecx and
+ * the address to return to in edx, so those two are clobbered. */
+#define SYSCALL_NOP 0
+#define SYSCALL_EXIT 1
+#define SYSCALL_BENCH_REPORT 2 /* method, cycles low, cycles high */
+#define SYSCALL_COUNT 3
+
+/* Returned for an unknown system call number */
+#define SYSCALL_ERROR_NO_SYSCALL 0xffffffff
+
+/* Where syscall_bench maps its user program and stack. The page directory
+ * entry for this range is only ever used for user pages. */
+#define SYSCALL_USER_CODE 0x40000000
+#define SYSCALL_USER_STACK 0x40001000
+#define SYSCALL_USER_STACK_TOP (SYSCALL_USER_STACK + 0x1000)
+
+/* Round trips timed by syscall_bench for each entry method */
+#define SYSCALL_BENCH_ITERATIONS 100000
+
+/* SYSCALL_BENCH_REPORT methods */
+#define SYSCALL_BENCH_INT 0
+#define SYSCALL_BENCH_SYSENTER 1
+
+void syscall_initialize(void);
+void syscall_initialize_cpu(void);
+bool syscall_have_sysenter(void);
+uint32_t syscall_dispatch(uint32_t number, uint32_t arg1, uint32_t arg2,
+                          uint32_t arg3);
+void syscall_bench(void);
+
+#endif /* INCLUDE_SYSCALL_H */
@@ -0,0 +1,26 @@
+section .text
+
+global thread_switch
+; thread_switch - Saves the callee saved registers on the current stack,
+; switches to another thread's stack and restores its registers. The caller
+; saved registers are already on the stack or dead as far as the C caller is
+; concerned, so this is all the state that has to move.
+; stack: [esp + 8] the saved stack pointer of the thread to switch to
+;        [esp + 4] where to store the stack pointer of the current thread
+;        [esp    ] the return address
+thread_switch:
+  mov eax, [esp+4]  ; fetch both arguments before the stack changes
+  mov edx, [esp+8]
+
+  push ebp
+  push ebx
+  push esi
+  push edi
+  mov [eax], esp    ; save the current stack
+
+  mov esp, edx      ; load the new stack
+  pop edi
+  pop esi
+  pop ebx
+  pop ebp
+  ret               ; return into the new thread
@@ -0,0 +1,516 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clock.h"
+#include "cpu.h"
+#include "fpu.h"
+#include "interrupts.h"
+#include "io.h"
+#include "kmem.h"
+#include "smp.h"
+#include "thread.h"
+#include "timer.h"
+
+/* The thread kernel_main runs on. It doubles as the idle thread: it has the
+ * lowest priority and is never taken off the run queue by blocking. */
+static thread_t thread_boot;
+static thread_t *thread_running;
+static thread_t *thread_all;
+
+/* Run queues, one circular list per priority, and a bit per non-empty list so
+ * the most urgent ready thread is found with a single bit scan */
+static thread_t *thread_queues[THREAD_PRIORITIES];
+static uint32_t thread_ready_bitmap;
+
+/* Set when a more urgent thread became ready or the timeslice ran out, acted
+ * on at the next interrupt exit or yield */
+static volatile bool thread_need_resched;
+static timer_t thread_timeslice_timer;
+
+/* A thread that exited, freed by the next thread to run since its stack is
+ * still in use until the switch away from it */
+static thread_t *thread_dead;
+
+static kmem_cache_t *thread_cache;
+static uint32_t thread_next_id;
+static bool thread_have_tsc;
+
+static uint64_t thread_switch_started;
+static thread_switch_stats_t thread_stats;
+
+static const char *const thread_state_names[] = {
+    [THREAD_RUNNING] = "running", [THREAD_READY] = "ready",
+    [THREAD_SLEEPING] = "sleeping", [THREAD_BLOCKED] = "blocked",
+    [THREAD_DEAD] = "dead",
+};
+
+/** thread_timestamp:
+ *  Returns the TSC, or 0 on CPUs without one
+ *
+ */
+static inline uint64_t thread_timestamp(void) {
+  return thread_have_tsc ? rdtsc() : 0;
+}
+
+/** thread_enqueue:
+ *  Adds a thread to the tail of the run queue of its priority
+ *
+ */
+static void thread_enqueue(thread_t *thread) {
+  thread_t **head = &thread_queues[thread->priority];
+
+  if (*head == NULL) {
+    thread->next = thread;
+    thread->prev = thread;
+    *head = thread;
+    thread_ready_bitmap |= 1u << thread->priority;
+  } else {
+    thread->next = *head;
+    thread->prev = (*head)->prev;
+    thread->prev->next = thread;
+    (*head)->prev = thread;
+  }
+}
+
+/** thread_dequeue:
+ *  Removes a thread from the run queue of its priority
+ *
+ */
+static void thread_dequeue(thread_t *thread) {
+  thread_t **head = &thread_queues[thread->priority];
+
+  if (thread->next == thread) {
+    *head = NULL;
+    thread_ready_bitmap &= ~(1u << thread->priority);
+  } else {
+    thread->prev->next = thread->next;
+    thread->next->prev = thread->prev;
+    if (*head == thread) {
+      *head = thread->next;
+    }
+  }
+  thread->next = NULL;
+  thread->prev = NULL;
+}
+
+/** thread_timeslice_expired:
+ *  Timer callback ending the timeslice of the running thread
+ *
+ */
+static void thread_timeslice_expired(__attribute__((unused)) timer_t *timer,
+                                     __attribute__((unused)) void *ctx) {
+  thread_need_resched = true;
+}
+
+/** thread_update_timeslice:
+ *  Arms the timeslice timer while a thread of the running thread's priority is
+ *  waiting for the CPU, and stops it otherwise, so a thread running alone is
+ *  never interrupted for nothing
+ *
+ */
+static void thread_update_timeslice(void) {
+  thread_t *current = thread_running;
+  bool contended = current != &thread_boot &&
+                   (thread_ready_bitmap & (1u << current->priority));
+
+  if (contended && !thread_timeslice_timer.pending) {
+    timer_add(&thread_timeslice_timer,
+              clock_monotonic_ns() + THREAD_TIMESLICE_NS,
+              thread_timeslice_expired, NULL);
+  } else if (!contended && thread_timeslice_timer.pending) {
+    timer_cancel(&thread_timeslice_timer);
+  }
+}
+
+/** thread_make_ready:
+ *  Puts a thread on the run queue, asking for a reschedule if it is more
+ *  urgent than the running thread
+ *
+ */
+static void thread_make_ready(thread_t *thread) {
+  thread->state = THREAD_READY;
+  thread_enqueue(thread);
+
+  if (thread->priority < thread_running->priority) {
+    thread_need_resched = true;
+  }
+  thread_update_timeslice();
+}
+
+/** thread_finish_switch:
+ *  Runs on the incoming thread right after a switch: records the switch
+ *  latency, frees a thread that exited and starts a new timeslice
+ *
+ */
+static void thread_finish_switch(void) {
+  uint64_t now = thread_timestamp();
+  uint64_t latency = now - thread_switch_started;
+  thread_t *current = thread_running;
+
+  thread_stats.count++;
+  thread_stats.total += latency;
+  if (thread_stats.count == 1 || latency < thread_stats.min) {
+    thread_stats.min = latency;
+  }
+  if (latency > thread_stats.max) {
+    thread_stats.max = latency;
+  }
+
+  current->switched_in = now;
+  current->switches++;
+
+  if (thread_dead != NULL && thread_dead != current) {
+    fpu_thread_free(thread_dead);
+    kfree(thread_dead->stack);
+    kmem_cache_free(thread_cache, thread_dead);
+    thread_dead = NULL;
+  }
+
+  timer_cancel(&thread_timeslice_timer);
+  thread_update_timeslice();
+}
+
+/** thread_schedule:
+ *  Switches to the most urgent ready thread. A running thread keeps the CPU
+ *  unless a thread of the same or a more urgent priority is ready, in which
+ *  case it goes to the back of its run queue. Must be called with interrupts
+ *  disabled.
+ *
+ */
+static void thread_schedule(void) {
+  thread_t *current = thread_running;
+  thread_need_resched = false;
+
+  if (current->state == THREAD_RUNNING) {
+    if (thread_ready_bitmap == 0 ||
+        (uint32_t)__builtin_ctz(thread_ready_bitmap) > current->priority) {
+      thread_update_timeslice();
+      return;
+    }
+    current->state = THREAD_READY;
+    thread_enqueue(current);
+  }
+
+  if (thread_ready_bitmap == 0) {
+    /* only the idle thread can get here and it never blocks */
+    return;
+  }
+
+  thread_t *next = thread_queues[__builtin_ctz(thread_ready_bitmap)];
+  thread_dequeue(next);
+  next->state = THREAD_RUNNING;
+
+  if (next == current) {
+    thread_update_timeslice();
+    return;
+  }
+
+  uint64_t now = thread_timestamp();
+  current->cycles += now - current->switched_in;
+  thread_running = next;
+  thread_switch_started = now;
+
+  /* interrupts and system calls from user mode switch to the top of the
+   * kernel stack of whichever thread is running. The boot thread never
+   * enters user mode. */
+  if (next->stack != NULL) {
+    smp_current_cpu()->tss.esp0 = (uint32_t)next->stack + THREAD_STACK_SIZE;
+  }
+  fpu_thread_switch(next);
+  thread_switch(&current->esp, next->esp);
+
+  /* running on the stack of current again, switched to by some other
+   * thread */
+  thread_finish_switch();
+}
+
+/** thread_start:
+ *  First code run by a new thread, thread_switch returns here
+ *
+ */
+static void thread_start(void) {
+  thread_finish_switch();
+  enable_interrupts();
+
+  thread_running->entry(thread_running->arg);
+  thread_exit();
+}
+
+/** thread_sleep_expired:
+ *  Timer callback waking a sleeping thread. Timers run with interrupts
+ *  enabled, and an interrupt handler may wake the same thread or touch the
+ *  run queues, so the check and the enqueue happen with them disabled.
+ *
+ */
+static void thread_sleep_expired(__attribute__((unused)) timer_t *timer,
+                                 void *ctx) {
+  thread_t *thread = ctx;
+  uint32_t flags = interrupts_save();
+  if (thread->state == THREAD_SLEEPING) {
+    thread_make_ready(thread);
+  }
+  interrupts_restore(flags);
+}
+
+/** thread_initialize:
+ *  Turns the code running kernel_main into the boot thread, so other threads
+ *  can be switched to from it. Needs the kernel heap.
+ *
+ */
+void thread_initialize(void) {
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+  thread_have_tsc = edx & CPUID_FEATURE_EDX_TSC;
+
+  thread_cache = kmem_cache_create("thread", sizeof(thread_t), 0, NULL);
+
+  uint32_t flags = interrupts_save();
+  thread_boot.id = thread_next_id++;
+  thread_boot.name = "main";
+  thread_boot.state = THREAD_RUNNING;
+  thread_boot.priority = THREAD_PRIORITY_IDLE;
+  thread_boot.switched_in = thread_timestamp();
+  thread_boot.list_next = thread_all;
+  thread_all = &thread_boot;
+  thread_running = &thread_boot;
+  interrupts_restore(flags);
+}
+
+/** thread_create:
+ *  Starts a kernel thread on a new stack
+ *
+ *  @param name Shown by thread_dump, must stay valid for the life of the
+ *              thread
+ *  @param priority From 0, the most urgent, to THREAD_PRIORITY_IDLE - 1
+ *  @param entry The function the thread runs, it exits when this returns
+ *  @param arg Passed to entry
+ *  @return The thread, NULL if out of memory
+ */
+thread_t *thread_create(const char *name, uint32_t priority,
+                        thread_entry_t entry, void *arg) {
+  if (thread_cache == NULL || priority >= THREAD_PRIORITY_IDLE) {
+    return NULL;
+  }
+
+  thread_t *thread = kmem_cache_alloc(thread_cache);
+  if (thread == NULL) {
+    return NULL;
+  }
+  *thread = (thread_t){.name = name,
+                       .priority = priority,
+                       .entry = entry,
+                       .arg = arg,
+                       .stack = kmalloc(THREAD_STACK_SIZE)};
+  if (thread->stack == NULL) {
+    kmem_cache_free(thread_cache, thread);
+    return NULL;
+  }
+
+  /* the frame thread_switch pops: edi, esi, ebx, ebp and a return into
+   * thread_start, which sees a null return address of its own above it */
+  uint32_t *sp = (uint32_t *)((char *)thread->stack + THREAD_STACK_SIZE);
+  *--sp = 0;
+  *--sp = (uint32_t)thread_start;
+  *--sp = 0;
+  *--sp = 0;
+  *--sp = 0;
+  *--sp = 0;
+  thread->esp = (uint32_t)sp;
+
+  uint32_t flags = interrupts_save();
+  thread->id = thread_next_id++;
+  thread->list_next = thread_all;
+  thread_all = thread;
+  thread_make_ready(thread);
+  if (thread_need_resched && !in_interrupt()) {
+    thread_schedule();
+  }
+  interrupts_restore(flags);
+
+  return thread;
+}
+
+/** thread_current:
+ *  Returns the running thread, NULL before thread_initialize
+ *
+ */
+thread_t *thread_current(void) { return thread_running; }
+
+/** thread_runnable:
+ *  Returns whether any thread other than the running one is ready to run
+ *
+ */
+bool thread_runnable(void) { return thread_ready_bitmap != 0; }
+
+/** thread_yield:
+ *  Gives the CPU to another ready thread of the same or a more urgent
+ *  priority, if there is one
+ *
+ */
+void thread_yield(void) {
+  if (thread_running == NULL) {
+    return;
+  }
+
+  uint32_t flags = interrupts_save();
+  thread_schedule();
+  interrupts_restore(flags);
+}
+
+/** thread_sleep:
+ *  Takes the running thread off the CPU for at least the given time. The boot
+ *  thread halts in place instead, since it is the thread that runs when
+ *  nothing else can.
+ *
+ *  @param ns The time to sleep in nanoseconds
+ */
+void thread_sleep(uint64_t ns) {
+  thread_t *current = thread_running;
+  uint64_t deadline = clock_monotonic_ns() + ns;
+
+  if (current == NULL) {
+    while (clock_monotonic_ns() < deadline) {
+    }
+    return;
+  }
+
+  uint32_t flags = interrupts_save();
+  timer_add(&current->sleep_timer, deadline, thread_sleep_expired, current);
+
+  if (current == &thread_boot) {
+    while (clock_monotonic_ns() < deadline) {
+      timer_idle();
+      disable_interrupts();
+    }
+  } else {
+    current->state = THREAD_SLEEPING;
+    thread_schedule();
+  }
+
+  interrupts_restore(flags);
+}
+
+/** thread_block:
+ *  Takes the running thread off the CPU until thread_wake is called for it.
+ *  Must be called with interrupts disabled, after checking the condition
+ *  waited for, so a wake up can't be lost in between. The boot thread halts
+ *  until the next interrupt instead, so callers must check their condition
+ *  again when this returns.
+ *
+ */
+void thread_block(void) {
+  thread_t *current = thread_running;
+
+  if (current == NULL || current == &thread_boot) {
+    asm volatile("sti\n\thlt\n\tcli" : : : "memory");
+    return;
+  }
+
+  current->state = THREAD_BLOCKED;
+  thread_schedule();
+}
+
+/** thread_wake:
+ *  Makes a blocked or sleeping thread ready to run. Switches to it right away
+ *  if it is more urgent than the caller, or at the end of the interrupt when
+ *  called from a handler.
+ *
+ *  @param thread The thread to wake
+ */
+void thread_wake(thread_t *thread) {
+  uint32_t flags = interrupts_save();
+
+  if (thread->state == THREAD_SLEEPING) {
+    timer_cancel(&thread->sleep_timer);
+  }
+  if (thread->state == THREAD_SLEEPING || thread->state == THREAD_BLOCKED) {
+    thread_make_ready(thread);
+    if (thread_need_resched && !in_interrupt()) {
+      thread_schedule();
+    }
+  }
+
+  interrupts_restore(flags);
+}
+
+/** thread_exit:
+ *  Ends the running thread. Its stack is freed by the next thread to run.
+ *
+ */
+void thread_exit(void) {
+  disable_interrupts();
+
+  thread_t *current = thread_running;
+  if (current != &thread_boot) {
+    thread_t **link = &thread_all;
+    while (*link != current) {
+      link = &(*link)->list_next;
+    }
+    *link = current->list_next;
+
+    current->state = THREAD_DEAD;
+    thread_dead = current;
+    thread_schedule();
+  }
+
+  for (;;) {
+    asm volatile("hlt");
+  }
+}
+
+/** thread_interrupt_exit:
+ *  Called at the end of every interrupt, switches threads if the interrupt
+ *  made a more urgent thread ready or ended the running thread's timeslice
+ *
+ */
+void thread_interrupt_exit(void) {
+  if (thread_need_resched && thread_running != NULL) {
+    thread_schedule();
+  }
+}
+
+/** thread_get_switch_stats:
+ *  Returns the context switch latency measured so far
+ *
+ *  @param stats Where to store the statistics
+ */
+void thread_get_switch_stats(thread_switch_stats_t *stats) {
+  uint32_t flags = interrupts_save();
+  *stats = thread_stats;
+  interrupts_restore(flags);
+}
+
+/** thread_dump:
+ *  Writes every thread and the context switch latency to serial
+ *
+ */
+void thread_dump(void) {
+  uint32_t flags = interrupts_save();
+
+  fprintf(SERIAL, "thread: %4s %-12s %-8s %4s %8s %10s\n", "id", "name",
+          "state", "prio", "switches", "run ms");
+  for (thread_t *thread = thread_all; thread != NULL;
+       thread = thread->list_next) {
+    uint64_t cycles = thread->cycles;
+    if (thread == thread_running) {
+      cycles += thread_timestamp() - thread->switched_in;
+    }
+    fprintf(SERIAL, "thread: %4u %-12s %-8s %4u %8u %10llu\n",
+            (unsigned int)thread->id, thread->name,
+            thread_state_names[thread->state], (unsigned int)thread->priority,
+            (unsigned int)thread->switches,
+            clock_cycles_to_ns(cycles) / 1000000);
+  }
+
+  thread_switch_stats_t stats = thread_stats;
+  interrupts_restore(flags);
+
+  if (stats.count != 0) {
+    fprintf(SERIAL,
+            "thread: %u switches, cycles min %llu avg %llu max %llu "
+            "(avg %llu ns)\n",
+            (unsigned int)stats.count, stats.min, stats.total / stats.count,
+            stats.max, clock_cycles_to_ns(stats.total / stats.count));
+  }
+}
@@ -0,0 +1,85 @@
+#ifndef INCLUDE_THREAD_H
+#define INCLUDE_THREAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "timer.h"
+
+/* Priorities go from 0, the most urgent, to THREAD_PRIORITY_IDLE. There is
+ * one run queue per priority and a bit per non-empty queue. */
+#define THREAD_PRIORITIES 32
+#define THREAD_PRIORITY_HIGH 8
+#define THREAD_PRIORITY_DEFAULT 16
+#define THREAD_PRIORITY_IDLE (THREAD_PRIORITIES - 1)
+
+#define THREAD_STACK_SIZE 8192
+
+/* Time a thread runs before yielding to a ready thread of the same priority */
+#define THREAD_TIMESLICE_NS 10000000
+
+enum thread_state {
+  THREAD_RUNNING,
+  THREAD_READY,
+  THREAD_SLEEPING,
+  THREAD_BLOCKED,
+  THREAD_DEAD,
+};
+
+typedef void (*thread_entry_t)(void *arg);
+
+struct thread {
+  uint32_t esp; /* saved by thread_switch while the thread isn't running */
+  uint32_t id;
+  const char *name;
+  enum thread_state state;
+  uint32_t priority;
+
+  thread_entry_t entry;
+  void *arg;
+  void *stack; /* NULL for the boot thread, whose stack is in boot.asm */
+
+  struct thread *next; /* run queue links */
+  struct thread *prev;
+  struct thread *list_next; /* every thread, for thread_dump */
+  timer_t sleep_timer;
+
+  void *fpu_state; /* saved FPU registers, allocated on first use */
+  bool fpu_used;   /* whether fpu_state holds anything yet */
+
+  uint32_t switches; /* times the thread was switched in */
+  uint64_t cycles;   /* TSC cycles spent running */
+  uint64_t switched_in;
+};
+
+typedef struct thread thread_t;
+
+/* Context switch latency, in TSC cycles from the outgoing thread giving up
+ * the CPU to the incoming one running */
+struct thread_switch_stats {
+  uint32_t count;
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+};
+
+typedef struct thread_switch_stats thread_switch_stats_t;
+
+void thread_switch(uint32_t *old_esp, uint32_t new_esp);
+
+void thread_initialize(void);
+thread_t *thread_create(const char *name, uint32_t priority,
+                        thread_entry_t entry, void *arg);
+thread_t *thread_current(void);
+void thread_yield(void);
+void thread_sleep(uint64_t ns);
+void thread_block(void);
+void thread_wake(thread_t *thread);
+void thread_exit(void) __attribute__((noreturn));
+bool thread_runnable(void);
+void thread_interrupt_exit(void);
+void thread_get_switch_stats(thread_switch_stats_t *stats);
+void thread_dump(void);
+
+#endif /* INCLUDE_THREAD_H */
@@ -0,0 +1,370 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clock.h"
+#include "interrupts.h"
+#include "softirq.h"
+#include "timer.h"
+
+/* Hierarchical timer wheel. Level 0 holds timers due within the next
+ * TIMER_WHEEL_SIZE ticks, one slot per tick. Each higher level holds timers
+ * further out in coarser slots, which are cascaded down a level every time
+ * the level below wraps around. Insert and expire are O(1). */
+static timer_t *timer_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+static uint64_t timer_wheel_occupied[TIMER_WHEEL_LEVELS];
+
+/* The next tick to be processed */
+static uint64_t timer_next_tick;
+static uint32_t timer_pending_count;
+
+/* Whether the clock event device runs in one-shot mode, and the time it is
+ * armed for, UINT64_MAX when no interrupt is outstanding */
+static bool timer_tickless;
+static uint64_t timer_armed_ns = UINT64_MAX;
+
+/** timer_index:
+ *  Returns the slot index of a tick on the given level
+ *
+ */
+static inline uint32_t timer_index(uint64_t tick, uint32_t level) {
+  return (tick >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+}
+
+/** timer_enqueue:
+ *  Puts a timer in the slot matching its expiry relative to the next tick to
+ *  be processed. Must be called with interrupts disabled.
+ *
+ *  @param timer The timer to insert, with expires set
+ */
+static void timer_enqueue(timer_t *timer) {
+  uint64_t expires = timer->expires;
+  if (expires < timer_next_tick) {
+    expires = timer_next_tick;
+  }
+
+  uint64_t delta = expires - timer_next_tick;
+  uint32_t level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         delta >= (1ULL << ((level + 1) * TIMER_WHEEL_BITS))) {
+    level++;
+  }
+
+  /* timers beyond the last level wait in its furthest slot and are
+   * re-inserted when it cascades */
+  uint64_t max_delta = (1ULL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS)) - 1;
+  if (delta > max_delta) {
+    expires = timer_next_tick + max_delta;
+  }
+
+  uint32_t slot = timer_index(expires, level);
+
+  timer->level = level;
+  timer->slot = slot;
+  timer->prev = NULL;
+  timer->next = timer_wheel[level][slot];
+  if (timer->next != NULL) {
+    timer->next->prev = timer;
+  }
+  timer_wheel[level][slot] = timer;
+  timer_wheel_occupied[level] |= 1ULL << slot;
+}
+
+/** timer_dequeue:
+ *  Unlinks a pending timer from its slot. Must be called with interrupts
+ *  disabled.
+ *
+ *  @param timer The timer to remove
+ */
+static void timer_dequeue(timer_t *timer) {
+  if (timer->prev != NULL) {
+    timer->prev->next = timer->next;
+  } else {
+    timer_wheel[timer->level][timer->slot] = timer->next;
+  }
+  if (timer->next != NULL) {
+    timer->next->prev = timer->prev;
+  }
+  if (timer_wheel[timer->level][timer->slot] == NULL) {
+    timer_wheel_occupied[timer->level] &= ~(1ULL << timer->slot);
+  }
+  timer->next = NULL;
+  timer->prev = NULL;
+}
+
+/** timer_cascade:
+ *  Re-inserts every timer of a slot on a higher level, which spreads them
+ *  over the finer slots of the levels below
+ *
+ *  @param level The level to cascade from
+ *  @param slot The slot to cascade
+ *  @return The slot index, so the caller knows whether this level wrapped too
+ */
+static uint32_t timer_cascade(uint32_t level, uint32_t slot) {
+  timer_t *timer = timer_wheel[level][slot];
+  timer_wheel[level][slot] = NULL;
+  timer_wheel_occupied[level] &= ~(1ULL << slot);
+
+  while (timer != NULL) {
+    timer_t *next = timer->next;
+    timer_enqueue(timer);
+    timer = next;
+  }
+
+  return slot;
+}
+
+/** timer_expire:
+ *  Runs every timer in the given level 0 slot, re-arming periodic ones. Must
+ *  be called with interrupts disabled, the callbacks run with the interrupt
+ *  flag timer_process was called with.
+ *
+ *  @param slot The level 0 slot that is due
+ *  @param flags The eflags value timer_process saved
+ */
+static void timer_expire(uint32_t slot, uint32_t flags) {
+  timer_t *timer;
+
+  /* timers added by the callbacks land in later slots, since
+   * timer_next_tick is already past this one */
+  while ((timer = timer_wheel[0][slot]) != NULL) {
+    timer_dequeue(timer);
+    timer->pending = false;
+    timer_pending_count--;
+
+    if (timer->period_ns != 0) {
+      /* advance the deadline in ns and round each one up on its own, a
+       * period that isn't a whole number of ticks keeps its rate */
+      timer->next_ns += timer->period_ns;
+      timer->expires = (timer->next_ns + TIMER_TICK_NS - 1) >> TIMER_TICK_SHIFT;
+      timer->pending = true;
+      timer_pending_count++;
+      timer_enqueue(timer);
+    }
+
+    /* the slot is read again afterwards, so interrupts may change the
+     * wheel while the callback runs */
+    interrupts_restore(flags);
+    timer->callback(timer, timer->ctx);
+    interrupts_save();
+  }
+}
+
+/** timer_arm:
+ *  In tickless mode, programs the clock event device for the next deadline
+ *  unless it is already armed to fire by then. Must be called with
+ *  interrupts disabled.
+ *
+ */
+static void timer_arm(void) {
+  if (!timer_tickless) {
+    return;
+  }
+
+  uint64_t deadline = timer_next_deadline();
+  if (deadline >= timer_armed_ns) {
+    return;
+  }
+
+  uint64_t now = clock_monotonic_ns();
+  uint64_t delta = deadline > now ? deadline - now : 0;
+  uint64_t max = clock_max_oneshot_ns();
+  /* a deadline beyond the device's reach is reached in several shots */
+  if (delta > max) {
+    delta = max;
+  }
+  clock_set_oneshot(delta);
+  timer_armed_ns = now + delta;
+}
+
+/** timer_process:
+ *  Advances the wheel to the current time, cascading higher levels as lower
+ *  ones wrap and running every timer that has expired. Bottom half of
+ *  SOFTIRQ_TIMER, the wheel is only touched with interrupts disabled and the
+ *  callbacks run with them enabled.
+ *
+ */
+void timer_process(void) {
+  uint32_t flags = interrupts_save();
+  uint64_t now = clock_monotonic_ns() >> TIMER_TICK_SHIFT;
+
+  if (timer_pending_count == 0) {
+    timer_next_tick = now + 1;
+    interrupts_restore(flags);
+    return;
+  }
+
+  while (timer_next_tick <= now) {
+    uint32_t index = timer_index(timer_next_tick, 0);
+
+    if (index == 0) {
+      for (uint32_t level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if (timer_cascade(level, timer_index(timer_next_tick, level)) != 0) {
+          break;
+        }
+      }
+    }
+
+    if (timer_wheel_occupied[0] == 0) {
+      /* nothing can fire before the next cascade, skip straight to it */
+      uint64_t boundary = (timer_next_tick | TIMER_WHEEL_MASK) + 1;
+      timer_next_tick = boundary <= now ? boundary : now + 1;
+      continue;
+    }
+
+    timer_next_tick++;
+    if (timer_wheel_occupied[0] & (1ULL << index)) {
+      timer_expire(index, flags);
+    }
+  }
+
+  timer_arm();
+  interrupts_restore(flags);
+}
+
+/** timer_interrupt:
+ *  Clock event handler, leaves the wheel to the timer softirq, which arms
+ *  the device again
+ *
+ */
+static void timer_interrupt(void) {
+  timer_armed_ns = UINT64_MAX;
+  softirq_raise(SOFTIRQ_TIMER);
+}
+
+/** timer_next_deadline:
+ *  Returns the time by which the wheel next needs processing: the earliest
+ *  level 0 timer, or the next cascade if only higher levels hold timers
+ *
+ *  @return The time in nanoseconds, UINT64_MAX if no timer is pending
+ */
+uint64_t timer_next_deadline(void) {
+  if (timer_pending_count == 0) {
+    return UINT64_MAX;
+  }
+
+  uint64_t tick = timer_next_tick;
+  uint32_t index = timer_index(tick, 0);
+  /* slots from index up to the end of level 0 fire before the next cascade */
+  uint64_t ahead = timer_wheel_occupied[0] >> index;
+
+  if (ahead != 0) {
+    tick += __builtin_ctzll(ahead);
+  } else {
+    tick = (tick | TIMER_WHEEL_MASK) + 1;
+  }
+
+  return tick << TIMER_TICK_SHIFT;
+}
+
+/** timer_add:
+ *  Arms a one-shot timer. A timer that is already pending is moved.
+ *
+ *  @param timer The timer, owned by the caller
+ *  @param deadline_ns When to fire, in clock_monotonic_ns time
+ *  @param callback The function to call
+ *  @param ctx Passed to the callback
+ */
+void timer_add(timer_t *timer, uint64_t deadline_ns, timer_callback_t callback,
+               void *ctx) {
+  timer_add_periodic(timer, deadline_ns, 0, callback, ctx);
+}
+
+/** timer_add_periodic:
+ *  Arms a timer which fires first at first_ns and then every period_ns
+ *  until cancelled. A period of 0 makes a one-shot timer.
+ *
+ *  @param timer The timer, owned by the caller
+ *  @param first_ns When to fire first, in clock_monotonic_ns time
+ *  @param period_ns The interval between firings, at least one tick
+ *  @param callback The function to call
+ *  @param ctx Passed to the callback
+ */
+void timer_add_periodic(timer_t *timer, uint64_t first_ns, uint64_t period_ns,
+                        timer_callback_t callback, void *ctx) {
+  uint32_t flags = interrupts_save();
+
+  if (timer->pending) {
+    timer_dequeue(timer);
+    timer_pending_count--;
+  }
+
+  if (timer_pending_count == 0) {
+    /* the wheel isn't advanced while empty, catch up before inserting */
+    timer_next_tick = (clock_monotonic_ns() >> TIMER_TICK_SHIFT) + 1;
+  }
+
+  if (period_ns != 0 && period_ns < TIMER_TICK_NS) {
+    period_ns = TIMER_TICK_NS;
+  }
+
+  /* round up so the timer never fires before its deadline */
+  timer->next_ns = first_ns;
+  timer->expires = (first_ns + TIMER_TICK_NS - 1) >> TIMER_TICK_SHIFT;
+  timer->period_ns = period_ns;
+  timer->callback = callback;
+  timer->ctx = ctx;
+  timer->pending = true;
+  timer_pending_count++;
+  timer_enqueue(timer);
+
+  /* reprogram the device if this is now the earliest deadline */
+  timer_arm();
+
+  interrupts_restore(flags);
+}
+
+/** timer_cancel:
+ *  Disarms a timer
+ *
+ *  @param timer The timer to cancel
+ *  @return true if the timer was pending
+ */
+bool timer_cancel(timer_t *timer) {
+  uint32_t flags = interrupts_save();
+
+  bool pending = timer->pending;
+  if (pending) {
+    timer_dequeue(timer);
+    timer->pending = false;
+    timer_pending_count--;
+  }
+
+  interrupts_restore(flags);
+  return pending;
+}
+
+/** timer_idle:
+ *  Halts until the next interrupt. In tickless mode the clock event device is
+ *  kept armed for the next deadline by timer_add and the timer softirq, so an
+ *  idle machine without timers only wakes for device interrupts. Must be
+ *  called with interrupts disabled; returns with them enabled.
+ *
+ */
+void timer_idle(void) {
+  /* sti only takes effect after hlt, so nothing can slip in between */
+  asm volatile("sti\n\thlt" : : : "memory");
+}
+
+/** timer_initialize:
+ *  Hooks the wheel onto the clock event device. With a calibrated TSC the
+ *  clock keeps time on its own, so the periodic tick is replaced by one-shot
+ *  interrupts programmed for each deadline.
+ *
+ */
+void timer_initialize(void) {
+  uint32_t flags = interrupts_save();
+
+  timer_next_tick = clock_monotonic_ns() >> TIMER_TICK_SHIFT;
+  softirq_register(SOFTIRQ_TIMER, "timer", timer_process);
+  clock_set_event_handler(timer_interrupt);
+
+  if (clock_tsc_hz() != 0) {
+    timer_tickless = true;
+    /* one last interrupt stops the rate generator */
+    clock_set_oneshot(clock_max_oneshot_ns());
+    timer_armed_ns = clock_monotonic_ns() + clock_max_oneshot_ns();
+  }
+
+  interrupts_restore(flags);
+}
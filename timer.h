@@ -0,0 +1,55 @@
+#ifndef INCLUDE_TIMER_H
+#define INCLUDE_TIMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The wheel advances in ticks of 2^TIMER_TICK_SHIFT ns (~1.05 ms), so
+ * turning a deadline into a tick is a shift rather than a division */
+#define TIMER_TICK_SHIFT 20
+#define TIMER_TICK_NS (1ULL << TIMER_TICK_SHIFT)
+
+/* Each level has 2^TIMER_WHEEL_BITS slots, each slot of level n spans
+ * 2^(n * TIMER_WHEEL_BITS) ticks. Four levels of 64 cover ~4.9 hours. */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+struct timer;
+
+/** timer_callback_t:
+ *  Called when a timer expires, from the timer softirq with interrupts
+ *  enabled, so anything it shares with interrupt handlers needs
+ *  interrupts_save. May add or cancel timers, including the one that fired.
+ */
+typedef void (*timer_callback_t)(struct timer *timer, void *ctx);
+
+/* A timer is owned by the caller and must stay valid while it is pending */
+struct timer {
+  struct timer *next;
+  struct timer *prev;
+  uint64_t expires;   /* wheel tick the timer fires on */
+  uint64_t next_ns;   /* deadline expires was rounded up from */
+  uint64_t period_ns; /* 0 for one-shot timers */
+  timer_callback_t callback;
+  void *ctx;
+  uint8_t level; /* position in the wheel while pending */
+  uint8_t slot;
+  bool pending;
+};
+
+typedef struct timer timer_t;
+
+void timer_initialize(void);
+void timer_add(timer_t *timer, uint64_t deadline_ns, timer_callback_t callback,
+               void *ctx);
+void timer_add_periodic(timer_t *timer, uint64_t first_ns, uint64_t period_ns,
+                        timer_callback_t callback, void *ctx);
+bool timer_cancel(timer_t *timer);
+void timer_process(void);
+uint64_t timer_next_deadline(void);
+void timer_idle(void);
+
+#endif /* INCLUDE_TIMER_H */
@@ -0,0 +1,283 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
+#include "interrupts.h"
+#include "pmm.h"
+#include "str.h"
+#include "vmm.h"
+
+/* PAT memory types */
+#define PAT_WRITE_COMBINING 0x01
+
+/* The kernel page directory. _start in boot.asm fills in the identity map and
+ * the direct map before turning paging on, so it lives in .bss where the
+ * bootloader zeroes it. */
+uint32_t vmm_kernel_directory[VMM_ENTRIES]
+    __attribute__((aligned(VMM_PAGE_SIZE)));
+
+/* Page table of the MMIO window. It is static so devices can be mapped before
+ * the page frame allocator is up. */
+static uint32_t vmm_mmio_table[VMM_ENTRIES]
+    __attribute__((aligned(VMM_PAGE_SIZE)));
+static uint32_t vmm_mmio_next = VMM_MMIO_BASE;
+
+/* Page table of the first 4 MiB of physical memory, used by the direct map
+ * and the low identity map instead of a large page so the legacy video
+ * window can be left out */
+static uint32_t vmm_low_table[VMM_ENTRIES]
+    __attribute__((aligned(VMM_PAGE_SIZE)));
+
+/* VMM_GLOBAL if the CPU supports global pages. Kernel mappings are marked
+ * global so they stay in the TLB across address space switches. */
+static uint32_t vmm_global;
+
+/** vmm_invlpg:
+ *  Drops the TLB entry covering a single virtual address
+ *
+ */
+static inline void vmm_invlpg(uint32_t virt) {
+  asm volatile("invlpg (%0)" : : "r"(virt) : "memory");
+}
+
+/** vmm_directory_index:
+ *  Returns the page directory index covering a virtual address
+ *
+ */
+static inline uint32_t vmm_directory_index(uint32_t virt) {
+  return virt >> VMM_LARGE_PAGE_SHIFT;
+}
+
+/** vmm_table_index:
+ *  Returns the page table index of a virtual address
+ *
+ */
+static inline uint32_t vmm_table_index(uint32_t virt) {
+  return (virt >> VMM_PAGE_SHIFT) & (VMM_ENTRIES - 1);
+}
+
+/** vmm_flush_all:
+ *  Drops every TLB entry, global ones included
+ *
+ */
+static void vmm_flush_all(void) {
+  if (vmm_global) {
+    uint32_t cr4 = read_cr4();
+    write_cr4(cr4 & ~CR4_PGE);
+    write_cr4(cr4);
+  } else {
+    asm volatile("mov %%cr3, %%eax\n\t"
+                 "mov %%eax, %%cr3"
+                 :
+                 :
+                 : "eax", "memory");
+  }
+}
+
+/** vmm_initialize_cpu:
+ *  Programs the PAT of the calling CPU. Every CPU must agree on the memory
+ *  types, so this runs on each one as it starts.
+ *
+ */
+void vmm_initialize_cpu(void) {
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+
+  if (edx & CPUID_FEATURE_EDX_PAT) {
+    /* PAT entry 1 (PWT set) defaults to write through. Nothing is mapped with
+     * it yet, so it can be changed without flushing caches. */
+    uint64_t pat = rdmsr(MSR_IA32_PAT);
+    pat &= ~(0xffULL << 8);
+    pat |= (uint64_t)PAT_WRITE_COMBINING << 8;
+    wrmsr(MSR_IA32_PAT, pat);
+  }
+}
+
+/** vmm_initialize:
+ *  Finishes the page tables set up by boot.asm: programs the PAT, marks the
+ *  direct map global, maps its first 4 MiB with small pages minus the legacy
+ *  video window, installs the MMIO window and drops the identity mapping that
+ *  was only needed to jump to the higher half
+ *
+ */
+void vmm_initialize(void) {
+  uint32_t eax, ebx, ecx, edx;
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+
+  vmm_initialize_cpu();
+
+  if (edx & CPUID_FEATURE_EDX_PGE) {
+    vmm_global = VMM_GLOBAL;
+    for (uint32_t i = vmm_directory_index(KERNEL_VIRTUAL_BASE) + 1;
+         i < vmm_directory_index(VMM_MMIO_BASE); i++) {
+      vmm_kernel_directory[i] |= VMM_GLOBAL;
+    }
+  }
+
+  /* the same translations as the large page it replaces, minus the video
+   * window, so the switch is safe while the kernel runs from it */
+  for (uint32_t i = 0; i < VMM_ENTRIES; i++) {
+    uint32_t phys = i << VMM_PAGE_SHIFT;
+    if (phys >= VMM_LEGACY_VIDEO_BASE && phys < VMM_LEGACY_VIDEO_END) {
+      continue;
+    }
+    vmm_low_table[i] = phys | VMM_PRESENT | VMM_WRITABLE | vmm_global;
+  }
+  vmm_kernel_directory[vmm_directory_index(KERNEL_VIRTUAL_BASE)] =
+      virt_to_phys(vmm_low_table) | VMM_PRESENT | VMM_WRITABLE;
+
+  if (vmm_global) {
+    /* setting CR4.PGE flushes the whole TLB */
+    write_cr4(read_cr4() | CR4_PGE);
+  } else {
+    vmm_flush_all();
+  }
+
+  vmm_kernel_directory[vmm_directory_index(VMM_MMIO_BASE)] =
+      virt_to_phys(vmm_mmio_table) | VMM_PRESENT | VMM_WRITABLE;
+
+  vmm_kernel_directory[0] = 0;
+  vmm_invlpg(0);
+}
+
+/** vmm_map:
+ *  Maps a 4 KiB page in the kernel page directory, allocating the page table
+ *  if needed. Only the one TLB entry is flushed when a mapping is replaced.
+ *
+ *  @param virt The virtual address of the page
+ *  @param phys The physical address of the page frame
+ *  @param flags VMM_* bits for the entry, VMM_PRESENT is implied
+ *  @return false if no page table could be allocated or the address is
+ *          covered by a 4 MiB page
+ */
+bool vmm_map(uint32_t virt, uint32_t phys, uint32_t flags) {
+  uint32_t *pde = &vmm_kernel_directory[vmm_directory_index(virt)];
+
+  if (virt >= KERNEL_VIRTUAL_BASE) {
+    flags |= vmm_global;
+  }
+
+  uint32_t irq_flags = interrupts_save();
+
+  if (!(*pde & VMM_PRESENT)) {
+    uint32_t table = pmm_alloc_page();
+    if (table == 0) {
+      interrupts_restore(irq_flags);
+      return false;
+    }
+    memset(phys_to_virt(table), 0, VMM_PAGE_SIZE);
+    *pde = table | VMM_PRESENT | VMM_WRITABLE | (flags & VMM_USER);
+  } else if (*pde & VMM_LARGE) {
+    interrupts_restore(irq_flags);
+    return false;
+  }
+
+  uint32_t *table = phys_to_virt(*pde & VMM_FRAME_MASK);
+  uint32_t *pte = &table[vmm_table_index(virt)];
+  bool replaced = *pte & VMM_PRESENT;
+
+  *pte = (phys & VMM_FRAME_MASK) | (flags & ~VMM_FRAME_MASK) | VMM_PRESENT;
+  /* entries that weren't present are never cached */
+  if (replaced) {
+    vmm_invlpg(virt);
+  }
+
+  interrupts_restore(irq_flags);
+  return true;
+}
+
+/** vmm_unmap:
+ *  Removes the mapping of a 4 KiB page and flushes its TLB entry. The page
+ *  table is kept.
+ *
+ *  @param virt The virtual address of the page
+ */
+void vmm_unmap(uint32_t virt) {
+  uint32_t pde = vmm_kernel_directory[vmm_directory_index(virt)];
+  if (!(pde & VMM_PRESENT) || (pde & VMM_LARGE)) {
+    return;
+  }
+
+  uint32_t *table = phys_to_virt(pde & VMM_FRAME_MASK);
+  table[vmm_table_index(virt)] = 0;
+  vmm_invlpg(virt);
+}
+
+/** vmm_translate:
+ *  Looks up the physical address a virtual address is mapped to
+ *
+ *  @param virt The virtual address
+ *  @param phys Where to store the physical address
+ *  @return false if the address isn't mapped
+ */
+bool vmm_translate(uint32_t virt, uint32_t *phys) {
+  uint32_t pde = vmm_kernel_directory[vmm_directory_index(virt)];
+  if (!(pde & VMM_PRESENT)) {
+    return false;
+  }
+  if (pde & VMM_LARGE) {
+    *phys = (pde & ~(VMM_LARGE_PAGE_SIZE - 1)) |
+            (virt & (VMM_LARGE_PAGE_SIZE - 1));
+    return true;
+  }
+
+  const uint32_t *table = phys_to_virt(pde & VMM_FRAME_MASK);
+  uint32_t pte = table[vmm_table_index(virt)];
+  if (!(pte & VMM_PRESENT)) {
+    return false;
+  }
+  *phys = (pte & VMM_FRAME_MASK) | (virt & (VMM_PAGE_SIZE - 1));
+  return true;
+}
+
+/** vmm_set_low_identity:
+ *  Identity maps the first 4 MiB, or takes that mapping down again, for code
+ *  that has to keep running while paging is turned on, like the SMP
+ *  trampoline. It shares the direct map's page table, so the legacy video
+ *  window stays unmapped here too.
+ *
+ *  @param mapped Whether the first 4 MiB are mapped
+ */
+void vmm_set_low_identity(bool mapped) {
+  vmm_kernel_directory[0] =
+      mapped ? virt_to_phys(vmm_low_table) | VMM_PRESENT | VMM_WRITABLE : 0;
+  /* the shared entries are global, invlpg of one address isn't enough */
+  vmm_flush_all();
+}
+
+/** vmm_map_mmio:
+ *  Maps a range of device memory into the MMIO window. Mappings are never
+ *  taken down again.
+ *
+ *  @param phys The physical address of the range
+ *  @param size The size of the range in bytes
+ *  @param cache One of the VMM_CACHE_* types
+ *  @return The virtual address of phys, NULL if the window is full
+ */
+void *vmm_map_mmio(uint32_t phys, size_t size, uint32_t cache) {
+  uint32_t offset = phys & (VMM_PAGE_SIZE - 1);
+  uint32_t frame = phys - offset;
+  uint32_t pages = (offset + size + VMM_PAGE_SIZE - 1) >> VMM_PAGE_SHIFT;
+
+  uint32_t flags = interrupts_save();
+
+  if (pages > (VMM_MMIO_BASE + VMM_MMIO_SIZE - vmm_mmio_next) >>
+                  VMM_PAGE_SHIFT) {
+    interrupts_restore(flags);
+    return NULL;
+  }
+
+  uint32_t virt = vmm_mmio_next;
+  vmm_mmio_next += pages << VMM_PAGE_SHIFT;
+
+  for (uint32_t i = 0; i < pages; i++) {
+    uint32_t page = virt + (i << VMM_PAGE_SHIFT);
+    vmm_mmio_table[vmm_table_index(page)] = (frame + (i << VMM_PAGE_SHIFT)) |
+                                            VMM_PRESENT | VMM_WRITABLE |
+                                            cache | vmm_global;
+  }
+
+  interrupts_restore(flags);
+  return (void *)(virt + offset);
+}
@@ -0,0 +1,71 @@
+#ifndef INCLUDE_VMM_H
+#define INCLUDE_VMM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The kernel is linked at KERNEL_VIRTUAL_BASE + 1 MiB. The first
+ * VMM_DIRECT_MAP_SIZE bytes of physical memory are mapped at
+ * KERNEL_VIRTUAL_BASE with 4 MiB pages, and device memory is mapped on demand
+ * in the window above. These must match boot.asm and linker.ld. */
+#define KERNEL_VIRTUAL_BASE 0xC0000000
+#define VMM_DIRECT_MAP_SIZE 0x30000000
+#define VMM_MMIO_BASE (KERNEL_VIRTUAL_BASE + VMM_DIRECT_MAP_SIZE)
+#define VMM_MMIO_SIZE 0x400000
+
+/* Legacy video memory. The direct map leaves it out, so the only mapping of
+ * it is the one vmm_map_mmio makes, with the memory type the driver asked
+ * for; mapping a page with two memory types is undefined. */
+#define VMM_LEGACY_VIDEO_BASE 0xA0000
+#define VMM_LEGACY_VIDEO_END 0xC0000
+
+#define VMM_PAGE_SHIFT 12
+#define VMM_PAGE_SIZE (1 << VMM_PAGE_SHIFT)
+#define VMM_LARGE_PAGE_SHIFT 22
+#define VMM_LARGE_PAGE_SIZE (1 << VMM_LARGE_PAGE_SHIFT)
+#define VMM_ENTRIES 1024
+
+/* Page directory and page table entry bits */
+#define VMM_PRESENT 0x001
+#define VMM_WRITABLE 0x002
+#define VMM_USER 0x004
+#define VMM_WRITE_THROUGH 0x008
+#define VMM_CACHE_DISABLE 0x010
+#define VMM_LARGE 0x080 /* directory entries only */
+#define VMM_GLOBAL 0x100
+#define VMM_FRAME_MASK 0xfffff000
+
+/* Cache types for vmm_map_mmio. The PAT is set up so that the write through
+ * bit alone selects write combining; without a PAT it means write through. */
+#define VMM_CACHE_WRITE_BACK 0
+#define VMM_CACHE_WRITE_COMBINING VMM_WRITE_THROUGH
+#define VMM_CACHE_UNCACHED (VMM_CACHE_DISABLE | VMM_WRITE_THROUGH)
+
+/** phys_to_virt:
+ *  Returns where a physical address inside the direct map is mapped
+ *
+ *  @param phys The physical address, below VMM_DIRECT_MAP_SIZE
+ */
+static inline void *phys_to_virt(uint32_t phys) {
+  return (void *)(phys + KERNEL_VIRTUAL_BASE);
+}
+
+/** virt_to_phys:
+ *  Returns the physical address of a direct map or kernel image address
+ *
+ *  @param virt The virtual address
+ */
+static inline uint32_t virt_to_phys(const void *virt) {
+  return (uint32_t)virt - KERNEL_VIRTUAL_BASE;
+}
+
+void vmm_initialize(void);
+void vmm_initialize_cpu(void);
+void vmm_set_low_identity(bool mapped);
+bool vmm_map(uint32_t virt, uint32_t phys, uint32_t flags);
+void vmm_unmap(uint32_t virt);
+bool vmm_translate(uint32_t virt, uint32_t *phys);
+void *vmm_map_mmio(uint32_t phys, size_t size, uint32_t cache);
+
+#endif /* INCLUDE_VMM_H */